@@ -1,6 +1,9 @@
 #include <iostream>
 #include <getopt.h>
 #include <processor.h>
+#include <benchmark.h>
+#include <bulkimport.h>
+#include <replica.h>
 #include <stdlib.h>
 
 using namespace jsonrpc;
@@ -14,13 +17,31 @@ static struct option long_options[] =
         {"db", required_argument, nullptr, 'd'},
         {"log", required_argument, nullptr, 'l'},
         {"regtest", no_argument, nullptr, 'r'},
+        {"connections", required_argument, nullptr, 'c'},
+        {"rawblocks", no_argument, nullptr, 'b'},
+        {"prefetch", required_argument, nullptr, 'f'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"dbcache", required_argument, nullptr, 'm'},
+        {"socket", required_argument, nullptr, 's'},
+        {"poolmin", required_argument, nullptr, 'n'},
+        {"poolmax", required_argument, nullptr, 'x'},
+        {"bench", no_argument, nullptr, 'e'},
+        {"migrate", no_argument, nullptr, 'g'},
+        {"dbprofile", required_argument, nullptr, 'o'},
+        {"bloombits", required_argument, nullptr, 'y'},
+        {"snappy", no_argument, nullptr, 'z'},
+        {"import", required_argument, nullptr, 'i'},
+        {"balancecache", required_argument, nullptr, 'a'},
+        {"sync", required_argument, nullptr, 'q'},
+        {"snapshot", required_argument, nullptr, 'j'},
+        {"replica", required_argument, nullptr, 'v'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, 0, nullptr, 0}
     };
 
 static void print_usage()
 {
-    printf("Usage: test (-u|-user <RpcConnectionLogin>) (-p|-pass <RpcConnectionPassword>) (-d|-db <DatabaseLocation>) (-l|-log <LogVerbosity [0-6]>)(-k|-key <XpubKey>) (-r[--regtest]) \n\n");
+    printf("Usage: test (-u|-user <RpcConnectionLogin>) (-p|-pass <RpcConnectionPassword>) (-d|-db <DatabaseLocation>) (-l|-log <LogVerbosity [0-6]>)(-k|-key <XpubKey>) (-r[--regtest]) (-c|-connections <RpcConnections, default 4>) (-b[--rawblocks]) (-f|-prefetch <BlocksInFlight, default 128>) (-w|-workers <DecodeThreads, default all cores>) (-m|-dbcache <UtxoCacheMB, default 100>) (-s|-socket <UnixSocketPath>) (-n|-poolmin <PoolLowWatermark, default 100>) (-x|-poolmax <PoolHighWatermark, default 1000>) (-e[--bench]) (-g[--migrate]) (-o|-dbprofile <balanced|lookup|compact, default balanced>) (-y|-bloombits <BloomBitsPerKey, 0 disables>) (-z[--snappy]) (-i|-import <AddressListFile, into a fresh database>) (-a|-balancecache <BalanceCacheMB, default 16, 0 disables>) (-q|-sync <never|scan|always, default scan>) (-j|-snapshot <BalanceSnapshotFile, rewritten after each 60 s scan cycle that changed addresses, balances or the cursor>) (-v|-replica <BalanceSnapshotFile, serve it read-only on -socket>) \n\n");
     printf("After executing the daemon, go to /tmp/, cat testpipeout, and echo commands to testpipein. \n");
     printf("Available commands are: GenerateAddress (this will generate new Bitcoin address from passed XPUB on daemon start), \"GetBalance Address\" (this will return address balance from DB, if it was already updated! Quotes needed!) \n\n");
     printf("Examples: \n");
@@ -44,6 +65,16 @@ int main(int argc, char* argv[])
     int opt = 0;
 
     StartUpParameters parameters;
+    bool RunBenchmark = false;
+    bool RunMigration = false;
+    std::string ImportFile;
+    std::string ReplicaSnapshot;
+
+    //Applied on top of the profile whatever the argument order
+    int BloomBits = -1;
+    int BalanceCacheMB = -1;
+    bool UseSnappy = false;
+    std::string SyncPolicy;
 
 //    parameters.DatabaseLocation = "/tmp/";
 //    parameters.CurlEndpoint = "http://127.0.0.1:8332";
@@ -52,7 +83,7 @@ int main(int argc, char* argv[])
 //    parameters.XpubAddress = "xpub6CUGRUonZSQ4TWtTMmzXdrXDtypWKiKrhko4egpiMZbpiaQL2jkwSB1icqYh2cfDfVxdx4df189oLKnC5fSwqPfgyP3hooxujYzAu3fDVmz";
 
     /* get arguments */
-    while ((opt = getopt_long_only(argc, argv, "u:p:k:d:r", long_options, &long_index)) != -1)
+    while ((opt = getopt_long_only(argc, argv, "u:p:k:d:rc:bf:w:m:s:n:x:ego:y:zi:a:q:j:v:", long_options, &long_index)) != -1)
     {
         switch (opt) {
         case 'h':
@@ -73,6 +104,64 @@ int main(int argc, char* argv[])
         case 'r':
             parameters.IsRegtest = true;
             break;
+        case 'c':
+            parameters.RpcConnections = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'b':
+            parameters.UseRawBlocks = true;
+            break;
+        case 'f':
+            parameters.PrefetchBlocks = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'w':
+            parameters.DecodeThreads = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'm':
+            parameters.DbCacheMB = static_cast<size_t>(atoi(optarg));
+            break;
+        case 's':
+            parameters.SocketPath = optarg;
+            break;
+        case 'n':
+            parameters.PoolLowWatermark = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'x':
+            parameters.PoolHighWatermark = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'e':
+            RunBenchmark = true;
+            break;
+        case 'g':
+            RunMigration = true;
+            break;
+        case 'o':
+            if(!StorageProfile::FromName(optarg, parameters.Storage))
+            {
+                printf("Unknown storage profile: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'y':
+            BloomBits = atoi(optarg);
+            break;
+        case 'z':
+            UseSnappy = true;
+            break;
+        case 'i':
+            ImportFile = optarg;
+            break;
+        case 'a':
+            BalanceCacheMB = atoi(optarg);
+            break;
+        case 'q':
+            SyncPolicy = optarg;
+            break;
+        case 'j':
+            parameters.SnapshotPath = optarg;
+            break;
+        case 'v':
+            ReplicaSnapshot = optarg;
+            break;
         case 'l':
             ConfigureLoggerSeverity((plog::Severity)atoi(optarg));
             break;
@@ -82,6 +171,61 @@ int main(int argc, char* argv[])
         }
     }
 
+    if(BloomBits >= 0) parameters.Storage.BloomBitsPerKey = BloomBits;
+    if(UseSnappy) parameters.Storage.Compression = true;
+    if(BalanceCacheMB >= 0) parameters.Storage.BalanceCacheMB = static_cast<size_t>(BalanceCacheMB);
+
+    if(!SyncPolicy.empty() && !CommitSyncFromName(SyncPolicy, parameters.Storage.Sync))
+    {
+        printf("Unknown sync policy: %s\n", SyncPolicy.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    if(RunBenchmark)
+    {
+        RunBenchmarks(parameters.IsRegtest, parameters.XpubAddress);
+        btc_ecc_stop();
+        return 0;
+    }
+
+    //Converts the database to the current schema in the foreground and exits, the daemon is not started
+    if(RunMigration)
+    {
+        DBStorage Storage(parameters.DatabaseLocation, parameters.Storage, parameters.IsRegtest ? &btc_chainparams_regtest : &btc_chainparams_main);
+        const bool Migrated = Storage.Migrate();
+
+        printf("Database migration %s, see db.log\n", Migrated ? "done" : "failed");
+        btc_ecc_stop();
+        return Migrated ? 0 : EXIT_FAILURE;
+    }
+
+    //Builds a fresh database from an address list, one "<address> [birth height]" per line, and exits
+    if(!ImportFile.empty())
+    {
+        BulkImport Import(parameters.DatabaseLocation, parameters.Storage, parameters.IsRegtest ? &btc_chainparams_regtest : &btc_chainparams_main);
+        const bool Imported = Import.Run(ImportFile);
+
+        printf("Imported %zu addresses, %zu duplicates, %zu invalid lines: %s, see db.log\n", Import.GetStats().Imported, Import.GetStats().Duplicates,
+               Import.GetStats().Invalid, Imported ? "done" : "failed");
+        btc_ecc_stop();
+        return Imported ? 0 : EXIT_FAILURE;
+    }
+
+    //Query process in the foreground, needs neither bitcoind nor the database
+    if(!ReplicaSnapshot.empty())
+    {
+        if(parameters.SocketPath.empty())
+        {
+            printf("A replica answers on -socket only, none given.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        Replica Query(ReplicaSnapshot, parameters.SocketPath, parameters.IsRegtest ? &btc_chainparams_regtest : &btc_chainparams_main);
+
+        btc_ecc_stop();
+        return 0;
+    }
+
     if(parameters.RpcLogin.size() == 0 || parameters.RpcPassword.size() == 0)
     {
         printf("No PRC login or password, exitting.");
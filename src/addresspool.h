@@ -0,0 +1,243 @@
+#ifndef ADDRESSPOOL_H
+#define ADDRESSPOOL_H
+
+#include <irunnable.h>
+#include <dbstorage.h>
+#include <blockscanner.h>
+#include <htttpcommunication.h>
+#include <watchset.h>
+#include <hdderiver.h>
+
+#include <btc/chainparams.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <loggerinstances.h>
+
+// Addresses derived, stored, watched and imported into bitcoind ahead of time, so GenerateAddress only pops one.
+// A background thread tops the pool up to the high watermark whenever it drops below the low one,
+// one batch of derivations, one database write and one batched importaddress call per refill.
+// The next index to hand out is persisted, addresses pooled but not handed out are reused after a restart.
+class AddressPool : public IRunnable
+{
+public:
+
+    AddressPool(DBStorage *Storage, HttpCommunication *Http, WatchSet *Watch, BlockScanner *Scanner, const btc_chainparams *Chain,
+                const std::string &XpubAddress, size_t LowWatermark = 100, size_t HighWatermark = 1000)
+        : m_DBStorage(Storage),
+          m_HttpCommunication(Http),
+          m_WatchSet(Watch),
+          m_BlockScanner(Scanner),
+          m_Deriver(Chain, XpubAddress),
+          m_LowWatermark(LowWatermark),
+          m_HighWatermark(std::max(HighWatermark, LowWatermark + 1))
+    {
+        //Databases from before the pool never stored the index, everything already stored there was handed out
+        m_Legacy = !m_DBStorage->GetHdIndex(m_NextIndex);
+
+        PLOG_ERROR_IF_(MainLogger, !m_Deriver.IsValid()) << "Invalid xpub, no addresses can be generated";
+
+        IRunnable::Start();
+    }
+
+    ~AddressPool() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+            m_Stopping = true;
+        }
+
+        m_RefillCondition.notify_all();
+        IRunnable::WaitForCompletion();
+    }
+
+    // Hands out the next pooled address. Waits for a refill only when the pool ran dry, false if none came.
+    bool Pop(std::string &Address)
+    {
+        PooledAddress Next;
+
+        {
+            std::unique_lock<std::mutex> lock(m_Guard);
+
+            if(m_Addresses.empty())
+            {
+                PLOG_WARNING_(MainLogger) << "Address pool is empty, waiting for a refill";
+
+                m_RefillCondition.notify_all();
+                m_ReadyCondition.wait_for(lock, MaxPopWait, [this] { return !m_Addresses.empty() || m_Stopping; });
+
+                if(m_Addresses.empty())
+                {
+                    return false;
+                }
+            }
+
+            Next = std::move(m_Addresses.front());
+            m_Addresses.pop_front();
+
+            if(m_Addresses.size() < m_LowWatermark)
+            {
+                m_RefillCondition.notify_all();
+            }
+        }
+
+        //Single consumer, the index only moves forward
+        m_DBStorage->UpdateHdIndex(Next.Index + 1);
+        Address = std::move(Next.Address);
+
+        return true;
+    }
+
+    size_t Size() const
+    {
+        std::lock_guard<std::mutex> lock(m_Guard);
+        return m_Addresses.size();
+    }
+
+    void Run() override
+    {
+        while(true)
+        {
+            size_t Missing = 0;
+
+            {
+                std::unique_lock<std::mutex> lock(m_Guard);
+                m_RefillCondition.wait(lock, [this] { return m_Stopping || m_Addresses.size() < m_LowWatermark; });
+
+                if(m_Stopping)
+                {
+                    return;
+                }
+
+                Missing = m_HighWatermark - m_Addresses.size();
+            }
+
+            if(!Refill(Missing))
+            {
+                //bitcoind or the database is unavailable, retry without spinning
+                std::unique_lock<std::mutex> lock(m_Guard);
+                m_RefillCondition.wait_for(lock, RetryDelay, [this] { return m_Stopping; });
+            }
+        }
+    }
+
+private:
+
+    struct PooledAddress
+    {
+        uint32_t Index = 0;
+        std::string Address;
+        Hash160Key Hash160;
+    };
+
+    static constexpr std::chrono::seconds MaxPopWait{5};
+    static constexpr std::chrono::seconds RetryDelay{5};
+
+    // Derives, stores and imports up to Count addresses after the last pooled one
+    bool Refill(size_t Count)
+    {
+        const auto Started = std::chrono::steady_clock::now();
+
+        std::vector<HdDeriver::DerivedAddress> Derived;
+
+        //One thread, the refill runs beside the block scanner
+        if(!m_Deriver.DeriveRange(m_NextIndex, static_cast<uint32_t>(Count), Derived, 1))
+        {
+            PLOG_ERROR_(MainLogger) << "Failed to derive addresses m/" << m_NextIndex << " .. m/" << m_NextIndex + Count - 1;
+            return false;
+        }
+
+        std::vector<PooledAddress> Batch;
+        std::vector<std::string> Addresses;
+
+        for(auto &Child : Derived)
+        {
+            Addresses.push_back(Child.Address);
+            Batch.push_back({Child.Index, std::move(Child.Address), Child.Hash160});
+        }
+
+        //Addresses stored already were pooled before a restart: imported and stored, only the watch set is missing
+        std::vector<TxInfo> Infos;
+        std::vector<char> Stored;
+        m_DBStorage->GetTxInfos(Addresses, Infos, Stored);
+
+        std::vector<std::string> NewAddresses;
+        std::vector<Hash160Key> NewHashes;
+
+        for(size_t Index = 0; Index < Batch.size(); ++Index)
+        {
+            if(Stored[Index])
+            {
+                m_WatchSet->Add(Batch[Index].Hash160, Batch[Index].Address);
+                continue;
+            }
+
+            NewAddresses.push_back(Batch[Index].Address);
+            NewHashes.push_back(Batch[Index].Hash160);
+        }
+
+        //Stored and watched in step with the scanner, as WatchRange does
+        if(!NewAddresses.empty())
+        {
+            int BirthHeight = 0;
+
+            if(!m_HttpCommunication->GetCurrentBlockChainInfo(BirthHeight) || !m_HttpCommunication->AddNewAddresses(NewAddresses, false) ||
+               !m_BlockScanner->AddNewAddresses(NewAddresses, NewHashes, BirthHeight))
+            {
+                PLOG_ERROR_(MainLogger) << "Failed to register " << NewAddresses.size() << " pooled addresses";
+                return false;
+            }
+        }
+
+        m_NextIndex += static_cast<uint32_t>(Batch.size());
+
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+
+            for(size_t Index = 0; Index < Batch.size(); ++Index)
+            {
+                //A legacy database handed its stored addresses out already, they must not be given twice
+                if(m_Legacy && Stored[Index]) continue;
+
+                m_Addresses.push_back(std::move(Batch[Index]));
+            }
+
+            m_Legacy = m_Legacy && m_Addresses.empty();
+        }
+
+        m_ReadyCondition.notify_all();
+
+        PLOG_VERBOSE_(MainLogger) << "Address pool refilled with " << Batch.size() << " addresses (" << NewAddresses.size() << " new) in "
+                                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Started).count() << " ms";
+
+        return true;
+    }
+
+private:
+
+    DBStorage *m_DBStorage = nullptr;
+    HttpCommunication *m_HttpCommunication = nullptr;
+    WatchSet *m_WatchSet = nullptr;
+    BlockScanner *m_BlockScanner = nullptr;
+    HdDeriver m_Deriver;
+
+    size_t m_LowWatermark = 0;
+    size_t m_HighWatermark = 0;
+
+    // Owned by the refill thread: index of the next address to derive
+    uint32_t m_NextIndex = 0;
+    bool m_Legacy = false;
+
+    std::deque<PooledAddress> m_Addresses;
+    bool m_Stopping = false;
+    mutable std::mutex m_Guard;
+    std::condition_variable m_RefillCondition, m_ReadyCondition;
+};
+
+#endif // ADDRESSPOOL_H
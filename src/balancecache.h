@@ -0,0 +1,213 @@
+#ifndef BALANCECACHE_H
+#define BALANCECACHE_H
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Address records by binary key, with whether a backfill is pending for them: everything a balance
+// query needs besides the cursor. Size bounded, evicted with CLOCK, split in shards with a lock each.
+//
+// Entries carry the commit sequence their value was written at and stay current until the next write
+// of the key replaces them, so a reader pinned at an older commit only takes entries not newer than it.
+// Loads are read-through by the caller: Find misses, the caller reads its snapshot and hands the record
+// to Insert with the snapshot's sequence. Writers refresh cached entries after their batch is written and
+// mark the shard with the commit sequence; a load from a snapshot older than the last write to its shard
+// might be outdated and is dropped.
+template<typename Record>
+class BalanceCache
+{
+public:
+
+    struct Stats
+    {
+        uint64_t Hits = 0;
+        uint64_t Misses = 0;
+        uint64_t Evictions = 0;
+        size_t Entries = 0;
+        size_t Capacity = 0;
+    };
+
+    explicit BalanceCache(size_t BudgetMB = 16)
+    {
+        const size_t PerShard = BudgetMB * 1048576 / EntryBytes / ShardCount;
+
+        for(auto &Shard : m_Shards)
+        {
+            Shard.Capacity = PerShard;
+            Shard.Slots.reserve(PerShard);
+            Shard.Index.reserve(PerShard);
+        }
+    }
+
+    bool Find(const std::string &Key, uint64_t MaxSequence, Record &Found, bool &Backfilling)
+    {
+        Shard &Target = ShardOf(Key);
+        std::lock_guard<std::mutex> Lock(Target.Mutex);
+
+        auto Entry = Target.Index.find(Key);
+
+        if(Entry == Target.Index.end() || Target.Slots[Entry->second].Sequence > MaxSequence)
+        {
+            Target.Misses++;
+            return false;
+        }
+
+        Slot &Cached = Target.Slots[Entry->second];
+        Cached.Referenced = true;
+        Found = Cached.Value;
+        Backfilling = Cached.Backfilling;
+
+        Target.Hits++;
+        return true;
+    }
+
+    void Insert(const std::string &Key, const Record &Value, bool Backfilling, uint64_t LoadSequence)
+    {
+        Shard &Target = ShardOf(Key);
+        std::lock_guard<std::mutex> Lock(Target.Mutex);
+
+        if(LoadSequence < Target.WrittenSequence || Target.Capacity == 0 || Target.Index.count(Key))
+        {
+            return;
+        }
+
+        uint32_t Position;
+
+        if(Target.Slots.size() < Target.Capacity)
+        {
+            Position = static_cast<uint32_t>(Target.Slots.size());
+            Target.Slots.emplace_back();
+        }
+        else
+        {
+            //Second chance: referenced entries lose their bit and survive one more turn of the hand
+            while(Target.Slots[Target.Hand].Referenced)
+            {
+                Target.Slots[Target.Hand].Referenced = false;
+                Target.Hand = (Target.Hand + 1) % Target.Slots.size();
+            }
+
+            Position = static_cast<uint32_t>(Target.Hand);
+            Target.Hand = (Target.Hand + 1) % Target.Slots.size();
+            Target.Index.erase(Target.Slots[Position].Key);
+            Target.Evictions++;
+        }
+
+        Slot &Cached = Target.Slots[Position];
+        Cached.Key = Key;
+        Cached.Value = Value;
+        Cached.Backfilling = Backfilling;
+        Cached.Referenced = false;
+        Cached.Sequence = LoadSequence;
+
+        Target.Index.emplace(Key, Position);
+    }
+
+    // After a write of the record at commit Sequence, whether it is cached or not
+    void Update(const std::string &Key, const Record &Value, uint64_t Sequence)
+    {
+        Shard &Target = ShardOf(Key);
+        std::lock_guard<std::mutex> Lock(Target.Mutex);
+
+        Target.WrittenSequence = Sequence;
+
+        auto Entry = Target.Index.find(Key);
+
+        if(Entry != Target.Index.end())
+        {
+            Target.Slots[Entry->second].Value = Value;
+            Target.Slots[Entry->second].Sequence = Sequence;
+        }
+    }
+
+    // After a backfill record of the address was written or erased
+    void UpdateBackfill(const std::string &Key, bool Backfilling, uint64_t Sequence)
+    {
+        Shard &Target = ShardOf(Key);
+        std::lock_guard<std::mutex> Lock(Target.Mutex);
+
+        Target.WrittenSequence = Sequence;
+
+        auto Entry = Target.Index.find(Key);
+
+        if(Entry != Target.Index.end())
+        {
+            Target.Slots[Entry->second].Backfilling = Backfilling;
+            Target.Slots[Entry->second].Sequence = Sequence;
+        }
+    }
+
+    // Everything changed at Sequence
+    void Clear(uint64_t Sequence)
+    {
+        for(auto &Target : m_Shards)
+        {
+            std::lock_guard<std::mutex> Lock(Target.Mutex);
+
+            Target.WrittenSequence = Sequence;
+            Target.Slots.clear();
+            Target.Index.clear();
+            Target.Hand = 0;
+        }
+    }
+
+    Stats GetStats()
+    {
+        Stats Total;
+
+        for(auto &Target : m_Shards)
+        {
+            std::lock_guard<std::mutex> Lock(Target.Mutex);
+
+            Total.Hits += Target.Hits;
+            Total.Misses += Target.Misses;
+            Total.Evictions += Target.Evictions;
+            Total.Entries += Target.Slots.size();
+            Total.Capacity += Target.Capacity;
+        }
+
+        return Total;
+    }
+
+private:
+
+    static constexpr size_t ShardCount = 16;
+
+    // Slot, index node and a heap allocated key, roughly
+    static constexpr size_t EntryBytes = 160;
+
+    struct Slot
+    {
+        std::string Key;
+        Record Value;
+        bool Backfilling = false;
+        bool Referenced = false;
+        uint64_t Sequence = 0;
+    };
+
+    struct Shard
+    {
+        std::mutex Mutex;
+        std::vector<Slot> Slots;
+        std::unordered_map<std::string, uint32_t> Index;
+        size_t Capacity = 0;
+        size_t Hand = 0;
+        uint64_t WrittenSequence = 0;
+        uint64_t Hits = 0;
+        uint64_t Misses = 0;
+        uint64_t Evictions = 0;
+    };
+
+    Shard &ShardOf(const std::string &Key)
+    {
+        return m_Shards[std::hash<std::string>()(Key) % ShardCount];
+    }
+
+    Shard m_Shards[ShardCount];
+};
+
+#endif // BALANCECACHE_H
@@ -0,0 +1,340 @@
+#ifndef BALANCESNAPSHOT_H
+#define BALANCESNAPSHOT_H
+
+#include <dbstorage.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <loggerinstances.h>
+
+// Immutable file of every address record of one committed view, for query processes which map it
+// read-only instead of opening the database. The daemon writes a new file next to the current one and
+// renames it over it, readers see the old or the new file whole and switch on their own schedule.
+//
+// Layout, native byte order (the file never leaves the machine):
+//   SnapshotHeader                        128 bytes
+//   uint64 Prefix[Count + 1]              first 8 key bytes big-endian, slot 0 unused, at offset 128
+//   SnapshotRecord Records[Count + 1]     at RecordsOffset, slot 0 unused
+// Both arrays are in Eytzinger (BFS) order: the children of slot k are 2k and 2k+1. A search walks the
+// prefixes top-down without branches, the first levels stay in cache and each step prefetches the
+// line holding the next three levels.
+
+static const char SNAPSHOT_MAGIC[8] = { 'B', 'A', 'L', 'S', 'N', 'A', 'P', '\0' };
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+// Binary address keys padded with zeros, the type byte tells the real length
+static constexpr size_t SNAPSHOT_KEY_SIZE = 33;
+
+struct SnapshotHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t RecordSize;
+    uint64_t Count;
+    uint64_t RecordsOffset;
+
+    // Commit the records were read at and its cursor
+    uint64_t Sequence;
+    int32_t CursorHeight;
+    int32_t HasCursor;
+    int64_t CreatedAt;
+
+    char Reserved[72];
+};
+
+struct SnapshotRecord
+{
+    int64_t Balance;
+    int32_t BirthHeight;
+    uint8_t Backfilling;
+    uint8_t Key[SNAPSHOT_KEY_SIZE];
+    uint8_t Padding[2];
+};
+
+static_assert(sizeof (SnapshotHeader) == 128, "snapshot header layout");
+static_assert(sizeof (SnapshotRecord) == 48, "snapshot record layout");
+
+class BalanceSnapshot
+{
+public:
+
+    ~BalanceSnapshot()
+    {
+        if(m_Data) munmap(m_Data, m_Size);
+    }
+
+    // Maps the file, the descriptor is closed right away; the mapping survives a rename over the file
+    static std::shared_ptr<const BalanceSnapshot> Open(const std::string &Path)
+    {
+        const int FileDescriptor = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if(FileDescriptor < 0)
+        {
+            return nullptr;
+        }
+
+        struct stat Info;
+        std::shared_ptr<BalanceSnapshot> Snapshot(new BalanceSnapshot());
+
+        if(fstat(FileDescriptor, &Info) == 0 && static_cast<size_t>(Info.st_size) >= sizeof (SnapshotHeader))
+        {
+            void *Data = mmap(nullptr, Info.st_size, PROT_READ, MAP_SHARED, FileDescriptor, 0);
+
+            if(Data != MAP_FAILED)
+            {
+                Snapshot->m_Data = static_cast<uint8_t*>(Data);
+                Snapshot->m_Size = Info.st_size;
+                Snapshot->m_Inode = Info.st_ino;
+            }
+        }
+
+        close(FileDescriptor);
+
+        return Snapshot->m_Data && Snapshot->Validate() ? Snapshot : nullptr;
+    }
+
+    // Lookups touch the mapping only, no system call
+    bool Find(const std::string &Key, SnapshotRecord &Record) const
+    {
+        uint8_t Target[SNAPSHOT_KEY_SIZE] = {0};
+
+        if(Key.empty() || Key.size() > SNAPSHOT_KEY_SIZE)
+        {
+            return false;
+        }
+
+        memcpy(Target, Key.data(), Key.size());
+
+        const uint64_t TargetPrefix = PrefixOf(Target);
+        const uint64_t Count = m_Header->Count;
+        uint64_t Slot = 1;
+
+        while(Slot <= Count)
+        {
+            __builtin_prefetch(m_Prefixes + Slot * 8);
+
+            const bool Less = m_Prefixes[Slot] < TargetPrefix ||
+                              (m_Prefixes[Slot] == TargetPrefix && memcmp(m_Records[Slot].Key, Target, SNAPSHOT_KEY_SIZE) < 0);
+
+            Slot = 2 * Slot + Less;
+        }
+
+        //Undo the right turns taken after the last left one: that left turn was at the lower bound
+        Slot >>= __builtin_ffsll(~Slot);
+
+        if(Slot == 0 || memcmp(m_Records[Slot].Key, Target, SNAPSHOT_KEY_SIZE) != 0)
+        {
+            return false;
+        }
+
+        Record = m_Records[Slot];
+        return true;
+    }
+
+    const SnapshotHeader &GetHeader() const
+    {
+        return *m_Header;
+    }
+
+    // Last block the balances include, -1 before the first scan
+    int GetHeight() const
+    {
+        return m_Header->HasCursor ? m_Header->CursorHeight - 1 : -1;
+    }
+
+    ino_t GetInode() const
+    {
+        return m_Inode;
+    }
+
+    // Writes every address record of View to Path: built in Path.tmp, synced and renamed over Path.
+    // The records are sorted already, LevelDB hands them out in key order.
+    static bool Publish(const DBStorage &Storage, const DBView &View, const std::string &Path)
+    {
+        std::vector<SnapshotRecord> Sorted;
+        std::unique_ptr<leveldb::Iterator> it = Storage.GetDbIterator(&View);
+
+        for(it->SeekToFirst(); it->Valid() && IsAddressKey(it->key()); it->Next())
+        {
+            TxInfo Info;
+
+            if(it->key().size() > SNAPSHOT_KEY_SIZE || !Info.Deserialize(it->value()))
+            {
+                continue;
+            }
+
+            SnapshotRecord Record;
+            memset(&Record, 0, sizeof (Record));
+            memcpy(Record.Key, it->key().data(), it->key().size());
+            Record.Balance = Info.m_Balance;
+            Record.BirthHeight = Info.m_BirthHeight;
+
+            Sorted.push_back(Record);
+        }
+
+        //Backfill keys are in the same order as the address keys they carry
+        size_t Position = 0;
+
+        for(it->Seek(BACKFILL_KEY_PREFIX); it->Valid() && it->key().starts_with(BACKFILL_KEY_PREFIX); it->Next())
+        {
+            uint8_t Key[SNAPSHOT_KEY_SIZE] = {0};
+            const size_t KeySize = it->key().size() - BACKFILL_KEY_PREFIX.size();
+
+            if(KeySize > SNAPSHOT_KEY_SIZE)
+            {
+                continue;
+            }
+
+            memcpy(Key, it->key().data() + BACKFILL_KEY_PREFIX.size(), KeySize);
+
+            while(Position < Sorted.size() && memcmp(Sorted[Position].Key, Key, SNAPSHOT_KEY_SIZE) < 0)
+            {
+                Position++;
+            }
+
+            if(Position < Sorted.size() && memcmp(Sorted[Position].Key, Key, SNAPSHOT_KEY_SIZE) == 0)
+            {
+                Sorted[Position].Backfilling = 1;
+            }
+        }
+
+        const std::string TempPath = Path + ".tmp";
+        const uint64_t Count = Sorted.size();
+        const uint64_t RecordsOffset = AlignLine(sizeof (SnapshotHeader) + (Count + 1) * sizeof (uint64_t));
+        const size_t Size = RecordsOffset + (Count + 1) * sizeof (SnapshotRecord);
+
+        const int FileDescriptor = open(TempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if(FileDescriptor < 0 || ftruncate(FileDescriptor, Size) != 0)
+        {
+            PLOG_ERROR_(DBLogger) << "Cannot create balance snapshot " << TempPath << ": " << strerror(errno);
+            if(FileDescriptor >= 0) close(FileDescriptor);
+            return false;
+        }
+
+        void *Data = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+
+        if(Data == MAP_FAILED)
+        {
+            PLOG_ERROR_(DBLogger) << "Cannot map balance snapshot " << TempPath << ": " << strerror(errno);
+            close(FileDescriptor);
+            return false;
+        }
+
+        uint8_t *Bytes = static_cast<uint8_t*>(Data);
+        SnapshotHeader *Header = reinterpret_cast<SnapshotHeader*>(Bytes);
+        uint64_t *Prefixes = reinterpret_cast<uint64_t*>(Bytes + sizeof (SnapshotHeader));
+        SnapshotRecord *Records = reinterpret_cast<SnapshotRecord*>(Bytes + RecordsOffset);
+
+        memset(Header, 0, sizeof (SnapshotHeader));
+        memcpy(Header->Magic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC));
+        Header->Version = SNAPSHOT_VERSION;
+        Header->RecordSize = sizeof (SnapshotRecord);
+        Header->Count = Count;
+        Header->RecordsOffset = RecordsOffset;
+        Header->Sequence = View.m_Sequence;
+        Header->CursorHeight = View.m_Cursor.m_Height;
+        Header->HasCursor = View.m_HasCursor;
+        Header->CreatedAt = time(nullptr);
+
+        //In-order walk of the implicit tree hands out the sorted records one by one
+        size_t Next = 0;
+        std::vector<uint64_t> Parents;
+        uint64_t Slot = 1;
+
+        while(Slot <= Count || !Parents.empty())
+        {
+            if(Slot <= Count)
+            {
+                Parents.push_back(Slot);
+                Slot *= 2;
+                continue;
+            }
+
+            Slot = Parents.back();
+            Parents.pop_back();
+
+            Records[Slot] = Sorted[Next++];
+            Prefixes[Slot] = PrefixOf(Records[Slot].Key);
+
+            Slot = 2 * Slot + 1;
+        }
+
+        const bool Synced = msync(Data, Size, MS_SYNC) == 0;
+
+        munmap(Data, Size);
+        close(FileDescriptor);
+
+        if(!Synced || rename(TempPath.c_str(), Path.c_str()) != 0)
+        {
+            PLOG_ERROR_(DBLogger) << "Cannot publish balance snapshot " << Path << ": " << strerror(errno);
+            unlink(TempPath.c_str());
+            return false;
+        }
+
+        PLOG_VERBOSE_(DBLogger) << "Balance snapshot published at block " << View.m_Cursor.m_Height << ", addresses: " << Count << ", bytes: " << Size;
+
+        return true;
+    }
+
+private:
+
+    BalanceSnapshot() = default;
+
+    static uint64_t AlignLine(uint64_t Offset)
+    {
+        return (Offset + 63) & ~static_cast<uint64_t>(63);
+    }
+
+    static uint64_t PrefixOf(const uint8_t *Key)
+    {
+        uint64_t Prefix = 0;
+
+        for(int Byte = 0; Byte < 8; ++Byte)
+        {
+            Prefix = (Prefix << 8) | Key[Byte];
+        }
+
+        return Prefix;
+    }
+
+    bool Validate()
+    {
+        m_Header = reinterpret_cast<const SnapshotHeader*>(m_Data);
+
+        if(memcmp(m_Header->Magic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC)) != 0 || m_Header->Version != SNAPSHOT_VERSION ||
+           m_Header->RecordSize != sizeof (SnapshotRecord) || m_Header->Count > m_Size / sizeof (SnapshotRecord) ||
+           m_Header->RecordsOffset != AlignLine(sizeof (SnapshotHeader) + (m_Header->Count + 1) * sizeof (uint64_t)) ||
+           m_Size < m_Header->RecordsOffset + (m_Header->Count + 1) * sizeof (SnapshotRecord))
+        {
+            return false;
+        }
+
+        m_Prefixes = reinterpret_cast<const uint64_t*>(m_Data + sizeof (SnapshotHeader));
+        m_Records = reinterpret_cast<const SnapshotRecord*>(m_Data + m_Header->RecordsOffset);
+
+        return true;
+    }
+
+    uint8_t *m_Data = nullptr;
+    size_t m_Size = 0;
+    ino_t m_Inode = 0;
+
+    const SnapshotHeader *m_Header = nullptr;
+    const uint64_t *m_Prefixes = nullptr;
+    const SnapshotRecord *m_Records = nullptr;
+};
+
+#endif // BALANCESNAPSHOT_H
@@ -0,0 +1,201 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <hdderiver.h>
+#include <hash160.h>
+
+#include <btc/bip32.h>
+#include <btc/chainparams.h>
+#include <btc/tool.h>
+
+#include <stdio.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Micro benchmarks behind the -bench option, printed to stdout; the daemon is not started.
+
+// BIP32 test vector 1 master, used when no -key is given
+static const std::string BENCH_XPUB = "xpub661MyMwAqRbcFtXgS5sYJABqqG9YLmC4Q1Rdap9gSE8NqtwybGhePY2gZ29ESFjqJoCu1Rupje8YtGqsefD265TMg7usUDFdp6W1EGMcet8";
+
+static constexpr uint32_t BENCH_ADDRESSES = 5000;
+
+// Seconds taken by Body
+static double BenchTime(const std::function<void ()> &Body)
+{
+    const auto Started = std::chrono::steady_clock::now();
+    Body();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - Started).count();
+}
+
+static void PrintBench(const char *Name, uint32_t Count, double Seconds, double Baseline)
+{
+    printf("%-32s %8u addresses %9.3f ms %8.2f us/address %7.2fx\n", Name, Count, Seconds * 1000, Seconds * 1e6 / Count, Baseline / Seconds);
+}
+
+// The string round trip GenerateAddress used before HdDeriver: hd_derive on the xpub string, then decode the child again
+static bool DeriveThroughStrings(const btc_chainparams *Chain, const std::string &Xpub, uint32_t Index, std::string &Address)
+{
+    char DerivedHd[112];
+    char DerivedAddress[35];
+    btc_hdnode Node;
+
+    const std::string KeyPath = "m/" + std::to_string(Index);
+
+    if(!hd_derive(Chain, Xpub.c_str(), KeyPath.c_str(), DerivedHd, sizeof (DerivedHd)) || !btc_hdnode_deserialize(DerivedHd, Chain, &Node))
+    {
+        return false;
+    }
+
+    btc_hdnode_get_p2pkh_address(&Node, Chain, DerivedAddress, sizeof (DerivedAddress));
+    Address = DerivedAddress;
+
+    return true;
+}
+
+static void BenchmarkHdDerivation(const btc_chainparams *Chain, const std::string &Xpub)
+{
+    HdDeriver Deriver(Chain, Xpub);
+
+    if(!Deriver.IsValid())
+    {
+        printf("Invalid xpub: %s\n", Xpub.c_str());
+        return;
+    }
+
+    std::vector<std::string> Expected(BENCH_ADDRESSES), Derived(BENCH_ADDRESSES);
+    bool Failed = false;
+
+    const double Baseline = BenchTime([&]
+    {
+        for(uint32_t Index = 0; Index < BENCH_ADDRESSES; ++Index)
+        {
+            Failed |= !DeriveThroughStrings(Chain, Xpub, Index, Expected[Index]);
+        }
+    });
+
+    const double Direct = BenchTime([&]
+    {
+        Hash160Key Hash160;
+
+        for(uint32_t Index = 0; Index < BENCH_ADDRESSES; ++Index)
+        {
+            Failed |= !Deriver.DeriveAddress(Index, Derived[Index], Hash160);
+        }
+    });
+
+    PrintBench("hd_derive string round trip", BENCH_ADDRESSES, Baseline, Baseline);
+    PrintBench("HdDeriver", BENCH_ADDRESSES, Direct, Baseline);
+
+    printf("Addresses %s\n", !Failed && Expected == Derived ? "match" : "DIFFER");
+}
+
+static void BenchmarkRangeDerivation(const btc_chainparams *Chain, const std::string &Xpub)
+{
+    HdDeriver Deriver(Chain, Xpub);
+    std::vector<HdDeriver::DerivedAddress> Sequential, Parallel;
+    bool Succeed = true;
+
+    const double Baseline = BenchTime([&] { Succeed &= Deriver.DeriveRange(0, 0, BENCH_ADDRESSES, Sequential, 1); });
+    const double AllCores = BenchTime([&] { Succeed &= Deriver.DeriveRange(0, 0, BENCH_ADDRESSES, Parallel); });
+
+    bool Match = Succeed;
+
+    for(uint32_t Index = 0; Match && Index < BENCH_ADDRESSES; ++Index)
+    {
+        Match = Sequential[Index].Address == Parallel[Index].Address && Sequential[Index].Index == Parallel[Index].Index;
+    }
+
+    PrintBench("DeriveRange m/0/i, 1 thread", BENCH_ADDRESSES, Baseline, Baseline);
+    PrintBench("DeriveRange m/0/i, all cores", BENCH_ADDRESSES, AllCores, Baseline);
+
+    printf("Addresses %s\n", Match ? "match" : "DIFFER");
+}
+
+// Every kernel level the CPU has against libbtc's scalar SHA-256 and RIPEMD-160, on derived compressed keys
+static void BenchmarkHash160(const btc_chainparams *Chain, const std::string &Xpub)
+{
+    static constexpr uint32_t Keys = 100000;
+
+    HdDeriver Deriver(Chain, Xpub);
+    std::vector<HdDeriver::DerivedAddress> Derived;
+    bool Match = Deriver.DeriveRange(0, BENCH_ADDRESSES, Derived);
+
+    //The keys themselves do not matter to the hashing, reuse a few thousand real ones
+    btc_hdnode Node;
+    btc_hdnode_deserialize(Xpub.c_str(), Chain, &Node);
+
+    std::vector<uint8_t> PublicKeys(static_cast<size_t>(Keys) * BTC_ECKEY_COMPRESSED_LENGTH);
+
+    for(uint32_t Index = 0; Index < BENCH_ADDRESSES; ++Index)
+    {
+        btc_hdnode Child = Node;
+        btc_hdnode_public_ckd(&Child, Index);
+        memcpy(&PublicKeys[Index * BTC_ECKEY_COMPRESSED_LENGTH], Child.public_key, BTC_ECKEY_COMPRESSED_LENGTH);
+    }
+
+    for(size_t Index = BENCH_ADDRESSES; Index < Keys; ++Index)
+    {
+        memcpy(&PublicKeys[Index * BTC_ECKEY_COMPRESSED_LENGTH], &PublicKeys[(Index % BENCH_ADDRESSES) * BTC_ECKEY_COMPRESSED_LENGTH], BTC_ECKEY_COMPRESSED_LENGTH);
+    }
+
+    std::vector<uint8_t> Expected(Keys * 20), Hashes(Keys * 20);
+
+    const double Baseline = BenchTime([&]
+    {
+        for(uint32_t Index = 0; Index < Keys; ++Index)
+        {
+            uint8_t Sha[SHA256_DIGEST_LENGTH];
+            sha256_Raw(&PublicKeys[Index * BTC_ECKEY_COMPRESSED_LENGTH], BTC_ECKEY_COMPRESSED_LENGTH, Sha);
+            btc_ripemd160(Sha, sizeof (Sha), &Expected[Index * 20]);
+        }
+    });
+
+    PrintBench("hash160 libbtc", Keys, Baseline, Baseline);
+
+    //DeriveRange hashes its keys in batches, it must agree with the scalar hashes too
+    for(uint32_t Index = 0; Match && Index < BENCH_ADDRESSES; ++Index)
+    {
+        Match = memcmp(Derived[Index].Hash160.data(), &Expected[Index * 20], 20) == 0;
+    }
+
+    for(HashLevel Level : {HashLevel::Sse41, HashLevel::Avx2, HashLevel::Avx512})
+    {
+        for(bool UseShaNi : {false, true})
+        {
+            const HashKernels Kernels = GetHashKernels(Level, UseShaNi);
+
+            //Levels the CPU lacks fall back to a lower one already measured
+            if(Kernels.Level != Level || Kernels.ShaNi != UseShaNi)
+            {
+                continue;
+            }
+
+            const double Seconds = BenchTime([&]
+            {
+                Hash160Strided(PublicKeys.data(), BTC_ECKEY_COMPRESSED_LENGTH, BTC_ECKEY_COMPRESSED_LENGTH, Keys,
+                               reinterpret_cast<uint8_t (*)[20]>(Hashes.data()), Kernels);
+            });
+
+            const std::string Name = std::string("hash160 ") + Kernels.Name;
+            PrintBench(Name.c_str(), Keys, Seconds, Baseline);
+
+            Match = Match && Hashes == Expected;
+        }
+    }
+
+    printf("Selected %s, hashes %s\n", GetBestHashKernels().Name, Match ? "match" : "DIFFER");
+}
+
+static void RunBenchmarks(bool IsRegtest, const std::string &Xpub)
+{
+    //The built-in xpub is a mainnet one
+    const btc_chainparams *Chain = (IsRegtest && !Xpub.empty()) ? &btc_chainparams_regtest : &btc_chainparams_main;
+
+    BenchmarkHdDerivation(Chain, Xpub.empty() ? BENCH_XPUB : Xpub);
+    BenchmarkRangeDerivation(Chain, Xpub.empty() ? BENCH_XPUB : Xpub);
+    BenchmarkHash160(Chain, Xpub.empty() ? BENCH_XPUB : Xpub);
+}
+
+#endif // BENCHMARK_H
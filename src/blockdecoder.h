@@ -0,0 +1,451 @@
+#ifndef BLOCKDECODER_H
+#define BLOCKDECODER_H
+
+#include <btc/btc.h>
+#include <btc/buffer.h>
+#include <btc/cstr.h>
+#include <btc/memory.h>
+#include <btc/ripemd160.h>
+#include <btc/script.h>
+#include <btc/serialize.h>
+#include <btc/sha2.h>
+#include <btc/tx.h>
+
+#include <hash160.h>
+#include <loggerinstances.h>
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <string>
+#include <vector>
+
+// Block header is fixed size in the serialized block, transactions follow the tx count varint
+static const size_t BLOCK_HEADER_SIZE = 80;
+
+static inline uint8_t HexNibble(uint8_t Char, uint8_t &Invalid)
+{
+    Invalid |= static_cast<uint8_t>(static_cast<uint8_t>(Char - '0') > 9 && static_cast<uint8_t>((Char | 0x20) - 'a') > 5);
+
+    //'0'-'9' keep the low nibble, letters get 9 added through the 0x40 bit
+    return static_cast<uint8_t>((Char & 0x0F) + (Char >> 6) * 9);
+}
+
+// Hex to binary, 16 characters per SSE2 step with a scalar tail.
+// Invalid characters are collected in one flag and checked once at the end.
+static bool HexToBin(const std::string &Hex, std::vector<uint8_t> &Bin)
+{
+    if(Hex.size() % 2 != 0)
+    {
+        return false;
+    }
+
+    const size_t Size = Hex.size() / 2;
+    const uint8_t *In = reinterpret_cast<const uint8_t*>(Hex.data());
+
+    Bin.resize(Size);
+    uint8_t *Out = Bin.data();
+    uint8_t Invalid = 0;
+    size_t Index = 0;
+
+#if defined(__SSE2__)
+    const __m128i LowMask = _mm_set1_epi8(0x0F), Nine = _mm_set1_epi8(9), Case = _mm_set1_epi8(0x20);
+    __m128i Valid = _mm_set1_epi8(-1);
+
+    for(; Index + 8 <= Size; Index += 8)
+    {
+        const __m128i Chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(In + 2 * Index));
+        const __m128i Lower = _mm_or_si128(Chars, Case);
+
+        const __m128i IsDigit = _mm_and_si128(_mm_cmpgt_epi8(Chars, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(Chars, _mm_set1_epi8('9' + 1)));
+        const __m128i IsLetter = _mm_and_si128(_mm_cmpgt_epi8(Lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(Lower, _mm_set1_epi8('f' + 1)));
+        Valid = _mm_and_si128(Valid, _mm_or_si128(IsDigit, IsLetter));
+
+        const __m128i Nibbles = _mm_add_epi8(_mm_and_si128(Chars, LowMask), _mm_and_si128(IsLetter, Nine));
+
+        //Each 16-bit lane holds (low char nibble, high char nibble), fold them into one byte
+        const __m128i Bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(Nibbles, _mm_set1_epi16(0x00FF)), 4), _mm_srli_epi16(Nibbles, 8));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(Out + Index), _mm_packus_epi16(Bytes, _mm_setzero_si128()));
+    }
+
+    Invalid |= static_cast<uint8_t>(_mm_movemask_epi8(Valid) != 0xFFFF);
+#endif
+
+    for(; Index < Size; ++Index)
+    {
+        Out[Index] = static_cast<uint8_t>((HexNibble(In[2 * Index], Invalid) << 4) | HexNibble(In[2 * Index + 1], Invalid));
+    }
+
+    return Invalid == 0;
+}
+
+// Hashes are shown byte reversed, as bitcoind prints them
+static std::string HashToHex(const uint8_t *Hash)
+{
+    static const char Digits[] = "0123456789abcdef";
+    std::string Hex(64, '0');
+
+    for(size_t Index = 0; Index < 32; ++Index)
+    {
+        Hex[2 * Index] = Digits[Hash[31 - Index] >> 4];
+        Hex[2 * Index + 1] = Digits[Hash[31 - Index] & 0x0F];
+    }
+
+    return Hex;
+}
+
+// Output paying to a 20-byte key hash we are able to watch
+struct DecodedOutput
+{
+    enum btc_tx_out_type Type = BTC_TX_NONSTANDARD;
+    uint8_t Hash160[20];
+    int64_t Value = 0;
+    uint8_t TxId[32];
+    uint32_t Index = 0;
+};
+
+// Previous output referenced by an input, txid in internal byte order
+struct Outpoint
+{
+    uint8_t TxId[32];
+    uint32_t Index = 0;
+};
+
+struct DecodedBlock
+{
+    int Height = 0;
+    bool Failed = false;
+    std::string BlockHash;
+    std::string PrevBlockHash;
+    std::vector<DecodedOutput> Outputs;
+    std::vector<Outpoint> Spends;
+};
+
+// Binary block with the offset of every transaction, so ranges of transactions can be decoded independently
+struct PreparedBlock
+{
+    int Height = 0;
+    std::string PrevBlockHash;
+    std::vector<uint8_t> Bytes;
+    std::vector<size_t> TxOffsets;
+
+    size_t GetTxCount() const
+    {
+        return TxOffsets.empty() ? 0 : TxOffsets.size() - 1;
+    }
+};
+
+// Walks a serialized (getblock verbosity 0) block in-process with libbtc
+class BlockDecoder
+{
+public:
+
+    bool Decode(const std::string &RawBlockHex, int Height, DecodedBlock &Block) const
+    {
+        PreparedBlock Prepared;
+
+        Block.Height = Height;
+        Block.Outputs.clear();
+        Block.Spends.clear();
+
+        if(!Prepare(RawBlockHex, Height, Prepared))
+        {
+            return false;
+        }
+
+        Block.PrevBlockHash = Prepared.PrevBlockHash;
+
+        return DecodeRange(Prepared, 0, Prepared.GetTxCount(), Block);
+    }
+
+    // Converts the hex and locates transaction boundaries without deserializing them
+    bool Prepare(const std::string &RawBlockHex, int Height, PreparedBlock &Block) const
+    {
+        Block.Height = Height;
+        Block.TxOffsets.clear();
+
+        if(!HexToBin(RawBlockHex, Block.Bytes) || Block.Bytes.size() < BLOCK_HEADER_SIZE)
+        {
+            PLOG_WARNING_(MainLogger) << "Malformed raw block at height " << Height;
+            return false;
+        }
+
+        const uint8_t *Begin = Block.Bytes.data();
+
+        //Header: version, previous block hash, merkle root, time, bits, nonce
+        Block.PrevBlockHash = HashToHex(Begin + 4);
+
+        struct const_buffer Buffer = { Begin + BLOCK_HEADER_SIZE, Block.Bytes.size() - BLOCK_HEADER_SIZE };
+        uint32_t TxCount = 0;
+
+        if(!deser_varlen(&TxCount, &Buffer))
+        {
+            return false;
+        }
+
+        for(uint32_t TxIndex = 0; TxIndex < TxCount; ++TxIndex)
+        {
+            Block.TxOffsets.push_back(static_cast<const uint8_t*>(Buffer.p) - Begin);
+
+            if(!SkipTransaction(Buffer))
+            {
+                PLOG_WARNING_(MainLogger) << "Malformed tx " << TxIndex << " at height " << Height;
+                return false;
+            }
+        }
+
+        Block.TxOffsets.push_back(static_cast<const uint8_t*>(Buffer.p) - Begin);
+
+        return true;
+    }
+
+    // Deserializes transactions [FirstTx, EndTx) and appends their watchable outputs and spent outpoints in order
+    bool DecodeRange(const PreparedBlock &Block, size_t FirstTx, size_t EndTx, DecodedBlock &Result) const
+    {
+        PendingKeys Keys;
+
+        for(size_t TxIndex = FirstTx; TxIndex < EndTx; ++TxIndex)
+        {
+            const size_t Offset = Block.TxOffsets[TxIndex];
+            size_t Consumed = 0;
+            btc_tx *Tx = btc_tx_new();
+
+            if(!btc_tx_deserialize(Block.Bytes.data() + Offset, Block.TxOffsets[TxIndex + 1] - Offset, Tx, &Consumed, true))
+            {
+                btc_tx_free(Tx);
+                PLOG_WARNING_(MainLogger) << "Failed to deserialize tx " << TxIndex << " at height " << Block.Height;
+                return false;
+            }
+
+            DecodeOutputs(Tx, Result.Outputs, &Keys);
+            DecodeSpends(Tx, Result.Spends);
+            btc_tx_free(Tx);
+        }
+
+        HashPendingKeys(Keys, Result.Outputs);
+
+        return true;
+    }
+
+    // Classifies a hex scriptPubKey, as reported by verbose RPC calls
+    bool ClassifyHex(const std::string &ScriptHex, DecodedOutput &Output) const
+    {
+        std::vector<uint8_t> Script;
+
+        if(!HexToBin(ScriptHex, Script))
+        {
+            return false;
+        }
+
+        cstring *ScriptString = cstr_new_buf(Script.data(), Script.size());
+        const bool Matched = Classify(ScriptString, Output);
+        cstr_free(ScriptString, true);
+
+        return Matched;
+    }
+
+private:
+
+    // P2PK keys of a decoded range, hashed in one batch once the range is done
+    struct PendingKeys
+    {
+        std::vector<uint8_t> Bytes;
+        std::vector<size_t> Sizes;
+        // Index in the result outputs the hash belongs to
+        std::vector<size_t> Outputs;
+    };
+
+    static void HashPendingKeys(const PendingKeys &Keys, std::vector<DecodedOutput> &Outputs)
+    {
+        if(Keys.Outputs.empty())
+        {
+            return;
+        }
+
+        std::vector<const uint8_t*> Messages(Keys.Outputs.size());
+        std::vector<uint8_t> Hashes(Keys.Outputs.size() * 20);
+        size_t Offset = 0;
+
+        for(size_t Index = 0; Index < Messages.size(); ++Index)
+        {
+            Messages[Index] = Keys.Bytes.data() + Offset;
+            Offset += Keys.Sizes[Index];
+        }
+
+        Hash160Many(Messages.data(), Keys.Sizes.data(), Messages.size(), reinterpret_cast<uint8_t (*)[20]>(Hashes.data()));
+
+        for(size_t Index = 0; Index < Messages.size(); ++Index)
+        {
+            memcpy(Outputs[Keys.Outputs[Index]].Hash160, Hashes.data() + Index * 20, 20);
+        }
+    }
+
+    // Moves the buffer past one serialized transaction, with or without witness data
+    static bool SkipTransaction(struct const_buffer &Buffer)
+    {
+        uint32_t InCount = 0, OutCount = 0, Length = 0;
+        bool HasWitness = false;
+
+        if(!deser_skip(&Buffer, 4) || !deser_varlen(&InCount, &Buffer))
+        {
+            return false;
+        }
+
+        //Segwit marker (0x00) and flag, the real input count follows
+        if(InCount == 0)
+        {
+            uint8_t Flag = 0;
+
+            if(!deser_bytes(&Flag, &Buffer, 1) || Flag != 1 || !deser_varlen(&InCount, &Buffer))
+            {
+                return false;
+            }
+
+            HasWitness = true;
+        }
+
+        for(uint32_t Index = 0; Index < InCount; ++Index)
+        {
+            if(!deser_skip(&Buffer, 36) || !deser_varlen(&Length, &Buffer) || !deser_skip(&Buffer, Length + 4))
+            {
+                return false;
+            }
+        }
+
+        if(!deser_varlen(&OutCount, &Buffer))
+        {
+            return false;
+        }
+
+        for(uint32_t Index = 0; Index < OutCount; ++Index)
+        {
+            if(!deser_skip(&Buffer, 8) || !deser_varlen(&Length, &Buffer) || !deser_skip(&Buffer, Length))
+            {
+                return false;
+            }
+        }
+
+        for(uint32_t Index = 0; HasWitness && Index < InCount; ++Index)
+        {
+            uint32_t Items = 0;
+
+            if(!deser_varlen(&Items, &Buffer))
+            {
+                return false;
+            }
+
+            for(uint32_t Item = 0; Item < Items; ++Item)
+            {
+                if(!deser_varlen(&Length, &Buffer) || !deser_skip(&Buffer, Length))
+                {
+                    return false;
+                }
+            }
+        }
+
+        return deser_skip(&Buffer, 4);
+    }
+
+    void DecodeOutputs(const btc_tx *Tx, std::vector<DecodedOutput> &Outputs, PendingKeys *Keys) const
+    {
+        const size_t FirstOutput = Outputs.size();
+
+        for(size_t Index = 0; Index < Tx->vout->len; ++Index)
+        {
+            const btc_tx_out *Out = static_cast<const btc_tx_out*>(vector_idx(Tx->vout, Index));
+            DecodedOutput Output;
+
+            if(Classify(Out->script_pubkey, Output, Keys, Outputs.size()))
+            {
+                Output.Value = Out->value;
+                Output.Index = static_cast<uint32_t>(Index);
+                Outputs.push_back(Output);
+            }
+        }
+
+        //The txid costs a re-serialization, only hash transactions having a watchable output
+        if(Outputs.size() > FirstOutput)
+        {
+            uint8_t TxId[32];
+            btc_tx_hash(Tx, TxId);
+
+            for(size_t Index = FirstOutput; Index < Outputs.size(); ++Index)
+            {
+                memcpy(Outputs[Index].TxId, TxId, sizeof (TxId));
+            }
+        }
+    }
+
+    void DecodeSpends(const btc_tx *Tx, std::vector<Outpoint> &Spends) const
+    {
+        for(size_t Index = 0; Index < Tx->vin->len; ++Index)
+        {
+            const btc_tx_in *In = static_cast<const btc_tx_in*>(vector_idx(Tx->vin, Index));
+
+            //Coinbase input, nothing is spent
+            if(In->prevout.n == UINT32_MAX && Tx->vin->len == 1)
+            {
+                continue;
+            }
+
+            Outpoint Spend;
+            memcpy(Spend.TxId, In->prevout.hash, sizeof (Spend.TxId));
+            Spend.Index = In->prevout.n;
+            Spends.push_back(Spend);
+        }
+    }
+
+    // Keeps P2PK, P2PKH, P2SH and P2WPKH outputs, they all map to a 20-byte hash.
+    // With Keys, a P2PK key is queued for the batch hash of output Slot instead of being hashed here.
+    bool Classify(const cstring *Script, DecodedOutput &Output, PendingKeys *Keys = nullptr, size_t Slot = 0) const
+    {
+        vector *Data = vector_new(1, btc_free);
+        Output.Type = btc_script_classify(Script, Data);
+
+        bool Matched = false;
+
+        if(Data->len > 0)
+        {
+            const uint8_t *Payload = static_cast<const uint8_t*>(vector_idx(Data, 0));
+
+            switch (Output.Type)
+            {
+                case BTC_TX_PUBKEYHASH: case BTC_TX_SCRIPTHASH: case BTC_TX_WITNESS_V0_PUBKEYHASH:
+                    memcpy(Output.Hash160, Payload, sizeof (Output.Hash160));
+                    Matched = true;
+                    break;
+                case BTC_TX_PUBKEY:
+                {
+                    //Pay-to-pubkey is matched through the hash of its (compressed or not) key
+                    const size_t KeySize = (Payload[0] == 0x02 || Payload[0] == 0x03) ? 33 : 65;
+
+                    if(Keys)
+                    {
+                        Keys->Bytes.insert(Keys->Bytes.end(), Payload, Payload + KeySize);
+                        Keys->Sizes.push_back(KeySize);
+                        Keys->Outputs.push_back(Slot);
+                    }
+                    else
+                    {
+                        uint8_t Sha[SHA256_DIGEST_LENGTH];
+                        sha256_Raw(Payload, KeySize, Sha);
+                        btc_ripemd160(Sha, sizeof (Sha), Output.Hash160);
+                    }
+
+                    Matched = true;
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        vector_free(Data, true);
+
+        return Matched;
+    }
+};
+
+#endif // BLOCKDECODER_H
@@ -0,0 +1,1085 @@
+#ifndef BLOCKSCANNER_H
+#define BLOCKSCANNER_H
+
+#include <dbstorage.h>
+#include <htttpcommunication.h>
+#include <blockdecoder.h>
+#include <boundedqueue.h>
+#include <utxocache.h>
+#include <watchset.h>
+#include <workstealingpool.h>
+
+#include <loggerinstances.h>
+
+#include <unordered_map>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <string>
+#include <thread>
+
+// Block as it comes from bitcoind, either serialized or as verbose transactions
+struct FetchedBlock
+{
+    int Height = 0;
+    bool Failed = false;
+    std::string BlockHash;
+    std::string PrevBlockHash;
+    std::string RawBlock;
+    std::vector<Json::Value> Transactions;
+};
+
+struct MatchedOutput
+{
+    std::string Address;
+    int64_t Value = 0;
+    std::string UtxoKey;
+    uint8_t Hash160[20];
+};
+
+// Outputs of one block paying to watched addresses, and every outpoint the block spends
+struct MatchedBlock
+{
+    int Height = 0;
+    bool Failed = false;
+    std::string BlockHash;
+    std::string PrevBlockHash;
+    std::vector<MatchedOutput> Outputs;
+    std::vector<Outpoint> Spends;
+};
+
+// State of one scan over a block range
+struct ScanPass
+{
+    // Records of the addresses credited so far, loaded from the database on their first match
+    std::unordered_map<std::string, TxInfo> Touched;
+
+    // Set for a backfill pass: only these addresses are credited, each within its own range
+    std::unordered_map<std::string, BackfillRange> *Backfills = nullptr;
+
+    // Hash of the last applied block, becomes the cursor hash on commit
+    std::string LastBlockHash;
+
+    // Blocks from this height on get undo records, a backfill pass adds its changes to the stored ones
+    int UndoFrom = INT_MAX;
+    UndoChanges Undo;
+
+    // Backfill records written along with the cursor, ranges which have to end where it does now
+    std::unordered_map<std::string, BackfillRange> CursorBackfills;
+
+    // Set once a commit failed: the state in memory no longer matches the database, nothing more is written
+    bool Failed = false;
+};
+
+// Block-major scanner: every block is downloaded once and all of its outputs are matched against the
+// whole watched set. A single persisted cursor marks how far the chain was applied, so a steady-state cycle
+// only reads the new blocks and only writes the addresses they pay to. Addresses which join below the cursor
+// get their own bounded backfill pass.
+// Blocks flow through a staged pipeline: fetch -> decode -> match -> commit, connected by bounded queues,
+// so bitcoind and our cores stay busy at the same time. Only the commit stage runs in height order.
+class BlockScanner
+{
+public:
+
+    // With UseRawBlocks blocks are fetched serialized and decoded in-process instead of as verbose JSON.
+    // PrefetchBlocks bounds how far fetching may run ahead of the committed height.
+    // DecodeThreads sizes the decoding pool, 0 uses every core. UtxoCacheMB is the memory budget of the UTXO cache.
+    BlockScanner(DBStorage *Storage, HttpCommunication *Http, WatchSet *Watch, bool UseRawBlocks = false, size_t PrefetchBlocks = 128,
+                 size_t DecodeThreads = 0, size_t UtxoCacheMB = 100)
+        : m_DBStorage(Storage),
+          m_HttpCommunication(Http),
+          m_WatchSet(Watch),
+          m_Utxos(Storage, UtxoCacheMB),
+          m_UseRawBlocks(UseRawBlocks),
+          m_PrefetchBlocks(std::max<size_t>(PrefetchBlocks, BlocksPerBatch)),
+          m_DecodePool(DecodeThreads)
+    {
+    }
+
+    // One update cycle: finish pending backfills, then scan from the cursor to the tip
+    bool Scan()
+    {
+        SetScanning(true);
+
+        const bool Scanned = ScanCycle();
+
+        SetScanning(false);
+
+        return Scanned;
+    }
+
+    // Stores addresses new to the database and starts watching them, called from any thread. The pipeline
+    // of a running scan may have matched blocks past the committed cursor without them, so an address joining
+    // during a scan is credited by none of its passes: its backfill covers those blocks instead, and every
+    // cursor the scan commits moves the end of that backfill along.
+    bool AddNewAddresses(const std::vector<std::string> &Addresses, const std::vector<Hash160Key> &Hashes, int BirthHeight)
+    {
+        std::lock_guard<std::mutex> lock(m_JoinGuard);
+
+        if(!m_DBStorage->AddNewAddresses(Addresses, BirthHeight))
+        {
+            return false;
+        }
+
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            m_WatchSet->Add(Hashes[Index], Addresses[Index]);
+
+            if(m_Scanning) m_Joined.emplace(Addresses[Index], BirthHeight);
+        }
+
+        return true;
+    }
+
+private:
+
+    // Drives single blocks through the commit path without bitcoind
+    friend class BlockScannerTest;
+
+    bool ScanCycle()
+    {
+        assert(m_DBStorage);
+        assert(m_HttpCommunication);
+        assert(m_WatchSet);
+
+        int CurrentBlockCount = 0;
+        ScanCursor Cursor;
+
+        if(!m_HttpCommunication->GetCurrentBlockCount(CurrentBlockCount))
+        {
+            PLOG_WARNING_(MainLogger) << "Scan skipped, unable to get current block count.";
+            return false;
+        }
+
+        if(!LoadCursor(CurrentBlockCount, Cursor))
+        {
+            PLOG_WARNING_(MainLogger) << "Scan skipped, unable to initialize scan cursor.";
+            return false;
+        }
+
+        m_Utxos.Load();
+
+        if(!Rewind(CurrentBlockCount, Cursor))
+        {
+            PLOG_WARNING_(MainLogger) << "Scan skipped, unable to bring the cursor back to the active chain.";
+            return false;
+        }
+
+        if(m_WatchSet->Size() == 0)
+        {
+            PLOG_VERBOSE_(MainLogger) << "Scan skipped, no addresses watched.";
+            return true;
+        }
+
+        //Outputs found by a backfill may be spent in blocks above the cursor, the main pass waits for it
+        if(!Backfill(Cursor))
+        {
+            return false;
+        }
+
+        if(Cursor.m_Height >= CurrentBlockCount)
+        {
+            PLOG_VERBOSE_(MainLogger) << "Scan skipped, cursor is at the tip: " << Cursor.m_Height;
+            return true;
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Scanning blocks " << Cursor.m_Height << " - " << CurrentBlockCount << " for " << m_WatchSet->Size() << " addresses";
+
+        ScanPass Pass;
+        Pass.LastBlockHash = Cursor.m_BlockHash;
+        Pass.UndoFrom = CurrentBlockCount - UndoBlocks;
+
+        //Blocks below ScannedUpTo are fully matched, on error we commit the progress made so far
+        const int ScannedUpTo = RunPipeline(Cursor.m_Height, CurrentBlockCount, Pass);
+
+        PLOG_WARNING_IF_(MainLogger, ScannedUpTo < CurrentBlockCount) << "Scan interrupted at block " << ScannedUpTo;
+        PLOG_VERBOSE_(MainLogger) << "Scan finished at block " << ScannedUpTo << ", committing " << Pass.Touched.size() << " records";
+
+        return Commit(ScannedUpTo, Pass);
+    }
+
+    // Addresses joining from now on are left to their backfill until the scan is over
+    void SetScanning(bool Scanning)
+    {
+        std::lock_guard<std::mutex> lock(m_JoinGuard);
+
+        m_Scanning = Scanning;
+        m_Joined.clear();
+    }
+
+    // Reads the cursor, creating it on first start. Databases written before the cursor existed
+    // start at the furthest scanned address, the ones behind it get backfilled up to there.
+    bool LoadCursor(int CurrentBlockCount, ScanCursor &Cursor)
+    {
+        const std::shared_ptr<const DBView> View = m_DBStorage->GetView();
+
+        if(View->m_HasCursor)
+        {
+            Cursor = View->m_Cursor;
+            return true;
+        }
+
+        std::unordered_map<std::string, TxInfo> Existing;
+        m_DBStorage->GetAllTxInfos(Existing, View.get());
+        int StartHeight = -1;
+
+        for(auto &Pair : Existing)
+        {
+            StartHeight = std::max(StartHeight, Pair.second.m_BirthHeight);
+        }
+
+        Cursor.m_Height = StartHeight < 0 ? CurrentBlockCount : StartHeight;
+
+        if(Cursor.m_Height > 0)
+        {
+            std::vector<std::string> Hashes;
+
+            if(!m_HttpCommunication->GetBlockHashes({Cursor.m_Height - 1}, Hashes))
+            {
+                return false;
+            }
+
+            strncpy(Cursor.m_BlockHash, Hashes[0].c_str(), sizeof (Cursor.m_BlockHash) - 1);
+        }
+
+        for(auto &Pair : Existing)
+        {
+            if(Pair.second.m_BirthHeight < Cursor.m_Height)
+            {
+                BackfillRange Range;
+                Range.m_From = Pair.second.m_BirthHeight;
+                Range.m_To = Cursor.m_Height;
+                m_DBStorage->AddBackfill(Pair.first, Range);
+            }
+        }
+
+        PLOG_INFO_(MainLogger) << "Scan cursor created at block " << Cursor.m_Height << ", addresses: " << Existing.size();
+
+        return m_DBStorage->UpdateCursor(Cursor);
+    }
+
+    // Walks the cursor back while the block under it is no longer on the active chain, disconnecting
+    // each block from its undo record. The main pass then reconnects the new branch from there.
+    bool Rewind(int CurrentBlockCount, ScanCursor &Cursor)
+    {
+        ScanPass Pass;
+
+        while(Cursor.m_Height > 0)
+        {
+            const int Height = Cursor.m_Height - 1;
+            std::vector<std::string> Hashes;
+
+            //Blocks above the tip are gone as well
+            if(Height <= CurrentBlockCount)
+            {
+                if(!m_HttpCommunication->GetBlockHashes({Height}, Hashes))
+                {
+                    return false;
+                }
+
+                if(Hashes[0] == Cursor.m_BlockHash)
+                {
+                    break;
+                }
+            }
+
+            if(!DisconnectTip(Cursor, Pass))
+            {
+                return false;
+            }
+        }
+
+        if(Pass.Undo.Removed.empty())
+        {
+            return true;
+        }
+
+        PLOG_WARNING_(MainLogger) << "Chain reorganization, disconnected " << Pass.Undo.Removed.size() << " blocks, cursor back at block " << Cursor.m_Height;
+
+        return CommitRewind(Cursor, Pass);
+    }
+
+    // Disconnects the block under the cursor and moves the cursor below it
+    bool DisconnectTip(ScanCursor &Cursor, ScanPass &Pass)
+    {
+        const int Height = Cursor.m_Height - 1;
+        BlockUndo Block;
+
+        if(!m_DBStorage->GetUndo(Height, Block) || strcmp(Block.m_BlockHash, Cursor.m_BlockHash) != 0)
+        {
+            PLOG_ERROR_(MainLogger) << "Reorganization below block " << Height << " is deeper than the undo data, a rescan is needed";
+            return false;
+        }
+
+        Disconnect(Block, Pass);
+        Pass.Undo.Removed.push_back(Height);
+
+        Cursor.m_Height = Height;
+        memcpy(Cursor.m_BlockHash, Block.m_PrevBlockHash, sizeof (Cursor.m_BlockHash));
+
+        return true;
+    }
+
+    // Pending backfills end at the rewound cursor: the main pass covers the blocks above it again, and what
+    // a backfill had credited there was in their undo records and is disconnected with them
+    bool CommitRewind(const ScanCursor &Cursor, ScanPass &Pass)
+    {
+        std::unordered_map<std::string, BackfillRange> Backfills;
+        m_DBStorage->GetBackfills(Backfills);
+
+        for(auto &Pair : Backfills)
+        {
+            BackfillRange Range = Pair.second;
+            Range.m_To = std::min(Range.m_To, Cursor.m_Height);
+            Range.m_From = std::min(Range.m_From, Range.m_To);
+
+            if(Range.m_To != Pair.second.m_To) Pass.CursorBackfills.emplace(Pair.first, Range);
+        }
+
+        Pass.LastBlockHash = Cursor.m_BlockHash;
+
+        return Commit(Cursor.m_Height, Pass);
+    }
+
+    // Reverts one block: its spends come back into the UTXO set, its outputs leave it
+    void Disconnect(const BlockUndo &Block, ScanPass &Pass)
+    {
+        std::string Address;
+
+        for(auto &Spent : Block.m_Spent)
+        {
+            TxInfo *Info = m_WatchSet->Find(Spent.second.m_Hash160, Address) ? GetTouched(Address, Block.m_Height, Pass) : nullptr;
+
+            if(Info) Info->m_Balance += Spent.second.m_Value;
+            m_Utxos.Add(Spent.first, Spent.second);
+        }
+
+        for(auto &Created : Block.m_Created)
+        {
+            TxInfo *Info = m_WatchSet->Find(Created.second.m_Hash160, Address) ? GetTouched(Address, Block.m_Height, Pass) : nullptr;
+            UtxoEntry Entry;
+
+            if(Info) Info->m_Balance -= Created.second.m_Value;
+            if(m_Utxos.Find(Created.first, Entry)) m_Utxos.Erase(Created.first);
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Disconnected block " << Block.m_Height << " " << Block.m_BlockHash;
+    }
+
+    // Scans the blocks addresses which joined below the cursor have missed, all pending ranges in one pass
+    bool Backfill(const ScanCursor &Cursor)
+    {
+        std::unordered_map<std::string, BackfillRange> Backfills;
+
+        m_DBStorage->GetBackfills(Backfills);
+
+        //Ranges of addresses which joined during this scan are still moving with the cursor
+        {
+            std::lock_guard<std::mutex> lock(m_JoinGuard);
+
+            for(auto &Pair : m_Joined)
+            {
+                Backfills.erase(Pair.first);
+            }
+        }
+
+        if(Backfills.empty())
+        {
+            return true;
+        }
+
+        int FirstBlock = INT_MAX, EndBlock = 0;
+
+        for(auto &Pair : Backfills)
+        {
+            FirstBlock = std::min(FirstBlock, Pair.second.m_From);
+            EndBlock = std::max(EndBlock, Pair.second.m_To);
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Backfilling blocks " << FirstBlock << " - " << EndBlock << " for " << Backfills.size() << " addresses";
+
+        ScanPass Pass;
+        Pass.Backfills = &Backfills;
+        Pass.UndoFrom = Cursor.m_Height - UndoBlocks;
+
+        const int ScannedUpTo = FirstBlock < EndBlock ? RunPipeline(FirstBlock, EndBlock, Pass) : EndBlock;
+
+        PLOG_WARNING_IF_(MainLogger, ScannedUpTo < EndBlock) << "Backfill interrupted at block " << ScannedUpTo;
+
+        return Commit(ScannedUpTo, Pass) && ScannedUpTo >= EndBlock;
+    }
+
+    // Writes touched balances and UTXO changes together with the cursor, or the backfill progress for a backfill pass
+    bool Commit(int ScannedUpTo, ScanPass &Pass)
+    {
+        if(Pass.Failed)
+        {
+            return false;
+        }
+
+        if(Pass.Backfills)
+        {
+            for(auto &Pair : *Pass.Backfills)
+            {
+                Pair.second.m_From = std::max(Pair.second.m_From, ScannedUpTo);
+            }
+        }
+
+        UtxoChanges Utxos;
+        m_Utxos.GetChanges(Utxos);
+
+        ScanCursor Cursor;
+        Cursor.m_Height = ScannedUpTo;
+        strncpy(Cursor.m_BlockHash, Pass.LastBlockHash.c_str(), sizeof (Cursor.m_BlockHash) - 1);
+
+        //Held until the cursor is in: an address joining meanwhile would take its backfill end from the old one
+        std::unique_lock<std::mutex> lock(m_JoinGuard, std::defer_lock);
+
+        if(!Pass.Backfills)
+        {
+            lock.lock();
+
+            for(auto &Pair : m_Joined)
+            {
+                BackfillRange &Range = Pass.CursorBackfills[Pair.first];
+                Range.m_From = Pair.second;
+                Range.m_To = ScannedUpTo;
+            }
+        }
+
+        const bool Committed = Pass.Backfills ? m_DBStorage->CommitBackfill(Pass.Touched, Utxos, Pass.Undo, *Pass.Backfills)
+                                              : m_DBStorage->CommitScan(Pass.Touched, Utxos, Pass.Undo, Cursor, Pass.CursorBackfills);
+
+        //A failed pass is replayed from the committed state by the next cycle, changes kept here would apply twice
+        if(Committed)
+        {
+            m_Utxos.Flushed();
+        }
+        else
+        {
+            PLOG_ERROR_(MainLogger) << "Commit at block " << ScannedUpTo << " failed, dropping the pass";
+
+            m_Utxos.Discard();
+            Pass.Touched.clear();
+            Pass.Failed = true;
+        }
+
+        Pass.Undo = UndoChanges();
+
+        return Committed;
+    }
+
+    // Runs all stages over [FirstBlock, EndBlock), returns the first block not committed
+    int RunPipeline(int FirstBlock, int EndBlock, ScanPass &Pass)
+    {
+        const auto StartTime = std::chrono::steady_clock::now();
+
+        BoundedQueue<FetchedBlock> Fetched(m_PrefetchBlocks);
+        BoundedQueue<DecodedBlock> Decoded(m_PrefetchBlocks);
+        BoundedQueue<MatchedBlock> Matched(m_PrefetchBlocks);
+
+        const size_t Fetchers = m_HttpCommunication->GetPoolSize();
+
+        m_NextBatch = FirstBlock;
+        m_CommittedHeight = FirstBlock;
+        m_Stopped = false;
+
+        std::atomic<size_t> FetchersLeft{Fetchers};
+        std::vector<std::thread> Stages;
+
+        //The last thread leaving a stage closes its output queue
+        for(size_t Index = 0; Index < Fetchers; ++Index)
+        {
+            Stages.emplace_back([&]() { FetchStage(EndBlock, Fetched); if(--FetchersLeft == 0) Fetched.Close(); });
+        }
+
+        Stages.emplace_back([&]() { DecodeStage(Fetched, Decoded); Decoded.Close(); });
+
+        Stages.emplace_back([&]() { MatchStage(Decoded, Matched); Matched.Close(); });
+
+        const int ScannedUpTo = CommitStage(FirstBlock, EndBlock, Matched, Pass);
+
+        //Release every stage still blocked on a queue or on the prefetch window
+        {
+            std::lock_guard<std::mutex> lock(m_WindowGuard);
+            m_Stopped = true;
+        }
+
+        m_WindowCondition.notify_all();
+
+        Fetched.Close();
+        Fetched.Clear();
+        Decoded.Close();
+        Decoded.Clear();
+        Matched.Close();
+        Matched.Clear();
+
+        for(auto &Stage : Stages)
+        {
+            Stage.join();
+        }
+
+        const double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - StartTime).count();
+
+        PLOG_VERBOSE_(MainLogger) << "Scanned " << ScannedUpTo - FirstBlock << " blocks in " << Seconds << "s, queue depth max/avg:"
+                                  << " fetched " << Fetched.GetMaxDepth() << "/" << Fetched.GetAverageDepth()
+                                  << " decoded " << Decoded.GetMaxDepth() << "/" << Decoded.GetAverageDepth()
+                                  << " matched " << Matched.GetMaxDepth() << "/" << Matched.GetAverageDepth();
+
+        return ScannedUpTo;
+    }
+
+    // Claims batches of heights and downloads them, never more than m_PrefetchBlocks ahead of the commit stage
+    void FetchStage(int EndBlock, BoundedQueue<FetchedBlock> &Fetched)
+    {
+        while(true)
+        {
+            const int BatchStart = m_NextBatch.fetch_add(BlocksPerBatch);
+
+            if(BatchStart >= EndBlock)
+            {
+                return;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(m_WindowGuard);
+                m_WindowCondition.wait(lock, [&] { return m_Stopped || BatchStart < m_CommittedHeight + static_cast<int>(m_PrefetchBlocks); });
+
+                if(m_Stopped)
+                {
+                    return;
+                }
+            }
+
+            std::vector<FetchedBlock> Blocks;
+            FetchBatch(BatchStart, std::min(BatchStart + BlocksPerBatch, EndBlock), Blocks);
+
+            for(auto &Block : Blocks)
+            {
+                if(!Fetched.Push(std::move(Block)))
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    // Fills Blocks for [FirstBlock, EndBlock), a failed block ends the batch
+    void FetchBatch(int FirstBlock, int EndBlock, std::vector<FetchedBlock> &Blocks)
+    {
+        std::vector<int> Heights;
+        std::vector<std::string> BlockHashes, RawBlocks;
+        std::vector<Json::Value> BlockInfos;
+
+        for(int Height = FirstBlock; Height < EndBlock; ++Height)
+        {
+            Heights.push_back(Height);
+        }
+
+        const bool HaveBlocks = m_HttpCommunication->GetBlockHashes(Heights, BlockHashes) &&
+                                (m_UseRawBlocks ? m_HttpCommunication->GetRawBlocks(BlockHashes, RawBlocks)
+                                                : m_HttpCommunication->GetBlockInfos(BlockHashes, BlockInfos));
+
+        for(size_t Index = 0; Index < Heights.size(); ++Index)
+        {
+            Blocks.emplace_back();
+            FetchedBlock &Block = Blocks.back();
+            Block.Height = Heights[Index];
+            Block.Failed = !HaveBlocks;
+
+            if(Block.Failed)
+            {
+                return;
+            }
+
+            Block.BlockHash = BlockHashes[Index];
+
+            if(m_UseRawBlocks)
+            {
+                Block.RawBlock = std::move(RawBlocks[Index]);
+                continue;
+            }
+
+            std::vector<std::string> TxIds;
+            Block.PrevBlockHash = BlockInfos[Index]["previousblockhash"].asString();
+
+            for(auto &Tx : BlockInfos[Index]["tx"])
+            {
+                TxIds.push_back(Tx.asString());
+            }
+
+            //Needs -txindex=1 on bitcoind for non wallet transactions
+            if(!m_HttpCommunication->GetRawTxInfos(TxIds, Block.Transactions))
+            {
+                Block.Failed = true;
+                return;
+            }
+        }
+    }
+
+    // Hands fetched blocks to the decoding pool, at most two blocks per worker in flight.
+    // Decoded blocks leave the pool in completion order, the commit stage restores height order.
+    void DecodeStage(BoundedQueue<FetchedBlock> &Fetched, BoundedQueue<DecodedBlock> &Decoded)
+    {
+        const size_t MaxInFlight = 2 * m_DecodePool.GetThreadCount();
+        FetchedBlock Block;
+
+        while(Fetched.Pop(Block))
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_DecodeGuard);
+                m_DecodeCondition.wait(lock, [&] { return m_DecodesInFlight < MaxInFlight; });
+                m_DecodesInFlight++;
+            }
+
+            auto Job = std::make_shared<DecodeJob>();
+            Job->Source = std::move(Block);
+            Job->Target = &Decoded;
+
+            m_DecodePool.Submit([this, Job]() { DecodeBlock(Job); });
+        }
+
+        //Tasks reference the pipeline queues, wait for all of them before the queues go away
+        std::unique_lock<std::mutex> lock(m_DecodeGuard);
+        m_DecodeCondition.wait(lock, [this] { return m_DecodesInFlight == 0; });
+    }
+
+    // A block being decoded on the pool, shared by the tasks of its transaction chunks
+    struct DecodeJob
+    {
+        FetchedBlock Source;
+        PreparedBlock Prepared;
+        DecodedBlock Result;
+        std::vector<DecodedBlock> ChunkResults;
+        std::atomic<size_t> ChunksLeft{0};
+        std::atomic<bool> Failed{false};
+        BoundedQueue<DecodedBlock> *Target = nullptr;
+    };
+
+    // Locates the transactions of a raw block and splits big blocks into chunks other workers can steal
+    void DecodeBlock(const std::shared_ptr<DecodeJob> &Job)
+    {
+        DecodedBlock &Result = Job->Result;
+        Result.Height = Job->Source.Height;
+        Result.Failed = Job->Source.Failed;
+        Result.BlockHash = std::move(Job->Source.BlockHash);
+        Result.PrevBlockHash = std::move(Job->Source.PrevBlockHash);
+
+        if(Result.Failed || !m_UseRawBlocks)
+        {
+            Result.Failed = Result.Failed || !DecodeTransactions(Job->Source.Transactions, Result);
+            FinishBlock(Job);
+            return;
+        }
+
+        if(!m_Decoder.Prepare(Job->Source.RawBlock, Result.Height, Job->Prepared))
+        {
+            Result.Failed = true;
+            FinishBlock(Job);
+            return;
+        }
+
+        Result.PrevBlockHash = Job->Prepared.PrevBlockHash;
+
+        //The hex is no longer needed, the chunks work on the binary copy
+        std::string().swap(Job->Source.RawBlock);
+
+        const size_t TxCount = Job->Prepared.GetTxCount();
+        const size_t Chunks = std::max<size_t>(1, (TxCount + TxsPerChunk - 1) / TxsPerChunk);
+
+        Job->ChunkResults.resize(Chunks);
+        Job->ChunksLeft = Chunks;
+
+        for(size_t Chunk = 1; Chunk < Chunks; ++Chunk)
+        {
+            m_DecodePool.Submit([this, Job, Chunk]() { DecodeChunk(Job, Chunk); });
+        }
+
+        DecodeChunk(Job, 0);
+    }
+
+    // The last chunk to finish stitches the outputs back together in transaction order
+    void DecodeChunk(const std::shared_ptr<DecodeJob> &Job, size_t Chunk)
+    {
+        const size_t FirstTx = Chunk * TxsPerChunk;
+        const size_t EndTx = std::min(FirstTx + TxsPerChunk, Job->Prepared.GetTxCount());
+
+        if(!m_Decoder.DecodeRange(Job->Prepared, FirstTx, EndTx, Job->ChunkResults[Chunk]))
+        {
+            Job->Failed = true;
+        }
+
+        if(--Job->ChunksLeft != 0)
+        {
+            return;
+        }
+
+        DecodedBlock &Result = Job->Result;
+        Result.Failed = Job->Failed;
+
+        for(auto &Chunk : Job->ChunkResults)
+        {
+            Result.Outputs.insert(Result.Outputs.end(), Chunk.Outputs.begin(), Chunk.Outputs.end());
+            Result.Spends.insert(Result.Spends.end(), Chunk.Spends.begin(), Chunk.Spends.end());
+        }
+
+        FinishBlock(Job);
+    }
+
+    void FinishBlock(const std::shared_ptr<DecodeJob> &Job)
+    {
+        //Fails only once the pipeline is shutting down
+        Job->Target->Push(std::move(Job->Result));
+
+        {
+            std::lock_guard<std::mutex> lock(m_DecodeGuard);
+            m_DecodesInFlight--;
+        }
+
+        m_DecodeCondition.notify_all();
+    }
+
+    // Verbose transactions carry the scriptPubKey hex, classified the same way as raw blocks
+    bool DecodeTransactions(const std::vector<Json::Value> &Transactions, DecodedBlock &Block) const
+    {
+        for(auto &TxInfoJson : Transactions)
+        {
+            uint8_t TxId[32];
+
+            if(!TxIdFromHex(TxInfoJson["txid"].asString(), TxId))
+            {
+                return false;
+            }
+
+            for(auto &Vout : TxInfoJson["vout"])
+            {
+                DecodedOutput Output;
+
+                if(m_Decoder.ClassifyHex(Vout["scriptPubKey"]["hex"].asString(), Output))
+                {
+                    //Amounts come in BTC, balances are kept in satoshi
+                    Output.Value = std::llround(Vout["value"].asDouble() * 100000000.0);
+                    Output.Index = Vout["n"].asUInt();
+                    memcpy(Output.TxId, TxId, sizeof (TxId));
+                    Block.Outputs.push_back(Output);
+                }
+            }
+
+            for(auto &Vin : TxInfoJson["vin"])
+            {
+                Outpoint Spend;
+
+                //Coinbase inputs carry no txid
+                if(!Vin.isMember("txid"))
+                {
+                    continue;
+                }
+
+                if(!TxIdFromHex(Vin["txid"].asString(), Spend.TxId))
+                {
+                    return false;
+                }
+
+                Spend.Index = Vin["vout"].asUInt();
+                Block.Spends.push_back(Spend);
+            }
+        }
+
+        return true;
+    }
+
+    // RPC shows txids byte reversed, outpoints use the internal order
+    static bool TxIdFromHex(const std::string &Hex, uint8_t *TxId)
+    {
+        std::vector<uint8_t> Bytes;
+
+        if(Hex.size() != 64 || !HexToBin(Hex, Bytes))
+        {
+            return false;
+        }
+
+        std::reverse_copy(Bytes.begin(), Bytes.end(), TxId);
+        return true;
+    }
+
+    void MatchStage(BoundedQueue<DecodedBlock> &Decoded, BoundedQueue<MatchedBlock> &Matched)
+    {
+        DecodedBlock Block;
+
+        while(Decoded.Pop(Block))
+        {
+            MatchedBlock Result;
+            Result.Height = Block.Height;
+            Result.Failed = Block.Failed;
+            Result.BlockHash = std::move(Block.BlockHash);
+            Result.PrevBlockHash = std::move(Block.PrevBlockHash);
+
+            for(auto &Output : Block.Outputs)
+            {
+                MatchedOutput Match;
+
+                if(m_WatchSet->Find(Output.Hash160, Match.Address))
+                {
+                    Match.Value = Output.Value;
+                    Match.UtxoKey = UtxoKey(Output.TxId, Output.Index);
+                    memcpy(Match.Hash160, Output.Hash160, sizeof (Match.Hash160));
+                    Result.Outputs.push_back(std::move(Match));
+                }
+            }
+
+            //Spends can only be matched in order, outputs of the previous block may not be committed yet
+            Result.Spends = std::move(Block.Spends);
+
+            if(!Matched.Push(std::move(Result)))
+            {
+                return;
+            }
+        }
+    }
+
+    // Applies matched blocks strictly in height order, flushing to the database every CommitInterval blocks
+    int CommitStage(int FirstBlock, int EndBlock, BoundedQueue<MatchedBlock> &Matched, ScanPass &Pass)
+    {
+        std::map<int, MatchedBlock> Pending;
+        MatchedBlock Block;
+        int NextHeight = FirstBlock, LastFlush = FirstBlock;
+
+        while(NextHeight < EndBlock && Matched.Pop(Block))
+        {
+            Pending.emplace(Block.Height, std::move(Block));
+
+            for(auto Found = Pending.find(NextHeight); Found != Pending.end(); Found = Pending.find(NextHeight))
+            {
+                if(Found->second.Failed || !ConnectBlock(Found->second, Pass))
+                {
+                    return NextHeight;
+                }
+
+                Pending.erase(Found);
+                NextHeight++;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_WindowGuard);
+                m_CommittedHeight = NextHeight;
+            }
+
+            m_WindowCondition.notify_all();
+
+            if(NextHeight - LastFlush >= CommitInterval || m_Utxos.IsOverBudget())
+            {
+                if(!Commit(NextHeight, Pass))
+                {
+                    return NextHeight;
+                }
+
+                LastFlush = NextHeight;
+            }
+        }
+
+        return NextHeight;
+    }
+
+    // Applies one block on top of the pass: its credits, debits and undo record. False when it does not
+    // belong to the chain the pass follows, the next cycle rewinds first.
+    bool ConnectBlock(MatchedBlock &Block, ScanPass &Pass)
+    {
+        BlockUndo Undo;
+        BlockUndo *RecordUndo = nullptr;
+
+        if(!Pass.Backfills)
+        {
+            //Heights were resolved to hashes while bitcoind switched branches
+            if(!Pass.LastBlockHash.empty() && Block.PrevBlockHash != Pass.LastBlockHash)
+            {
+                PLOG_WARNING_(MainLogger) << "Block " << Block.Height << " does not extend " << Pass.LastBlockHash << ", chain reorganized during scan";
+                return false;
+            }
+
+            if(Block.Height >= Pass.UndoFrom)
+            {
+                Undo.m_Height = Block.Height;
+                strncpy(Undo.m_BlockHash, Block.BlockHash.c_str(), sizeof (Undo.m_BlockHash) - 1);
+                strncpy(Undo.m_PrevBlockHash, Pass.LastBlockHash.c_str(), sizeof (Undo.m_PrevBlockHash) - 1);
+                RecordUndo = &Undo;
+            }
+        }
+        //A backfill credit in a block which can still be disconnected joins its undo record, a rewind reverts it too
+        else if(Block.Height >= Pass.UndoFrom && m_DBStorage->GetUndo(Block.Height, Undo))
+        {
+            if(Block.BlockHash != Undo.m_BlockHash)
+            {
+                PLOG_WARNING_(MainLogger) << "Backfill block " << Block.Height << " is not the scanned " << Undo.m_BlockHash << ", chain reorganized";
+                return false;
+            }
+
+            RecordUndo = &Undo;
+        }
+
+        //Outputs first, a transaction may spend an output created earlier in the same block
+        for(auto &Output : Block.Outputs)
+        {
+            Credit(Output, Block.Height, Pass, RecordUndo);
+        }
+
+        for(auto &Spend : Block.Spends)
+        {
+            Debit(Spend, Block.Height, Pass, RecordUndo);
+        }
+
+        if(RecordUndo)
+        {
+            Pass.Undo.Added.push_back(std::move(Undo));
+            if(!Pass.Backfills && Block.Height >= UndoBlocks) Pass.Undo.Removed.push_back(Block.Height - UndoBlocks);
+        }
+
+        Pass.LastBlockHash = std::move(Block.BlockHash);
+
+        return true;
+    }
+
+    // Adds the output to the balance and to the UTXO set
+    void Credit(const MatchedOutput &Output, int Height, ScanPass &Pass, BlockUndo *Undo)
+    {
+        TxInfo *Info = GetTouched(Output.Address, Height, Pass);
+
+        if(!Info)
+        {
+            return;
+        }
+
+        //Fresh addresses carry -1 until their first credit
+        if(Info->m_Balance < 0) Info->m_Balance = 0;
+
+        Info->m_Balance += Output.Value;
+
+        UtxoEntry Entry;
+        memcpy(Entry.m_Hash160, Output.Hash160, sizeof (Entry.m_Hash160));
+        Entry.m_Value = Output.Value;
+        Entry.m_Height = Height;
+        m_Utxos.Add(Output.UtxoKey, Entry);
+
+        if(Undo) Undo->m_Created.emplace_back(Output.UtxoKey, Entry);
+
+        PLOG_VERBOSE_(MainLogger) << "Found output to " << Output.Address << " in block " << Height;
+    }
+
+    // Removes a spent watched output from the UTXO set and its value from the balance
+    void Debit(const Outpoint &Spend, int Height, ScanPass &Pass, BlockUndo *Undo)
+    {
+        const std::string Key = UtxoKey(Spend.TxId, Spend.Index);
+        UtxoEntry Entry;
+        std::string Address;
+
+        if(!m_Utxos.Find(Key, Entry) || !m_WatchSet->Find(Entry.m_Hash160, Address))
+        {
+            return;
+        }
+
+        TxInfo *Info = GetTouched(Address, Height, Pass);
+
+        if(!Info)
+        {
+            return;
+        }
+
+        Info->m_Balance -= Entry.m_Value;
+        m_Utxos.Erase(Key);
+
+        if(Undo) Undo->m_Spent.emplace_back(Key, Entry);
+
+        PLOG_VERBOSE_(MainLogger) << "Found spend from " << Address << " in block " << Height;
+    }
+
+    // Record of an address the block at Height counts for, loaded on first use; null when the block is not its to count
+    TxInfo *GetTouched(const std::string &Address, int Height, ScanPass &Pass) const
+    {
+        if(Pass.Backfills)
+        {
+            auto Range = Pass.Backfills->find(Address);
+
+            if(Range == Pass.Backfills->end() || Height < Range->second.m_From || Height >= Range->second.m_To)
+            {
+                return nullptr;
+            }
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(m_JoinGuard);
+
+            if(m_Joined.count(Address))
+            {
+                return nullptr;
+            }
+        }
+
+        auto Found = Pass.Touched.find(Address);
+
+        if(Found == Pass.Touched.end())
+        {
+            TxInfo Info;
+
+            if(!m_DBStorage->GetTxInfo(Address, Info))
+            {
+                return nullptr;
+            }
+
+            Found = Pass.Touched.emplace(Address, Info).first;
+        }
+
+        //Blocks older than the address are not ours to count
+        return Height < Found->second.m_BirthHeight ? nullptr : &Found->second;
+    }
+
+private:
+
+    // Blocks resolved per getblockhash/getblock batch
+    static constexpr int BlocksPerBatch = 16;
+
+    // Committed blocks between intermediate database flushes during long catch-ups
+    static constexpr int CommitInterval = 1000;
+
+    // Most recent blocks kept disconnectable, deeper reorganizations need a rescan
+    static constexpr int UndoBlocks = 100;
+
+    // Transactions per decoding task, blocks below it are decoded by a single worker
+    static constexpr size_t TxsPerChunk = 256;
+
+    DBStorage *m_DBStorage = nullptr;
+    HttpCommunication *m_HttpCommunication = nullptr;
+    WatchSet *m_WatchSet = nullptr;
+
+    UtxoCache m_Utxos;
+
+    // Addresses which joined during the running scan with their birth height, guarded by m_JoinGuard
+    std::unordered_map<std::string, int> m_Joined;
+    bool m_Scanning = false;
+    mutable std::mutex m_JoinGuard;
+
+    BlockDecoder m_Decoder;
+    bool m_UseRawBlocks = false;
+    size_t m_PrefetchBlocks = 0;
+
+    std::atomic<int> m_NextBatch{0};
+
+    // Blocks handed to the decoding pool and not pushed out yet, guarded by m_DecodeGuard
+    size_t m_DecodesInFlight = 0;
+    std::mutex m_DecodeGuard;
+    std::condition_variable m_DecodeCondition;
+
+    // Prefetch window, guarded by m_WindowGuard
+    int m_CommittedHeight = 0;
+    bool m_Stopped = false;
+    std::mutex m_WindowGuard;
+    std::condition_variable m_WindowCondition;
+
+    // Declared last, its workers are joined before the state they use is destroyed
+    WorkStealingPool m_DecodePool;
+};
+
+#endif // BLOCKSCANNER_H
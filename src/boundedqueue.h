@@ -0,0 +1,111 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <queue>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+// Blocking FIFO with a fixed capacity, used to connect pipeline stages.
+// Producers wait while it is full, consumers while it is empty; Close() releases both.
+template <typename T>
+class BoundedQueue
+{
+public:
+
+    BoundedQueue(size_t Capacity) : m_Capacity(Capacity) {}
+
+    // Returns false when the queue was closed
+    bool Push(T &&Item)
+    {
+        std::unique_lock<std::mutex> lock(m_Guard);
+        m_NotFull.wait(lock, [this] { return m_Closed || m_Items.size() < m_Capacity; });
+
+        if(m_Closed)
+        {
+            return false;
+        }
+
+        m_Items.push(std::move(Item));
+        m_MaxDepth = std::max(m_MaxDepth, m_Items.size());
+        m_DepthSum += m_Items.size();
+        m_Pushes++;
+
+        lock.unlock();
+        m_NotEmpty.notify_one();
+
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained
+    bool Pop(T &Item)
+    {
+        std::unique_lock<std::mutex> lock(m_Guard);
+        m_NotEmpty.wait(lock, [this] { return m_Closed || !m_Items.empty(); });
+
+        if(m_Items.empty())
+        {
+            return false;
+        }
+
+        Item = std::move(m_Items.front());
+        m_Items.pop();
+
+        lock.unlock();
+        m_NotFull.notify_one();
+
+        return true;
+    }
+
+    // No more pushes, consumers drain what is left
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+            m_Closed = true;
+        }
+
+        m_NotEmpty.notify_all();
+        m_NotFull.notify_all();
+    }
+
+    // Drops queued items, used when the consumer stops early
+    void Clear()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+            m_Items = std::queue<T>();
+        }
+
+        m_NotFull.notify_all();
+    }
+
+    size_t GetMaxDepth() const
+    {
+        std::lock_guard<std::mutex> lock(m_Guard);
+        return m_MaxDepth;
+    }
+
+    // Mean depth seen by producers right after their push
+    double GetAverageDepth() const
+    {
+        std::lock_guard<std::mutex> lock(m_Guard);
+        return m_Pushes ? static_cast<double>(m_DepthSum) / m_Pushes : 0.0;
+    }
+
+private:
+
+    const size_t m_Capacity;
+    bool m_Closed = false;
+
+    std::queue<T> m_Items;
+
+    size_t m_MaxDepth = 0;
+    size_t m_DepthSum = 0;
+    size_t m_Pushes = 0;
+
+    mutable std::mutex m_Guard;
+    std::condition_variable m_NotEmpty, m_NotFull;
+};
+
+#endif // BOUNDEDQUEUE_H
@@ -0,0 +1,521 @@
+#ifndef BULKIMPORT_H
+#define BULKIMPORT_H
+
+#include <dbstorage.h>
+
+#include <leveldb/env.h>
+#include <leveldb/table_builder.h>
+
+#include <btc/chainparams.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <loggerinstances.h>
+
+// Builds a fresh database from a list of addresses without going through the write path: no WAL, no memtable,
+// no compactions. Input lines are "<address> [birth height]" (birth defaults to 0, a full backfill).
+// Lines are turned into binary keys and sorted in runs that fit in memory, the runs are merged into
+// finished SST files with TableBuilder and RepairDB writes a manifest listing them. Every key is written once.
+//
+// The tables hold LevelDB's internal keys (user key + sequence and type) and filters over the user keys,
+// exactly what the database writes itself. They are installed in level 0; their ranges do not overlap,
+// so LevelDB moves them down the levels without rewriting them.
+class BulkImport
+{
+public:
+
+    struct Stats
+    {
+        size_t Lines = 0;
+        size_t Imported = 0;
+        size_t Duplicates = 0;
+        size_t Invalid = 0;
+        size_t Runs = 0;
+        size_t Tables = 0;
+        uint64_t Bytes = 0;
+    };
+
+    BulkImport(const std::string &DBPath, const StorageProfile &Profile, const btc_chainparams *Chain)
+        : m_DBPath(DBPath),
+          m_Profile(Profile),
+          m_Chain(Chain)
+    {
+        m_Profile.Clamp();
+        plog::init<DBLogger>(GLOBAL_LOG_SEVERITY, "db.log");
+    }
+
+    bool Run(const std::string &InputPath)
+    {
+        const auto Started = std::chrono::steady_clock::now();
+        const std::string DataPath = m_DBPath + "data";
+        Env *FileSystem = Env::Default();
+
+        //Tables are only ever added to an empty database, they would shadow nothing but could be shadowed
+        if(FileSystem->FileExists(DataPath + "/CURRENT"))
+        {
+            PLOG_ERROR_(DBLogger) << "Bulk import needs a fresh database, " << DataPath << " already exists";
+            return false;
+        }
+
+        FileSystem->CreateDir(DataPath);
+        FileSystem->CreateDir(TempPath());
+
+        std::vector<ImportRecord> Records;
+        std::vector<std::unique_ptr<RunReader>> Runs;
+
+        bool Succeed = SortRuns(InputPath, Records, Runs) && MergeRuns(Records, Runs, DataPath);
+
+        Runs.clear();
+        RemoveRuns();
+
+        if(Succeed)
+        {
+            Options options = TableOptions();
+            options.filter_policy = m_UserFilter.get();
+
+            const Status Result = RepairDB(DataPath, options);
+            Succeed = Result.ok();
+
+            PLOG_ERROR_IF_(DBLogger, !Succeed) << "Failed to install the imported tables: " << Result.ToString();
+        }
+
+        PLOG_INFO_IF_(DBLogger, Succeed) << "Imported " << m_Stats.Imported << " addresses into " << m_Stats.Tables << " tables ("
+                                         << m_Stats.Bytes / 1048576 << " MB) in " << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - Started).count()
+                                         << " s, " << m_Stats.Duplicates << " duplicates, " << m_Stats.Invalid << " invalid lines, " << m_Stats.Runs << " sorted runs";
+
+        return Succeed;
+    }
+
+    const Stats &GetStats() const
+    {
+        return m_Stats;
+    }
+
+private:
+
+    // Fixed size, runs are written and read back as raw records
+    struct ImportRecord
+    {
+        uint8_t Size = 0;
+        uint8_t Key[33];
+        int32_t BirthHeight = 0;
+
+        Slice GetKey() const
+        {
+            return Slice(reinterpret_cast<const char*>(Key), Size);
+        }
+
+        // Equal keys keep the earliest birth first, it is the one kept
+        bool operator<(const ImportRecord &Other) const
+        {
+            const int Order = GetKey().compare(Other.GetKey());
+            return Order < 0 || (Order == 0 && BirthHeight < Other.BirthHeight);
+        }
+    };
+
+    // A sorted run, from its file or from memory
+    class RunReader
+    {
+    public:
+
+        explicit RunReader(const std::string &Path)
+            : m_File(fopen(Path.c_str(), "rb"))
+        {
+        }
+
+        explicit RunReader(std::vector<ImportRecord> &&Records)
+            : m_Buffer(std::move(Records))
+        {
+        }
+
+        ~RunReader()
+        {
+            if(m_File) fclose(m_File);
+        }
+
+        bool Next(ImportRecord &Record)
+        {
+            if(m_Position == m_Buffer.size())
+            {
+                if(!m_File)
+                {
+                    return false;
+                }
+
+                m_Buffer.resize(ReadAhead);
+                m_Buffer.resize(fread(m_Buffer.data(), sizeof (ImportRecord), ReadAhead, m_File));
+                m_Position = 0;
+
+                if(m_Buffer.empty())
+                {
+                    return false;
+                }
+            }
+
+            Record = m_Buffer[m_Position++];
+            return true;
+        }
+
+        bool IsOpen() const
+        {
+            return m_File || !m_Buffer.empty();
+        }
+
+    private:
+
+        static constexpr size_t ReadAhead = 65536;
+
+        FILE *m_File = nullptr;
+        std::vector<ImportRecord> m_Buffer;
+        size_t m_Position = 0;
+    };
+
+    // Orders internal keys the way the database does: user key ascending, then sequence descending.
+    // Separators are left as they are, shortening them is only an optimization.
+    class InternalKeyOrder : public Comparator
+    {
+    public:
+
+        int Compare(const Slice &Left, const Slice &Right) const override
+        {
+            const int Order = UserKey(Left).compare(UserKey(Right));
+
+            if(Order != 0)
+            {
+                return Order;
+            }
+
+            const uint64_t LeftTag = Tag(Left), RightTag = Tag(Right);
+            return LeftTag > RightTag ? -1 : LeftTag < RightTag ? 1 : 0;
+        }
+
+        const char *Name() const override
+        {
+            return "leveldb.InternalKeyComparator";
+        }
+
+        void FindShortestSeparator(std::string*, const Slice&) const override
+        {
+        }
+
+        void FindShortSuccessor(std::string*) const override
+        {
+        }
+
+    private:
+
+        static uint64_t Tag(const Slice &Key)
+        {
+            uint64_t Value = 0;
+            memcpy(&Value, Key.data() + Key.size() - 8, 8);
+            return Value;
+        }
+    };
+
+    // The database builds table filters over user keys under the user policy's name, so must we
+    class UserKeyFilter : public FilterPolicy
+    {
+    public:
+
+        explicit UserKeyFilter(const FilterPolicy *Policy)
+            : m_Policy(Policy)
+        {
+        }
+
+        const char *Name() const override
+        {
+            return m_Policy->Name();
+        }
+
+        void CreateFilter(const Slice *Keys, int Count, std::string *Filter) const override
+        {
+            std::vector<Slice> UserKeys(Keys, Keys + Count);
+
+            for(auto &Key : UserKeys)
+            {
+                Key = UserKey(Key);
+            }
+
+            m_Policy->CreateFilter(UserKeys.data(), Count, Filter);
+        }
+
+        bool KeyMayMatch(const Slice &Key, const Slice &Filter) const override
+        {
+            return m_Policy->KeyMayMatch(UserKey(Key), Filter);
+        }
+
+    private:
+
+        const FilterPolicy *m_Policy;
+    };
+
+    // Records per sorted run, about 40 MB
+    static constexpr size_t RunRecords = 1 << 20;
+
+    // Tables are made larger than the compaction output, level 0 must stay below LevelDB's write slowdown
+    // trigger (8 files) for imports up to a few hundred MB
+    static constexpr uint64_t MinTableBytes = 64ull * 1048576;
+
+    // Sequence number of every imported record, the database continues after it; kTypeValue
+    static constexpr uint64_t ImportTag = (1ull << 8) | 1;
+
+    static Slice UserKey(const Slice &InternalKey)
+    {
+        return Slice(InternalKey.data(), InternalKey.size() - 8);
+    }
+
+    std::string TempPath() const
+    {
+        return m_DBPath + "import.tmp";
+    }
+
+    std::string RunPath(size_t Run) const
+    {
+        return TempPath() + "/run-" + std::to_string(Run);
+    }
+
+    Options TableOptions()
+    {
+        if(m_Profile.BloomBitsPerKey > 0 && !m_UserFilter)
+        {
+            m_UserFilter.reset(NewBloomFilterPolicy(m_Profile.BloomBitsPerKey));
+        }
+
+        Options options;
+        options.block_size = m_Profile.BlockSizeKB * 1024;
+        options.compression = m_Profile.Compression ? kSnappyCompression : kNoCompression;
+        options.max_file_size = m_Profile.MaxFileSizeMB * 1048576;
+
+        return options;
+    }
+
+    // Reads the input into sorted runs, spilled to files while more input follows. The last run stays in Records.
+    bool SortRuns(const std::string &InputPath, std::vector<ImportRecord> &Records, std::vector<std::unique_ptr<RunReader>> &Runs)
+    {
+        std::ifstream Input(InputPath);
+
+        if(!Input)
+        {
+            PLOG_ERROR_(DBLogger) << "Cannot open import file " << InputPath;
+            return false;
+        }
+
+        std::string Line, Key;
+        Records.reserve(RunRecords);
+
+        while(std::getline(Input, Line))
+        {
+            m_Stats.Lines++;
+
+            const size_t Start = Line.find_first_not_of(" \t\r");
+
+            if(Start == std::string::npos || Line[Start] == '#')
+            {
+                continue;
+            }
+
+            const size_t End = std::min(Line.find_first_of(" \t\r,;", Start), Line.size());
+            const std::string Address = Line.substr(Start, End - Start);
+
+            ImportRecord Record;
+
+            if(!AddressToKey(Address, m_Chain, Key))
+            {
+                PLOG_WARNING_IF_(DBLogger, m_Stats.Invalid < 100) << "Not an address of this chain, line " << m_Stats.Lines << ": " << Address;
+                m_Stats.Invalid++;
+                continue;
+            }
+
+            Record.Size = static_cast<uint8_t>(Key.size());
+            memcpy(Record.Key, Key.data(), Key.size());
+            Record.BirthHeight = End < Line.size() ? std::max(atoi(Line.c_str() + End + 1), 0) : 0;
+
+            Records.push_back(Record);
+
+            if(Records.size() == RunRecords && !SpillRun(Records, Runs))
+            {
+                return false;
+            }
+        }
+
+        std::sort(Records.begin(), Records.end());
+        m_Stats.Runs = Runs.size() + 1;
+
+        return true;
+    }
+
+    bool SpillRun(std::vector<ImportRecord> &Records, std::vector<std::unique_ptr<RunReader>> &Runs)
+    {
+        std::sort(Records.begin(), Records.end());
+
+        const std::string Path = RunPath(Runs.size());
+        FILE *File = fopen(Path.c_str(), "wb");
+
+        if(!File || fwrite(Records.data(), sizeof (ImportRecord), Records.size(), File) != Records.size())
+        {
+            PLOG_ERROR_(DBLogger) << "Failed to write sorted run " << Path;
+            if(File) fclose(File);
+            return false;
+        }
+
+        fclose(File);
+        Records.clear();
+
+        Runs.emplace_back(new RunReader(Path));
+
+        if(!Runs.back()->IsOpen())
+        {
+            PLOG_ERROR_(DBLogger) << "Failed to reopen sorted run " << Path;
+            return false;
+        }
+
+        return true;
+    }
+
+    void RemoveRuns()
+    {
+        Env *FileSystem = Env::Default();
+        std::vector<std::string> Files;
+
+        FileSystem->GetChildren(TempPath(), &Files);
+
+        for(auto &File : Files)
+        {
+            if(File != "." && File != "..") FileSystem->DeleteFile(TempPath() + "/" + File);
+        }
+
+        FileSystem->DeleteDir(TempPath());
+    }
+
+    // K-way merge of the runs into tables, duplicates dropped, then the schema record
+    bool MergeRuns(std::vector<ImportRecord> &Records, std::vector<std::unique_ptr<RunReader>> &Runs, const std::string &DataPath)
+    {
+        Runs.emplace_back(new RunReader(std::move(Records)));
+
+        typedef std::pair<ImportRecord, size_t> HeapEntry;
+        auto Later = [](const HeapEntry &Left, const HeapEntry &Right) { return Right.first < Left.first; };
+        std::priority_queue<HeapEntry, std::vector<HeapEntry>, decltype(Later)> Heap(Later);
+
+        for(size_t Run = 0; Run < Runs.size(); ++Run)
+        {
+            ImportRecord First;
+            if(Runs[Run]->Next(First)) Heap.emplace(First, Run);
+        }
+
+        Options options = TableOptions();
+        InternalKeyOrder Order;
+        std::unique_ptr<UserKeyFilter> Filter(m_UserFilter ? new UserKeyFilter(m_UserFilter.get()) : nullptr);
+
+        options.comparator = &Order;
+        options.filter_policy = Filter.get();
+
+        const uint64_t TableBytes = std::max<uint64_t>(options.max_file_size, MinTableBytes);
+
+        std::unique_ptr<WritableFile> File;
+        std::unique_ptr<TableBuilder> Builder;
+        std::string LastKey, InternalKey;
+        bool HasLast = false;
+
+        auto Add = [&](const Slice &Key, const Slice &Value) -> bool
+        {
+            if(!Builder && !OpenTable(DataPath, options, File, Builder))
+            {
+                return false;
+            }
+
+            InternalKey.assign(Key.data(), Key.size());
+            InternalKey.append(reinterpret_cast<const char*>(&ImportTag), 8);
+            Builder->Add(InternalKey, Value);
+
+            return Builder->FileSize() < TableBytes || CloseTable(File, Builder);
+        };
+
+        while(!Heap.empty())
+        {
+            const HeapEntry Top = Heap.top();
+            Heap.pop();
+
+            ImportRecord Next;
+            if(Runs[Top.second]->Next(Next)) Heap.emplace(Next, Top.second);
+
+            if(HasLast && Top.first.GetKey() == Slice(LastKey))
+            {
+                m_Stats.Duplicates++;
+                continue;
+            }
+
+            LastKey.assign(Top.first.GetKey().data(), Top.first.GetKey().size());
+            HasLast = true;
+
+            if(!Add(Top.first.GetKey(), TxInfo(Top.first.BirthHeight, 0).Serialize()))
+            {
+                return false;
+            }
+
+            m_Stats.Imported++;
+        }
+
+        //Meta keys sort after the address keys, the schema record closes the last table
+        std::string Schema;
+        PutVarint(Schema, DB_SCHEMA_VERSION);
+
+        return Add(SCHEMA_KEY, Schema) && (!Builder || CloseTable(File, Builder));
+    }
+
+    bool OpenTable(const std::string &DataPath, const Options &options, std::unique_ptr<WritableFile> &File, std::unique_ptr<TableBuilder> &Builder)
+    {
+        //LevelDB table file name, numbers only have to be unique, RepairDB takes the next free ones for itself
+        char Name[32];
+        snprintf(Name, sizeof (Name), "/%06llu.ldb", static_cast<unsigned long long>(++m_Stats.Tables));
+
+        WritableFile *Opened = nullptr;
+        const Status Result = Env::Default()->NewWritableFile(DataPath + Name, &Opened);
+
+        if(!Result.ok())
+        {
+            PLOG_ERROR_(DBLogger) << "Failed to create table " << DataPath + Name << ": " << Result.ToString();
+            return false;
+        }
+
+        File.reset(Opened);
+        Builder.reset(new TableBuilder(options, File.get()));
+
+        return true;
+    }
+
+    bool CloseTable(std::unique_ptr<WritableFile> &File, std::unique_ptr<TableBuilder> &Builder)
+    {
+        Status Result = Builder->Finish();
+
+        if(Result.ok()) Result = File->Sync();
+        if(Result.ok()) Result = File->Close();
+
+        m_Stats.Bytes += Builder->FileSize();
+
+        Builder.reset();
+        File.reset();
+
+        PLOG_ERROR_IF_(DBLogger, !Result.ok()) << "Failed to finish table " << m_Stats.Tables << ": " << Result.ToString();
+
+        return Result.ok();
+    }
+
+private:
+
+    std::string m_DBPath;
+    StorageProfile m_Profile;
+    const btc_chainparams *m_Chain = nullptr;
+    std::unique_ptr<const FilterPolicy> m_UserFilter;
+    Stats m_Stats;
+};
+
+#endif // BULKIMPORT_H
@@ -4,183 +4,1719 @@
 #include <leveldb/db.h>
 #include <leveldb/cache.h>
 #include <leveldb/comparator.h>
+#include <leveldb/filter_policy.h>
 #include <leveldb/write_batch.h>
 #include <leveldb/iterator.h>
 
+#include <btc/base58.h>
+#include <btc/chainparams.h>
+#include <btc/segwit_addr.h>
+
+#include <balancecache.h>
 #include <loggerinstances.h>
 
 #include <unordered_map>
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <string>
+#include <sstream>
 #include <iostream>
 
 using namespace leveldb;
 
+// Unsigned LEB128, at most 10 bytes
+static inline void PutVarint(std::string &Out, uint64_t Value)
+{
+    while(Value >= 0x80)
+    {
+        Out.push_back(static_cast<char>((Value & 0x7F) | 0x80));
+        Value >>= 7;
+    }
+
+    Out.push_back(static_cast<char>(Value));
+}
+
+static inline bool GetVarint(Slice &In, uint64_t &Value)
+{
+    Value = 0;
+
+    for(int Shift = 0; Shift < 64 && !In.empty(); Shift += 7)
+    {
+        const uint8_t Byte = static_cast<uint8_t>(In[0]);
+        In.remove_prefix(1);
+        Value |= static_cast<uint64_t>(Byte & 0x7F) << Shift;
+
+        if(!(Byte & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Signed values are zigzag mapped first, small negatives stay short
+static inline void PutSignedVarint(std::string &Out, int64_t Value)
+{
+    PutVarint(Out, (static_cast<uint64_t>(Value) << 1) ^ static_cast<uint64_t>(Value >> 63));
+}
+
+static inline bool GetSignedVarint(Slice &In, int64_t &Value)
+{
+    uint64_t Encoded = 0;
+
+    if(!GetVarint(In, Encoded))
+    {
+        return false;
+    }
+
+    Value = static_cast<int64_t>(Encoded >> 1) ^ -static_cast<int64_t>(Encoded & 1);
+    return true;
+}
+
+static inline bool GetSignedVarint(Slice &In, int &Value)
+{
+    int64_t Wide = 0;
+
+    if(!GetSignedVarint(In, Wide) || Wide < INT_MIN || Wide > INT_MAX)
+    {
+        return false;
+    }
+
+    Value = static_cast<int>(Wide);
+    return true;
+}
+
+static inline bool GetBytes(Slice &In, void *Out, size_t Size)
+{
+    if(In.size() < Size)
+    {
+        return false;
+    }
+
+    memcpy(Out, In.data(), Size);
+    In.remove_prefix(Size);
+    return true;
+}
+
+// Length prefixed text of a NUL terminated buffer, the terminator is not stored
+static inline void PutText(std::string &Out, const char *Text, size_t BufferSize)
+{
+    const size_t Size = strnlen(Text, BufferSize - 1);
+
+    PutVarint(Out, Size);
+    Out.append(Text, Size);
+}
+
+static inline bool GetText(Slice &In, char *Text, size_t BufferSize)
+{
+    uint64_t Size = 0;
+
+    if(!GetVarint(In, Size) || Size >= BufferSize || !GetBytes(In, Text, Size))
+    {
+        return false;
+    }
+
+    memset(Text + Size, 0, BufferSize - Size);
+    return true;
+}
+
+// Outputs in blocks below the birth height are never credited to the address.
+// Records written before the scan cursor existed kept their last scanned block here, which keeps the same meaning.
 struct TxInfo
 {
+    // Record layout: varint version, then the fields of that version as varints. A new version only appends
+    // fields, older code reads the ones it knows and ignores the tail.
+    static constexpr uint64_t Version = 1;
+
     TxInfo()
     {
-        m_LastScannedBlockNum = 0;
+        m_BirthHeight = 0;
         m_Balance = -1;
     }
 
-    TxInfo(int LastScannedBlockNum, int Balance)
+    TxInfo(int BirthHeight, int64_t Balance)
+    {
+        m_BirthHeight = BirthHeight;
+        m_Balance = Balance;
+    }
+
+    std::string Serialize() const
+    {
+        std::string Data;
+
+        PutVarint(Data, Version);
+        PutSignedVarint(Data, m_BirthHeight);
+        PutSignedVarint(Data, m_Balance);
+
+        return Data;
+    }
+
+    bool Deserialize(Slice Data)
     {
-        m_LastScannedBlockNum = LastScannedBlockNum;
+        uint64_t RecordVersion = 0;
+        int BirthHeight = 0;
+        int64_t Balance = 0;
+
+        //A birth height outside int is a corrupt record, not one to truncate
+        if(!GetVarint(Data, RecordVersion) || RecordVersion < 1 || !GetSignedVarint(Data, BirthHeight) || !GetSignedVarint(Data, Balance))
+        {
+            return false;
+        }
+
+        m_BirthHeight = BirthHeight;
         m_Balance = Balance;
+
+        return true;
+    }
+
+    // Unversioned records of the string-keyed schema: the raw struct of two ints, empty for bare addresses
+    bool DeserializeLegacy(const Slice &Data)
+    {
+        int32_t Fields[2] = { 0, -1 };
+
+        if(Data.size() != 0 && Data.size() != sizeof (Fields))
+        {
+            return false;
+        }
+
+        memcpy(Fields, Data.data(), Data.size());
+        m_BirthHeight = Fields[0];
+        m_Balance = Fields[1];
+
+        return true;
     }
 
-    int m_LastScannedBlockNum;
-    int m_Balance;
+    int m_BirthHeight;
+    int64_t m_Balance;
 };
 
-class DBStorage
+// Chain position shared by all addresses: blocks below m_Height are applied, m_BlockHash is the hash of block m_Height - 1
+// Record layout as TxInfo's: varint version, signed varint height, length prefixed hash.
+struct ScanCursor
 {
-public:
+    static constexpr uint64_t Version = 1;
 
-    DBStorage(const std::string &DBPath = "/tmp/", size_t DBCacheSize = 32)
+    std::string Serialize() const
     {
-        m_DBPath = DBPath;
-        m_DBCacheSize = DBCacheSize;
+        std::string Data;
 
-        InitDatabase();
-        InitLogger();
+        PutVarint(Data, Version);
+        PutSignedVarint(Data, m_Height);
+        PutText(Data, m_BlockHash, sizeof (m_BlockHash));
+
+        return Data;
     }
 
-    ~DBStorage()
+    bool Deserialize(Slice Data)
     {
-        CloseDatabase();
+        uint64_t RecordVersion = 0;
+        ScanCursor Cursor;
+
+        if(!GetVarint(Data, RecordVersion) || RecordVersion < 1 || !GetSignedVarint(Data, Cursor.m_Height) ||
+           !GetText(Data, Cursor.m_BlockHash, sizeof (Cursor.m_BlockHash)))
+        {
+            return false;
+        }
+
+        *this = Cursor;
+        return true;
     }
-    // NO additional thread sync needed as for leveldb readme.
 
-    // Adding an one address at once
-    inline bool AddAddress(const std::string &Address)
+    int m_Height = 0;
+    char m_BlockHash[65] = {0};
+};
+
+// Blocks [m_From, m_To) still to be scanned for an address which joined below the cursor.
+// Record layout: varint version, then both heights as signed varints.
+struct BackfillRange
+{
+    static constexpr uint64_t Version = 1;
+
+    std::string Serialize() const
     {
-        Status Result;
-        if(data) Result = data->Put(WriteOptions(), Slice(Address), Slice());
+        std::string Data;
 
-        PLOG_VERBOSE_IF_(DBLogger, Result.ok()) << "Added new address to database: " << Address;
-        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error adding new address to database: " << Address;
+        PutVarint(Data, Version);
+        PutSignedVarint(Data, m_From);
+        PutSignedVarint(Data, m_To);
 
-        return Result.ok();
+        return Data;
     }
 
-    // Adding a bunch of addresses at a time (faster)
-    inline bool AddAddresses(const std::vector<std::string> &Addresses)
+    bool Deserialize(Slice Data)
     {
-        Status Result;
-        WriteBatch Batch;
+        uint64_t RecordVersion = 0;
+        BackfillRange Range;
 
-        for(auto &Address : Addresses)
+        if(!GetVarint(Data, RecordVersion) || RecordVersion < 1 || !GetSignedVarint(Data, Range.m_From) || !GetSignedVarint(Data, Range.m_To))
         {
-            Batch.Put(Address, Slice());
+            return false;
         }
 
-        if(data) Result = data->Write(WriteOptions(), &Batch);
+        *this = Range;
+        return true;
+    }
 
-        PLOG_VERBOSE_IF_(DBLogger, Result.ok()) << "Added new batch of addresses to database.";
-        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error adding batch of addresses to database.";
+    int m_From = 0;
+    int m_To = 0;
+};
 
-        return Result.ok();
-    }
+//-1 while the cursor has not reached the address or its backfill is pending
+static inline int64_t ReportedBalance(const TxInfo &Info, const ScanCursor *Cursor, bool Backfilling)
+{
+    const bool Scanned = Cursor && Cursor->m_Height >= Info.m_BirthHeight && !Backfilling;
+    return Scanned ? std::max<int64_t>(Info.m_Balance, 0) : -1;
+}
 
-    // Add/update an one TxInfo at a time
-    inline bool UpdateTxInfo(const std::string &Address, const TxInfo &UpdatedInfo)
+// Watched output which is not spent yet.
+// Record layout: varint version, then the fields: 20 hash bytes, value and height as signed varints.
+struct UtxoEntry
+{
+    static constexpr uint64_t Version = 1;
+
+    std::string Serialize() const
     {
-        Status Result;
+        std::string Data;
 
-        if(data) Result = data->Put(WriteOptions(), Slice(Address), Slice(reinterpret_cast<const char*>(&UpdatedInfo), sizeof (UpdatedInfo)));
+        PutVarint(Data, Version);
+        AppendFields(Data);
 
-        PLOG_VERBOSE_IF_(DBLogger,Result.ok()) << "Added new txinfo to database: " << UpdatedInfo.m_LastScannedBlockNum;
-        PLOG_WARNING_IF_(DBLogger,!Result.ok()) << "Error adding new txinfo to database: " << UpdatedInfo.m_LastScannedBlockNum;
+        return Data;
+    }
 
-        return Result.ok();
+    bool Deserialize(Slice Data)
+    {
+        uint64_t RecordVersion = 0;
+        return GetVarint(Data, RecordVersion) && RecordVersion >= 1 && ReadFields(Data);
     }
 
-    // Add a bunch of pairs address:TxInfo to DB (faster)
-    inline bool UpdateTxInfos(const std::unordered_map<std::string, TxInfo> &UpdatedInfos)
+    // The fields without a version, undo records embed them
+    void AppendFields(std::string &Data) const
     {
-        Status Result;
-        WriteBatch Batch;
+        Data.append(reinterpret_cast<const char*>(m_Hash160), sizeof (m_Hash160));
+        PutSignedVarint(Data, m_Value);
+        PutSignedVarint(Data, m_Height);
+    }
 
-        for(auto &Pair : UpdatedInfos)
+    bool ReadFields(Slice &Data)
+    {
+        UtxoEntry Entry;
+
+        if(!GetBytes(Data, Entry.m_Hash160, sizeof (Entry.m_Hash160)) || !GetSignedVarint(Data, Entry.m_Value) || !GetSignedVarint(Data, Entry.m_Height))
         {
-            Batch.Put(Pair.first, Slice(reinterpret_cast<const char*>(&Pair.second), sizeof (Pair.second)));
+            return false;
         }
 
-        if(data) Result = data->Write(WriteOptions(), &Batch);
+        *this = Entry;
+        return true;
+    }
 
-        PLOG_VERBOSE_IF_(DBLogger,Result.ok()) << "Added new batch of addresses and TxInfos to database.";
-        PLOG_WARNING_IF_(DBLogger,!Result.ok()) << "Error adding batch of addresses and TxInfos to database.";
+    uint8_t m_Hash160[20] = {0};
+    int64_t m_Value = 0;
+    int m_Height = 0;
+};
 
-        return Result.ok();
+// UTXO records to write and erase in one commit
+struct UtxoChanges
+{
+    std::vector<std::pair<std::string, UtxoEntry>> Added;
+    std::vector<std::string> Spent;
+};
+
+// Meta records live next to the address records, '#' is outside the Base58 and Bech32 alphabets
+static const char META_KEY_PREFIX = '#';
+static const std::string SCHEMA_KEY = "#schema";
+static const std::string CURSOR_KEY = "#cursor";
+static const std::string BACKFILL_KEY_PREFIX = "#backfill/";
+static const std::string UTXO_KEY_PREFIX = "#utxo/";
+static const std::string UNDO_KEY_PREFIX = "#undo/";
+static const std::string HD_INDEX_KEY = "#hdindex";
+
+// Big endian height, undo records sort by height
+static inline std::string UndoKey(int Height)
+{
+    std::string Key = UNDO_KEY_PREFIX;
+
+    for(int Byte = 3; Byte >= 0; --Byte)
+    {
+        Key.push_back(static_cast<char>((static_cast<uint32_t>(Height) >> (8 * Byte)) & 0xFF));
+    }
+
+    return Key;
+}
+
+// Prefix + 32-byte txid (internal byte order) + little endian output index
+static inline std::string UtxoKey(const uint8_t *TxId, uint32_t Index)
+{
+    std::string Key = UTXO_KEY_PREFIX;
+    Key.append(reinterpret_cast<const char*>(TxId), 32);
+
+    for(int Byte = 0; Byte < 4; ++Byte)
+    {
+        Key.push_back(static_cast<char>((Index >> (8 * Byte)) & 0xFF));
     }
 
-    inline bool GetTxInfo(const std::string &Address, TxInfo &Info) const
+    return Key;
+}
+
+// HD index record: varint version, then the next derivation index as a varint
+static inline std::string EncodeHdIndex(uint32_t Index)
+{
+    std::string Data;
+
+    PutVarint(Data, 1);
+    PutVarint(Data, Index);
+
+    return Data;
+}
+
+static inline bool DecodeHdIndex(Slice Data, uint32_t &Index)
+{
+    uint64_t RecordVersion = 0, Value = 0;
+
+    if(!GetVarint(Data, RecordVersion) || RecordVersion < 1 || !GetVarint(Data, Value) || Value > UINT32_MAX)
     {
-        Status Result;
-        std::string Data;
-        if(data) Result = data->Get(ReadOptions(), Address, &Data);
+        return false;
+    }
 
-        if(Result.ok())
+    Index = static_cast<uint32_t>(Value);
+    return true;
+}
+
+static inline bool IsMetaKey(const Slice &Key)
+{
+    return !Key.empty() && Key[0] == META_KEY_PREFIX;
+}
+
+// Schema 1 keyed address records by their text, schema 2 by type and hash
+static constexpr uint64_t DB_SCHEMA_VERSION = 2;
+
+// Address record key: the address type, then its 20-byte hash or witness program.
+// Types sort before '#' and the printable characters the text keys of schema 1 start with.
+// P2WSH keys are reserved: the watch set and the output matcher only know 20-byte hashes, so such an
+// address could be stored but never credited. AddressToKey refuses it.
+enum AddressKeyType : uint8_t
+{
+    ADDRESS_KEY_P2PKH = 0x01,
+    ADDRESS_KEY_P2SH = 0x02,
+    ADDRESS_KEY_P2WPKH = 0x03,
+    ADDRESS_KEY_P2WSH = 0x04
+};
+
+static inline bool IsAddressKey(const Slice &Key)
+{
+    return !Key.empty() && static_cast<uint8_t>(Key[0]) >= ADDRESS_KEY_P2PKH && static_cast<uint8_t>(Key[0]) <= ADDRESS_KEY_P2WSH;
+}
+
+// Address record of schema 1
+static inline bool IsLegacyAddressKey(const Slice &Key)
+{
+    return !Key.empty() && !IsMetaKey(Key) && static_cast<uint8_t>(Key[0]) >= '0';
+}
+
+static bool AddressToKey(const std::string &Address, const btc_chainparams *Chain, std::string &Key)
+{
+    uint8_t Decoded[64];
+
+    //Version byte + hash160 + 4 checksum bytes
+    if(btc_base58_decode_check(Address.c_str(), Decoded, sizeof (Decoded)) == 25)
+    {
+        if(Decoded[0] != Chain->b58prefix_pubkey_address && Decoded[0] != Chain->b58prefix_script_address)
         {
-            memcpy((void*)&Info, (const void*)Data.data(), Data.size());
-            return true;
+            return false;
         }
 
+        Key.assign(1, static_cast<char>(Decoded[0] == Chain->b58prefix_pubkey_address ? ADDRESS_KEY_P2PKH : ADDRESS_KEY_P2SH));
+        Key.append(reinterpret_cast<const char*>(Decoded + 1), 20);
+        return true;
+    }
+
+    int WitnessVersion = 0;
+    size_t ProgramSize = 0;
+
+    if(!segwit_addr_decode(&WitnessVersion, Decoded, &ProgramSize, Chain->bech32_hrp, Address.c_str()) || WitnessVersion != 0)
+    {
         return false;
     }
 
-    // Iterate all saved addresses (may be slow on big database)
-    bool GetAllAddresses(std::vector<std::string> &Addresses)
+    if(ProgramSize == 32)
     {
-        leveldb::Iterator *it = data->NewIterator(ReadOptions());
+        PLOG_WARNING_(DBLogger) << "P2WSH addresses cannot be watched, refused: " << Address;
+        return false;
+    }
 
-        for (it->SeekToFirst(); it->Valid(); it->Next())
-        {
-           Addresses.push_back(it->key().ToString());
-        }
+    if(ProgramSize != 20)
+    {
+        return false;
+    }
+
+    Key.assign(1, static_cast<char>(ADDRESS_KEY_P2WPKH));
+    Key.append(reinterpret_cast<const char*>(Decoded), ProgramSize);
+    return true;
+}
+
+static bool KeyToAddress(const Slice &Key, const btc_chainparams *Chain, std::string &Address)
+{
+    if(!IsAddressKey(Key))
+    {
+        return false;
+    }
 
-        delete it;
+    const uint8_t Type = static_cast<uint8_t>(Key[0]);
+    const uint8_t *Hash = reinterpret_cast<const uint8_t*>(Key.data() + 1);
+    const size_t HashSize = Key.size() - 1;
+
+    if(Type == ADDRESS_KEY_P2PKH || Type == ADDRESS_KEY_P2SH)
+    {
+        uint8_t Payload[1 + 20];
+        //Max bitcoin raw address length, for not nulling this string from garbage symbols tailing \000
+        char Encoded[36];
 
-        if(Addresses.size() > 0)
+        if(HashSize != 20)
         {
-            return true;
+            return false;
         }
-        else
+
+        Payload[0] = Type == ADDRESS_KEY_P2PKH ? Chain->b58prefix_pubkey_address : Chain->b58prefix_script_address;
+        memcpy(Payload + 1, Hash, HashSize);
+
+        if(!btc_base58_encode_check(Payload, sizeof (Payload), Encoded, sizeof (Encoded)))
         {
             return false;
         }
+
+        Address = Encoded;
+        return true;
     }
 
-    std::unique_ptr<leveldb::Iterator> GetDbIterator() const
+    //Human readable part, separator, 32-byte program and checksum fit easily
+    char Encoded[128];
+
+    if(HashSize != (Type == ADDRESS_KEY_P2WPKH ? 20u : 32u) || !segwit_addr_encode(Encoded, Chain->bech32_hrp, 0, Hash, HashSize))
     {
-        return std::unique_ptr<leveldb::Iterator>(data->NewIterator(ReadOptions()));
+        return false;
     }
 
-private:
+    Address = Encoded;
+    return true;
+}
 
-    DB* data;
-    size_t m_DBCacheSize = 0;
+// Watched outputs one block created and spent, enough to disconnect it again.
+// Keys are full UTXO keys.
+struct BlockUndo
+{
+    int m_Height = 0;
+    char m_BlockHash[65] = {0};
+    char m_PrevBlockHash[65] = {0};
+    std::vector<std::pair<std::string, UtxoEntry>> m_Created;
+    std::vector<std::pair<std::string, UtxoEntry>> m_Spent;
 
-    void InitDatabase()
+    // Record layout: varint version, signed varint height, both hashes length prefixed, varint counts of
+    // created and spent outputs, then per entry the 36 key bytes after the prefix and the UtxoEntry fields
+    static constexpr uint64_t Version = 1;
+
+    std::string Serialize() const
     {
-        Options options;
-        options.create_if_missing = true;
-        options.compression = kNoCompression;
+        std::string Data;
 
-        if (m_DBCacheSize)
+        PutVarint(Data, Version);
+        PutSignedVarint(Data, m_Height);
+        PutText(Data, m_BlockHash, sizeof (m_BlockHash));
+        PutText(Data, m_PrevBlockHash, sizeof (m_PrevBlockHash));
+        PutVarint(Data, m_Created.size());
+        PutVarint(Data, m_Spent.size());
+
+        for(auto *Entries : { &m_Created, &m_Spent })
         {
-            options.block_cache = NewLRUCache(m_DBCacheSize * 1048576);
+            for(auto &Pair : *Entries)
+            {
+                Data.append(Pair.first, UTXO_KEY_PREFIX.size(), std::string::npos);
+                Pair.second.AppendFields(Data);
+            }
         }
 
-        Status status = DB::Open(options, m_DBPath + "data", &data);
+        return Data;
+    }
 
-        PLOG_VERBOSE_IF_(DBLogger, status.ok()) << "Database opened/created at: " << m_DBPath + "data";
-        PLOG_WARNING_IF_(DBLogger, !status.ok()) << "Error opening/creating the database at: " << m_DBPath + "data";
+    bool Deserialize(Slice Data)
+    {
+        uint64_t RecordVersion = 0, Counts[2] = { 0, 0 };
+        BlockUndo Block;
 
-        assert(status.ok());
+        if(!GetVarint(Data, RecordVersion) || RecordVersion < 1 || !GetSignedVarint(Data, Block.m_Height) ||
+           !GetText(Data, Block.m_BlockHash, sizeof (Block.m_BlockHash)) || !GetText(Data, Block.m_PrevBlockHash, sizeof (Block.m_PrevBlockHash)) ||
+           !GetVarint(Data, Counts[0]) || !GetVarint(Data, Counts[1]))
+        {
+            return false;
+        }
+
+        //Every entry takes at least its key and hash, a corrupt count cannot allocate more than the record holds
+        const uint64_t MinEntrySize = 36 + sizeof (UtxoEntry::m_Hash160) + 2;
+
+        if(Counts[0] > Data.size() / MinEntrySize || Counts[1] > Data.size() / MinEntrySize - Counts[0])
+        {
+            return false;
+        }
+
+        Block.m_Created.resize(Counts[0]);
+        Block.m_Spent.resize(Counts[1]);
+
+        for(auto *Entries : { &Block.m_Created, &Block.m_Spent })
+        {
+            for(auto &Pair : *Entries)
+            {
+                char Key[36];
+
+                if(!GetBytes(Data, Key, sizeof (Key)) || !Pair.second.ReadFields(Data))
+                {
+                    return false;
+                }
+
+                Pair.first = UTXO_KEY_PREFIX + std::string(Key, sizeof (Key));
+            }
+        }
+
+        *this = std::move(Block);
+        return true;
+    }
+};
+
+// Undo records to write and erase in one commit
+struct UndoChanges
+{
+    std::vector<BlockUndo> Added;
+    std::vector<int> Removed;
+};
+
+// never: the log is left to the OS, a process crash loses nothing, a power loss the last commits.
+// scan: commits of the scanner, which carry the cursor, are synced; they include any small writes
+//       grouped with them.
+// always: every commit group is synced, writers arriving meanwhile share the next fsync.
+enum CommitSync
+{
+    COMMIT_SYNC_NEVER,
+    COMMIT_SYNC_SCAN,
+    COMMIT_SYNC_ALWAYS
+};
+
+static bool CommitSyncFromName(const std::string &Name, CommitSync &Sync)
+{
+    static const char *Names[] = { "never", "scan", "always" };
+
+    for(int Index = 0; Index < 3; ++Index)
+    {
+        if(Name == Names[Index])
+        {
+            Sync = static_cast<CommitSync>(Index);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static const char *CommitSyncName(CommitSync Sync)
+{
+    return Sync == COMMIT_SYNC_NEVER ? "never" : Sync == COMMIT_SYNC_SCAN ? "scan" : "always";
+}
+
+// LevelDB settings the database is opened with. Sizes are clamped to the ranges LevelDB accepts,
+// so the values here are the effective ones.
+struct StorageProfile
+{
+    std::string Name = "balanced";
+
+    // Block cache, 0 leaves LevelDB's own 8MB one
+    size_t CacheMB = 32;
+
+    // Bloom filter per table, 0 disables it. A Get of a key which is not there is answered from the filter
+    // without reading a block for all but about 1% (10 bits) of the tables it could be in.
+    int BloomBitsPerKey = 10;
+
+    size_t WriteBufferMB = 16;
+    size_t BlockSizeKB = 4;
+    size_t MaxFileSizeMB = 4;
+    int MaxOpenFiles = 1000;
+    bool Compression = false;
+
+    // Address records kept in memory in front of LevelDB, 0 disables it
+    size_t BalanceCacheMB = 16;
+
+    // Which commits wait for an fsync of the log
+    CommitSync Sync = COMMIT_SYNC_SCAN;
+
+    // balanced: the defaults above.
+    // lookup: mostly point reads, bigger cache and filters, small blocks.
+    // compact: Snappy and larger blocks and files, for big databases on slow or small disks.
+    static bool FromName(const std::string &Name, StorageProfile &Profile)
+    {
+        StorageProfile Preset;
+        Preset.Name = Name;
+
+        if(Name == "lookup")
+        {
+            Preset.CacheMB = 128;
+            Preset.BalanceCacheMB = 64;
+            Preset.BloomBitsPerKey = 14;
+            Preset.BlockSizeKB = 2;
+        }
+        else if(Name == "compact")
+        {
+            Preset.Compression = true;
+            Preset.BlockSizeKB = 16;
+            Preset.MaxFileSizeMB = 8;
+        }
+        else if(Name != "balanced")
+        {
+            return false;
+        }
+
+        Profile = Preset;
+        return true;
+    }
+
+    void Clamp()
+    {
+        WriteBufferMB = std::min<size_t>(std::max<size_t>(WriteBufferMB, 1), 1024);
+        BlockSizeKB = std::min<size_t>(std::max<size_t>(BlockSizeKB, 1), 4096);
+        MaxFileSizeMB = std::min<size_t>(std::max<size_t>(MaxFileSizeMB, 1), 1024);
+        MaxOpenFiles = std::min(std::max(MaxOpenFiles, 74), 50000);
+        BloomBitsPerKey = std::max(BloomBitsPerKey, 0);
+    }
+
+    std::string Describe() const
+    {
+        std::ostringstream Out;
+
+        Out << "profile " << Name << ", cache " << CacheMB << " MB, bloom " << BloomBitsPerKey << " bits/key, write buffer "
+            << WriteBufferMB << " MB, block " << BlockSizeKB << " KB, max file " << MaxFileSizeMB << " MB, max open files "
+            << MaxOpenFiles << ", compression " << (Compression ? "snappy" : "none") << ", balance cache " << BalanceCacheMB << " MB, sync " << CommitSyncName(Sync);
+
+        return Out.str();
+    }
+};
+
+// Committed state for readers: a LevelDB snapshot taken between two commit groups and the cursor they
+// left, so balances and the height they are valid at always match. Reads through a view never see a
+// half-applied commit and never block the writer; holding one only keeps its snapshot alive.
+// Views have to be released before the DBStorage they came from.
+struct DBView
+{
+    ReadOptions m_Options;
+    ScanCursor m_Cursor;
+    bool m_HasCursor = false;
+
+    // Commit group the view was taken after
+    uint64_t m_Sequence = 0;
+
+    // Last commit group which changed an address, balance, backfill or the cursor; HD index updates do not count
+    uint64_t m_DataSequence = 0;
+};
+
+class DBStorage
+{
+public:
+
+    DBStorage(const std::string &DBPath = "/tmp/", const StorageProfile &Profile = StorageProfile(), const btc_chainparams *Chain = &btc_chainparams_main)
+    {
+        m_DBPath = DBPath;
+        m_Profile = Profile;
+        m_Profile.Clamp();
+        m_Chain = Chain;
+        m_Balances.reset(new BalanceCache<TxInfo>(m_Profile.BalanceCacheMB));
+
+        InitLogger();
+        InitDatabase();
+        InitSchema();
+        InitCursor();
+        PublishView();
+    }
+
+    ~DBStorage()
+    {
+        CloseDatabase();
+    }
+    // NO additional thread sync needed as for leveldb readme.
+
+    // Address records are still keyed by text, Migrate has to run before anything else
+    bool NeedsMigration() const
+    {
+        return m_NeedsMigration;
+    }
+
+    // Of the database as opened, a newer one than DB_SCHEMA_VERSION cannot be used
+    uint64_t GetSchemaVersion() const
+    {
+        return m_SchemaVersion;
+    }
+
+    // Adding an one address at once
+    inline bool AddAddress(const std::string &Address)
+    {
+        Status Result = Status::InvalidArgument(Address);
+        std::string Key;
+
+        if(KeyOf(Address, Key))
+        {
+            WriteBatch Batch;
+            Batch.Put(Key, TxInfo().Serialize());
+
+            Result = Commit(Batch, false, [&] { m_Balances->Update(Key, TxInfo(), m_CommitSequence); });
+        }
+
+        PLOG_VERBOSE_IF_(DBLogger, Result.ok()) << "Added new address to database: " << Address;
+        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error adding new address to database: " << Address;
+
+        return Result.ok();
+    }
+
+    // Adding a bunch of addresses at a time (faster)
+    inline bool AddAddresses(const std::vector<std::string> &Addresses)
+    {
+        Status Result;
+        WriteBatch Batch;
+        std::vector<std::string> Keys(Addresses.size());
+
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            if(KeyOf(Addresses[Index], Keys[Index])) Batch.Put(Keys[Index], TxInfo().Serialize());
+        }
+
+        Result = Commit(Batch, false, [&]
+        {
+            for(auto &Key : Keys)
+            {
+                if(!Key.empty()) m_Balances->Update(Key, TxInfo(), m_CommitSequence);
+            }
+        });
+
+        PLOG_VERBOSE_IF_(DBLogger, Result.ok()) << "Added new batch of addresses to database.";
+        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error adding batch of addresses to database.";
+
+        return Result.ok();
+    }
+
+    // Add/update an one TxInfo at a time
+    inline bool UpdateTxInfo(const std::string &Address, const TxInfo &UpdatedInfo)
+    {
+        Status Result = Status::InvalidArgument(Address);
+        std::string Key;
+
+        if(KeyOf(Address, Key))
+        {
+            WriteBatch Batch;
+            Batch.Put(Key, UpdatedInfo.Serialize());
+
+            Result = Commit(Batch, false, [&] { m_Balances->Update(Key, UpdatedInfo, m_CommitSequence); });
+        }
+
+        PLOG_VERBOSE_IF_(DBLogger,Result.ok()) << "Added new txinfo to database: " << UpdatedInfo.m_BirthHeight;
+        PLOG_WARNING_IF_(DBLogger,!Result.ok()) << "Error adding new txinfo to database: " << UpdatedInfo.m_BirthHeight;
+
+        return Result.ok();
+    }
+
+    // Add a bunch of pairs address:TxInfo to DB (faster)
+    inline bool UpdateTxInfos(const std::unordered_map<std::string, TxInfo> &UpdatedInfos)
+    {
+        Status Result;
+        WriteBatch Batch;
+        WrittenInfos Written;
+
+        AddTxInfos(UpdatedInfos, Batch, Written);
+
+        Result = Commit(Batch, false, [&] { CacheTxInfos(Written); });
+
+        PLOG_VERBOSE_IF_(DBLogger,Result.ok()) << "Added new batch of addresses and TxInfos to database.";
+        PLOG_WARNING_IF_(DBLogger,!Result.ok()) << "Error adding batch of addresses and TxInfos to database.";
+
+        return Result.ok();
+    }
+
+    // Latest committed state, pinned until the last copy is dropped
+    std::shared_ptr<const DBView> GetView() const
+    {
+        std::lock_guard<std::mutex> Lock(m_ViewMutex);
+        return m_View;
+    }
+
+    // Readers below take the view to read, the latest one when none is given.
+    // Served from the balance cache when the address was looked up or written recently.
+    inline bool GetTxInfo(const std::string &Address, TxInfo &Info, const DBView *View = nullptr) const
+    {
+        std::shared_ptr<const DBView> Pinned;
+        std::string Key;
+        bool Backfilling = false;
+
+        return data && AddressToKey(Address, m_Chain, Key) && LoadTxInfo(Key, Pin(View, Pinned), Info, Backfilling);
+    }
+
+    // Bulk lookup: keys are visited in sorted order with one iterator, so it only moves forward through
+    // the tables and every block is read once. Infos[i] and Found[i] belong to Addresses[i], so does
+    // Backfilling[i] when asked for: whether the address still has a backfill pending.
+    size_t GetTxInfos(const std::vector<std::string> &Addresses, std::vector<TxInfo> &Infos, std::vector<char> &Found,
+                      std::vector<char> *Backfilling = nullptr, const DBView *View = nullptr) const
+    {
+        Infos.assign(Addresses.size(), TxInfo());
+        Found.assign(Addresses.size(), 0);
+
+        if(Backfilling) Backfilling->assign(Addresses.size(), 0);
+
+        if(!data || Addresses.empty())
+        {
+            return 0;
+        }
+
+        //Addresses which do not decode are simply not found
+        std::vector<std::string> Keys(Addresses.size());
+        std::vector<uint32_t> Order;
+        Order.reserve(Addresses.size());
+
+        std::shared_ptr<const DBView> Pinned;
+        const DBView &Current = Pin(View, Pinned);
+
+        size_t FoundCount = 0;
+        bool CachedBackfilling = false;
+
+        //Cached records need no seek
+        for(uint32_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            if(!AddressToKey(Addresses[Index], m_Chain, Keys[Index]))
+            {
+                continue;
+            }
+
+            if(m_Balances->Find(Keys[Index], Current.m_Sequence, Infos[Index], CachedBackfilling))
+            {
+                Found[Index] = 1;
+                FoundCount++;
+
+                if(Backfilling) (*Backfilling)[Index] = CachedBackfilling;
+            }
+            else
+            {
+                Order.push_back(Index);
+            }
+        }
+
+        std::sort(Order.begin(), Order.end(), [&Keys](uint32_t Left, uint32_t Right) { return Keys[Left] < Keys[Right]; });
+
+        std::unique_ptr<leveldb::Iterator> it(data->NewIterator(Current.m_Options));
+
+        for(auto Index : Order)
+        {
+            const Slice Key(Keys[Index]);
+
+            //Sorted input: seek only when the iterator is behind, a miss costs no extra seek
+            if(!it->Valid() || it->key().compare(Key) < 0)
+            {
+                it->Seek(Key);
+            }
+
+            //Past the last key, the rest of the sorted input is missing too
+            if(!it->Valid())
+            {
+                break;
+            }
+
+            if(it->key() == Key && Infos[Index].Deserialize(it->value()))
+            {
+                Found[Index] = 1;
+                FoundCount++;
+            }
+        }
+
+        //Backfill keys sort after all address keys in the same order, the iterator keeps moving forward
+        if(Backfilling)
+        {
+            std::string BackfillKey;
+
+            for(auto Index : Order)
+            {
+                if(!Found[Index])
+                {
+                    continue;
+                }
+
+                BackfillKey = BACKFILL_KEY_PREFIX + Keys[Index];
+
+                if(!it->Valid() || it->key().compare(BackfillKey) < 0)
+                {
+                    it->Seek(BackfillKey);
+                }
+
+                if(!it->Valid())
+                {
+                    break;
+                }
+
+                (*Backfilling)[Index] = it->key() == Slice(BackfillKey);
+            }
+        }
+
+        return FoundCount;
+    }
+
+    // Cursor of the latest view, no database read
+    inline bool GetCursor(ScanCursor &Cursor) const
+    {
+        std::shared_ptr<const DBView> Current = GetView();
+
+        Cursor = Current->m_Cursor;
+        return Current->m_HasCursor;
+    }
+
+    inline bool UpdateCursor(const ScanCursor &Cursor)
+    {
+        WriteBatch Batch;
+        Batch.Put(CURSOR_KEY, Cursor.Serialize());
+
+        const Status Result = Commit(Batch, true, [&] { SetCursor(Cursor); });
+
+        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error updating scan cursor to block " << Cursor.m_Height;
+
+        return Result.ok();
+    }
+
+    // Next derivation index to hand out, absent on databases written before the address pool
+    inline bool GetHdIndex(uint32_t &Index) const
+    {
+        std::string Data;
+
+        return data && data->Get(ReadOptions(), HD_INDEX_KEY, &Data).ok() && DecodeHdIndex(Data, Index);
+    }
+
+    inline bool UpdateHdIndex(uint32_t Index)
+    {
+        WriteBatch Batch;
+        Batch.Put(HD_INDEX_KEY, EncodeHdIndex(Index));
+
+        const Status Result = Commit(Batch, false, std::function<void ()>(), false);
+
+        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error updating HD index to " << Index;
+
+        return Result.ok();
+    }
+
+    // New addresses born at one height, with a backfill record each when the cursor is already past it
+    inline bool AddNewAddresses(const std::vector<std::string> &Addresses, int BirthHeight)
+    {
+        Status Result;
+        WriteBatch Batch;
+
+        const std::string Info = TxInfo(BirthHeight, 0).Serialize();
+
+        ScanCursor Cursor;
+        const bool NeedsBackfill = GetCursor(Cursor) && BirthHeight < Cursor.m_Height;
+
+        BackfillRange Range;
+        Range.m_From = BirthHeight;
+        Range.m_To = NeedsBackfill ? Cursor.m_Height : BirthHeight;
+
+        const std::string Backfill = Range.Serialize();
+
+        std::vector<std::string> Keys(Addresses.size());
+
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            if(!KeyOf(Addresses[Index], Keys[Index]))
+            {
+                continue;
+            }
+
+            Batch.Put(Keys[Index], Info);
+            if(NeedsBackfill) Batch.Put(BACKFILL_KEY_PREFIX + Keys[Index], Backfill);
+        }
+
+        Result = Commit(Batch, false, [&]
+        {
+            for(auto &Key : Keys)
+            {
+                if(Key.empty())
+                {
+                    continue;
+                }
+
+                m_Balances->Update(Key, TxInfo(BirthHeight, 0), m_CommitSequence);
+                m_Balances->UpdateBackfill(Key, NeedsBackfill, m_CommitSequence);
+            }
+        });
+
+        PLOG_VERBOSE_IF_(DBLogger, Result.ok()) << "Added " << Addresses.size() << " new addresses born at block " << BirthHeight;
+        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error adding " << Addresses.size() << " new addresses born at block " << BirthHeight;
+
+        return Result.ok();
+    }
+
+    // Touched balances and the new cursor go in one batch, a crash never leaves them out of step.
+    // Backfills are ranges which have to end where the new cursor does, written the way CommitBackfill does.
+    inline bool CommitScan(const std::unordered_map<std::string, TxInfo> &UpdatedInfos, const UtxoChanges &Utxos, const UndoChanges &Undo, const ScanCursor &Cursor,
+                           const std::unordered_map<std::string, BackfillRange> &Backfills = std::unordered_map<std::string, BackfillRange>())
+    {
+        Status Result;
+        WriteBatch Batch;
+        WrittenInfos Written;
+        std::vector<std::pair<std::string, bool>> Pending;
+
+        AddUtxoChanges(Utxos, Batch);
+        AddUndoChanges(Undo, Batch);
+        AddTxInfos(UpdatedInfos, Batch, Written);
+        AddBackfills(Backfills, Batch, Pending);
+
+        Batch.Put(CURSOR_KEY, Cursor.Serialize());
+
+        Result = Commit(Batch, true, [&]
+        {
+            CacheTxInfos(Written);
+            SetCursor(Cursor);
+
+            for(auto &Pair : Pending)
+            {
+                m_Balances->UpdateBackfill(Pair.first, Pair.second, m_CommitSequence);
+            }
+        });
+
+        PLOG_VERBOSE_IF_(DBLogger,Result.ok()) << "Committed " << UpdatedInfos.size() << " TxInfos, cursor at block " << Cursor.m_Height;
+        PLOG_WARNING_IF_(DBLogger,!Result.ok()) << "Error committing TxInfos at block " << Cursor.m_Height;
+
+        return Result.ok();
+    }
+
+    inline bool AddBackfill(const std::string &Address, const BackfillRange &Range)
+    {
+        Status Result = Status::InvalidArgument(Address);
+        std::string Key;
+
+        if(KeyOf(Address, Key))
+        {
+            WriteBatch Batch;
+            Batch.Put(BACKFILL_KEY_PREFIX + Key, Range.Serialize());
+
+            Result = Commit(Batch, false, [&] { m_Balances->UpdateBackfill(Key, true, m_CommitSequence); });
+        }
+
+        PLOG_VERBOSE_IF_(DBLogger, Result.ok()) << "Backfill of blocks " << Range.m_From << " - " << Range.m_To << " queued for " << Address;
+        PLOG_WARNING_IF_(DBLogger, !Result.ok()) << "Error queueing backfill for " << Address;
+
+        return Result.ok();
+    }
+
+    inline bool HasBackfill(const std::string &Address, const DBView *View = nullptr) const
+    {
+        std::shared_ptr<const DBView> Pinned;
+        std::string Key, Data;
+        TxInfo Info;
+        bool Backfilling = false;
+
+        if(!data || !AddressToKey(Address, m_Chain, Key))
+        {
+            return false;
+        }
+
+        const DBView &Current = Pin(View, Pinned);
+
+        //Cached along with the record
+        if(LoadTxInfo(Key, Current, Info, Backfilling))
+        {
+            return Backfilling;
+        }
+
+        return data->Get(Current.m_Options, BACKFILL_KEY_PREFIX + Key, &Data).ok();
+    }
+
+    // Pending backfills keyed by address
+    bool GetBackfills(std::unordered_map<std::string, BackfillRange> &Backfills, const DBView *View = nullptr) const
+    {
+        std::shared_ptr<const DBView> Pinned;
+        std::unique_ptr<leveldb::Iterator> it(data->NewIterator(Pin(View, Pinned).m_Options));
+        std::string Address;
+
+        for (it->Seek(BACKFILL_KEY_PREFIX); it->Valid() && it->key().starts_with(BACKFILL_KEY_PREFIX); it->Next())
+        {
+            BackfillRange Range;
+            Slice Key = it->key();
+            Key.remove_prefix(BACKFILL_KEY_PREFIX.size());
+
+            if(Range.Deserialize(it->value()) && KeyToAddress(Key, m_Chain, Address))
+            {
+                Backfills.emplace(Address, Range);
+            }
+        }
+
+        return !Backfills.empty();
+    }
+
+    // Writes backfill progress along with the balances, finished ranges are removed. Undo holds the stored
+    // undo records of the blocks the backfill credited, extended by its own changes.
+    inline bool CommitBackfill(const std::unordered_map<std::string, TxInfo> &UpdatedInfos, const UtxoChanges &Utxos, const UndoChanges &Undo,
+                               const std::unordered_map<std::string, BackfillRange> &Backfills)
+    {
+        Status Result;
+        WriteBatch Batch;
+        WrittenInfos Written;
+        std::vector<std::pair<std::string, bool>> Pending;
+
+        AddUtxoChanges(Utxos, Batch);
+        AddUndoChanges(Undo, Batch);
+        AddTxInfos(UpdatedInfos, Batch, Written);
+        AddBackfills(Backfills, Batch, Pending);
+
+        Result = Commit(Batch, true, [&]
+        {
+            CacheTxInfos(Written);
+
+            for(auto &Pair : Pending)
+            {
+                m_Balances->UpdateBackfill(Pair.first, Pair.second, m_CommitSequence);
+            }
+        });
+
+        PLOG_VERBOSE_IF_(DBLogger,Result.ok()) << "Committed backfill of " << Backfills.size() << " addresses.";
+        PLOG_WARNING_IF_(DBLogger,!Result.ok()) << "Error committing backfill of " << Backfills.size() << " addresses.";
+
+        return Result.ok();
+    }
+
+    inline bool GetUtxo(const std::string &Key, UtxoEntry &Entry) const
+    {
+        std::string Data;
+
+        return data && data->Get(ReadOptions(), Key, &Data).ok() && Entry.Deserialize(Data);
+    }
+
+    inline bool GetUndo(int Height, BlockUndo &Block) const
+    {
+        std::string Data;
+        return data && data->Get(ReadOptions(), UndoKey(Height), &Data).ok() && Block.Deserialize(Data);
+    }
+
+    // Iterate all stored UTXO keys (used to size and fill the UTXO filter)
+    bool GetUtxoKeys(std::vector<std::string> &Keys) const
+    {
+        std::unique_ptr<leveldb::Iterator> it(data->NewIterator(ReadOptions()));
+
+        for (it->Seek(UTXO_KEY_PREFIX); it->Valid() && it->key().starts_with(UTXO_KEY_PREFIX); it->Next())
+        {
+            Keys.push_back(it->key().ToString());
+        }
+
+        return !Keys.empty();
+    }
+
+    // Iterate all saved addresses (may be slow on big database)
+    bool GetAllAddresses(std::vector<std::string> &Addresses, const DBView *View = nullptr) const
+    {
+        std::shared_ptr<const DBView> Pinned;
+        std::unique_ptr<leveldb::Iterator> it(data->NewIterator(Pin(View, Pinned).m_Options));
+        std::string Address;
+
+        //Address keys sort before everything else
+        for (it->SeekToFirst(); it->Valid() && IsAddressKey(it->key()); it->Next())
+        {
+           if(KeyToAddress(it->key(), m_Chain, Address)) Addresses.push_back(Address);
+        }
+
+        return !Addresses.empty();
+    }
+
+    // Every address record with its TxInfo (may be slow on big database)
+    bool GetAllTxInfos(std::unordered_map<std::string, TxInfo> &Infos, const DBView *View = nullptr) const
+    {
+        std::shared_ptr<const DBView> Pinned;
+        std::unique_ptr<leveldb::Iterator> it(data->NewIterator(Pin(View, Pinned).m_Options));
+        std::string Address;
+
+        for (it->SeekToFirst(); it->Valid() && IsAddressKey(it->key()); it->Next())
+        {
+            TxInfo Info;
+
+            if(KeyToAddress(it->key(), m_Chain, Address) && Info.Deserialize(it->value()))
+            {
+                Infos.emplace(Address, Info);
+            }
+        }
+
+        return !Infos.empty();
+    }
+
+    BalanceCache<TxInfo>::Stats GetBalanceCacheStats() const
+    {
+        return m_Balances->GetStats();
+    }
+
+    // Batches written and the group commits they went out in
+    void GetCommitStats(uint64_t &Batches, uint64_t &Groups)
+    {
+        std::lock_guard<std::mutex> Lock(m_CommitMutex);
+
+        Batches = m_CommittedBatches;
+        Groups = m_CommitGroups;
+    }
+
+    // The iterator keeps the snapshot of its view alive on its own
+    std::unique_ptr<leveldb::Iterator> GetDbIterator(const DBView *View = nullptr) const
+    {
+        std::shared_ptr<const DBView> Pinned;
+        return std::unique_ptr<leveldb::Iterator>(data->NewIterator(Pin(View, Pinned).m_Options));
+    }
+
+    // One-shot conversion of schema 1: text keys become binary ones, raw TxInfo structs versioned records.
+    // Schema 1 had no meta records besides the schema stamp. Batches are atomic, an interrupted run is simply
+    // started again. Records whose key does not decode as an address of this chain are left untouched and reported.
+    bool Migrate()
+    {
+        if(m_SchemaVersion > DB_SCHEMA_VERSION)
+        {
+            PLOG_ERROR_(DBLogger) << "Database has schema " << m_SchemaVersion << ", newer than " << DB_SCHEMA_VERSION << " this version handles";
+            return false;
+        }
+
+        if(!m_NeedsMigration)
+        {
+            PLOG_INFO_(DBLogger) << "Database already at schema " << DB_SCHEMA_VERSION;
+            return true;
+        }
+
+        size_t Converted = 0, Skipped = 0;
+        std::string Key, From;
+
+        for(bool Done = false; !Done;)
+        {
+            WriteBatch Batch;
+            size_t Pending = 0;
+
+            //A fresh iterator per batch sees the keys the previous batch removed as gone
+            std::unique_ptr<leveldb::Iterator> it(data->NewIterator(ReadOptions()));
+            it->Seek(From);
+
+            for(; it->Valid() && Pending < MigrationBatch; it->Next())
+            {
+                if(!IsLegacyAddressKey(it->key()))
+                {
+                    continue;
+                }
+
+                const std::string OldKey = it->key().ToString();
+                TxInfo Info;
+
+                if(!AddressToKey(OldKey, m_Chain, Key) || !Info.DeserializeLegacy(it->value()))
+                {
+                    PLOG_WARNING_(DBLogger) << "Migration skipped record " << OldKey;
+                    Skipped++;
+                    continue;
+                }
+
+                Batch.Put(Key, Info.Serialize());
+                Batch.Delete(OldKey);
+                Pending++;
+            }
+
+            Done = !it->Valid();
+
+            if(!Done)
+            {
+                From = it->key().ToString();
+            }
+            else
+            {
+                std::string Schema;
+                PutVarint(Schema, DB_SCHEMA_VERSION);
+                Batch.Put(SCHEMA_KEY, Schema);
+            }
+
+            Status Result = data->Write(WriteOptions(), &Batch);
+
+            if(!Result.ok())
+            {
+                PLOG_ERROR_(DBLogger) << "Migration failed after " << Converted << " records: " << Result.ToString();
+                return false;
+            }
+
+            Converted += Pending;
+        }
+
+        m_SchemaVersion = DB_SCHEMA_VERSION;
+        m_NeedsMigration = false;
+        InitCursor();
+        m_Balances->Clear(++m_CommitSequence);
+        m_DataSequence = m_CommitSequence;
+        PublishView();
+
+        PLOG_INFO_(DBLogger) << "Migrated " << Converted << " records to schema " << DB_SCHEMA_VERSION << ", skipped " << Skipped;
+
+        return true;
+    }
+
+private:
+
+    static constexpr size_t MigrationBatch = 10000;
+
+    // Binary key of a caller supplied address, logged when it does not decode
+    bool KeyOf(const std::string &Address, std::string &Key) const
+    {
+        const bool Valid = AddressToKey(Address, m_Chain, Key);
+
+        PLOG_WARNING_IF_(DBLogger, !Valid) << "Not an address of this chain: " << Address;
+
+        return Valid;
+    }
+
+    // Keys and records of a batch, for the balance cache once it is written
+    typedef std::vector<std::pair<std::string, const TxInfo*>> WrittenInfos;
+
+    void AddTxInfos(const std::unordered_map<std::string, TxInfo> &UpdatedInfos, WriteBatch &Batch, WrittenInfos &Written) const
+    {
+        std::string Key;
+        Written.reserve(Written.size() + UpdatedInfos.size());
+
+        for(auto &Pair : UpdatedInfos)
+        {
+            if(!KeyOf(Pair.first, Key))
+            {
+                continue;
+            }
+
+            Batch.Put(Key, Pair.second.Serialize());
+            Written.emplace_back(Key, &Pair.second);
+        }
+    }
+
+    // Run by Commit right after the write: a later batch of the same keys refreshes them after this one
+    void CacheTxInfos(const WrittenInfos &Written)
+    {
+        for(auto &Pair : Written)
+        {
+            m_Balances->Update(Pair.first, *Pair.second, m_CommitSequence);
+        }
+    }
+
+    // Record and pending backfill of an address key as of View, read through the balance cache
+    bool LoadTxInfo(const std::string &Key, const DBView &View, TxInfo &Info, bool &Backfilling) const
+    {
+        if(m_Balances->Find(Key, View.m_Sequence, Info, Backfilling))
+        {
+            return true;
+        }
+
+        std::string Data;
+
+        if(!data->Get(View.m_Options, Key, &Data).ok() || !Info.Deserialize(Data))
+        {
+            return false;
+        }
+
+        Backfilling = data->Get(View.m_Options, BACKFILL_KEY_PREFIX + Key, &Data).ok();
+        m_Balances->Insert(Key, Info, Backfilling, View.m_Sequence);
+
+        return true;
+    }
+
+    const DBView &Pin(const DBView *View, std::shared_ptr<const DBView> &Pinned) const
+    {
+        if(!View)
+        {
+            Pinned = GetView();
+            View = Pinned.get();
+        }
+
+        return *View;
+    }
+
+    // Applied by the commit leader only
+    void SetCursor(const ScanCursor &Cursor)
+    {
+        m_Cursor = Cursor;
+        m_HasCursor = true;
+    }
+
+    // After a commit group, before the next one can start: the snapshot holds exactly what was committed
+    void PublishView()
+    {
+        DB *Database = data;
+        std::shared_ptr<DBView> View(new DBView(), [Database](DBView *Released)
+        {
+            Database->ReleaseSnapshot(Released->m_Options.snapshot);
+            delete Released;
+        });
+
+        View->m_Options.snapshot = data->GetSnapshot();
+        View->m_Cursor = m_Cursor;
+        View->m_HasCursor = m_HasCursor;
+        View->m_Sequence = m_CommitSequence;
+        View->m_DataSequence = m_DataSequence;
+
+        std::lock_guard<std::mutex> Lock(m_ViewMutex);
+        m_View = std::move(View);
+    }
+
+    static void AddUtxoChanges(const UtxoChanges &Utxos, WriteBatch &Batch)
+    {
+        for(auto &Pair : Utxos.Added)
+        {
+            Batch.Put(Pair.first, Pair.second.Serialize());
+        }
+
+        for(auto &Key : Utxos.Spent)
+        {
+            Batch.Delete(Key);
+        }
+    }
+
+    static void AddUndoChanges(const UndoChanges &Undo, WriteBatch &Batch)
+    {
+        for(auto &Block : Undo.Added)
+        {
+            Batch.Put(UndoKey(Block.m_Height), Block.Serialize());
+        }
+
+        for(auto Height : Undo.Removed)
+        {
+            Batch.Delete(UndoKey(Height));
+        }
+    }
+
+    // Empty ranges are done and removed. Pending gets the key and whether a backfill is left, for the balance cache.
+    void AddBackfills(const std::unordered_map<std::string, BackfillRange> &Backfills, WriteBatch &Batch, std::vector<std::pair<std::string, bool>> &Pending) const
+    {
+        std::string Key;
+
+        for(auto &Pair : Backfills)
+        {
+            if(!KeyOf(Pair.first, Key))
+            {
+                continue;
+            }
+
+            if(Pair.second.m_From >= Pair.second.m_To)
+            {
+                Batch.Delete(BACKFILL_KEY_PREFIX + Key);
+            }
+            else
+            {
+                Batch.Put(BACKFILL_KEY_PREFIX + Key, Pair.second.Serialize());
+            }
+
+            Pending.emplace_back(Key, Pair.second.m_From < Pair.second.m_To);
+        }
+    }
+
+    DB* data;
+    StorageProfile m_Profile;
+
+    // Owned here, LevelDB only borrows them and both must outlive the database
+    Cache *m_BlockCache = nullptr;
+    const FilterPolicy *m_FilterPolicy = nullptr;
+    const btc_chainparams *m_Chain = nullptr;
+    uint64_t m_SchemaVersion = DB_SCHEMA_VERSION;
+    bool m_NeedsMigration = false;
+
+    // Writer waiting in the commit queue, on its own stack
+    struct PendingCommit
+    {
+        WriteBatch *Batch = nullptr;
+        bool Sync = false;
+        const std::function<void ()> *OnCommitted = nullptr;
+        bool ChangesData = true;
+        Status Result;
+        bool Done = false;
+        std::condition_variable Signal;
+    };
+
+    // Group commit: the writer at the front of the queue writes the batches of everyone queued behind it
+    // as one, with one fsync when any of them asked for it, then runs their callbacks in queue order,
+    // publishes the view of the group and hands the front to the next waiting writer. Writers which came
+    // in while a group was written are coalesced into the next one. Callbacks update the in-memory state
+    // (balance cache, cursor), so it follows the database in commit order.
+    // ChangesData is false for writes no reader of address records sees, they leave m_DataSequence alone.
+    Status Commit(WriteBatch &Batch, bool IsScan, const std::function<void ()> &OnCommitted = std::function<void ()>(), bool ChangesData = true)
+    {
+        if(!data)
+        {
+            return Status::IOError("database is not open");
+        }
+
+        PendingCommit Self;
+        Self.Batch = &Batch;
+        Self.Sync = m_Profile.Sync == COMMIT_SYNC_ALWAYS || (IsScan && m_Profile.Sync == COMMIT_SYNC_SCAN);
+        Self.OnCommitted = &OnCommitted;
+        Self.ChangesData = ChangesData;
+
+        std::unique_lock<std::mutex> Lock(m_CommitMutex);
+        m_CommitQueue.push_back(&Self);
+
+        Self.Signal.wait(Lock, [&] { return Self.Done || m_CommitQueue.front() == &Self; });
+
+        if(Self.Done)
+        {
+            return Self.Result;
+        }
+
+        //Leader. Grouping stops at a size limit, small writes are not held up behind a huge group,
+        //and at the first writer needing a sync the leader does not do
+        const size_t FirstBytes = Batch.ApproximateSize();
+        const size_t MaxBytes = FirstBytes <= SmallCommitBytes ? FirstBytes + SmallCommitBytes : MaxGroupBytes;
+
+        std::vector<PendingCommit*> Group(1, &Self);
+        size_t Bytes = FirstBytes;
+        WriteBatch Combined;
+
+        for(auto Next = m_CommitQueue.begin() + 1; Next != m_CommitQueue.end(); ++Next)
+        {
+            Bytes += (*Next)->Batch->ApproximateSize();
+
+            if(((*Next)->Sync && !Self.Sync) || Bytes > MaxBytes)
+            {
+                break;
+            }
+
+            if(Group.size() == 1) Combined.Append(Batch);
+            Combined.Append(*(*Next)->Batch);
+
+            Group.push_back(*Next);
+        }
+
+        Lock.unlock();
+
+        WriteOptions Options;
+        Options.sync = Self.Sync;
+
+        const Status Result = data->Write(Options, Group.size() == 1 ? &Batch : &Combined);
+
+        //The next leader waits for the front of the queue, so callbacks of consecutive groups never interleave
+        if(Result.ok())
+        {
+            m_CommitSequence++;
+
+            for(auto *Member : Group)
+            {
+                if(*Member->OnCommitted) (*Member->OnCommitted)();
+                if(Member->ChangesData) m_DataSequence = m_CommitSequence;
+            }
+
+            PublishView();
+        }
+
+        Lock.lock();
+
+        m_CommittedBatches += Group.size();
+        m_CommitGroups++;
+
+        for(auto *Member : Group)
+        {
+            m_CommitQueue.pop_front();
+
+            if(Member != &Self)
+            {
+                Member->Result = Result;
+                Member->Done = true;
+                Member->Signal.notify_one();
+            }
+        }
+
+        if(!m_CommitQueue.empty())
+        {
+            m_CommitQueue.front()->Signal.notify_one();
+        }
+
+        return Result;
+    }
+
+    static constexpr size_t SmallCommitBytes = 128 * 1024;
+    static constexpr size_t MaxGroupBytes = 1024 * 1024;
+
+    std::mutex m_CommitMutex;
+    std::deque<PendingCommit*> m_CommitQueue;
+    uint64_t m_CommittedBatches = 0;
+    uint64_t m_CommitGroups = 0;
+
+    std::unique_ptr<BalanceCache<TxInfo>> m_Balances;
+
+    // State of the last commit group, written by its leader; readers get it through m_View
+    ScanCursor m_Cursor;
+    bool m_HasCursor = false;
+    uint64_t m_CommitSequence = 0;
+    uint64_t m_DataSequence = 0;
+
+    mutable std::mutex m_ViewMutex;
+    std::shared_ptr<const DBView> m_View;
+
+    void InitDatabase()
+    {
+        Options options;
+        options.create_if_missing = true;
+        options.compression = m_Profile.Compression ? kSnappyCompression : kNoCompression;
+        options.write_buffer_size = m_Profile.WriteBufferMB * 1048576;
+        options.block_size = m_Profile.BlockSizeKB * 1024;
+        options.max_file_size = m_Profile.MaxFileSizeMB * 1048576;
+        options.max_open_files = m_Profile.MaxOpenFiles;
+
+        if (m_Profile.CacheMB)
+        {
+            m_BlockCache = NewLRUCache(m_Profile.CacheMB * 1048576);
+            options.block_cache = m_BlockCache;
+        }
+
+        //Tables written without a filter keep working, they get one when compacted
+        if (m_Profile.BloomBitsPerKey > 0)
+        {
+            m_FilterPolicy = NewBloomFilterPolicy(m_Profile.BloomBitsPerKey);
+            options.filter_policy = m_FilterPolicy;
+        }
+
+        Status status = DB::Open(options, m_DBPath + "data", &data);
+
+        PLOG_VERBOSE_IF_(DBLogger, status.ok()) << "Database opened/created at: " << m_DBPath + "data";
+        PLOG_WARNING_IF_(DBLogger, !status.ok()) << "Error opening/creating the database at: " << m_DBPath + "data";
+        PLOG_INFO_IF_(DBLogger, status.ok()) << "Storage settings: " << m_Profile.Describe();
+
+        assert(status.ok());
+    }
+
+    // A database without the schema record is new, or written by schema 1 when it holds text keyed records
+    void InitSchema()
+    {
+        std::string Schema;
+
+        if(data->Get(ReadOptions(), SCHEMA_KEY, &Schema).ok())
+        {
+            Slice Data(Schema);
+
+            if(!GetVarint(Data, m_SchemaVersion))
+            {
+                PLOG_ERROR_(DBLogger) << "Unreadable schema record, handled as schema 1";
+                m_SchemaVersion = 1;
+            }
+        }
+        else
+        {
+            //Text keys start with a Base58 or Bech32 character, they sort after all meta and binary keys
+            std::unique_ptr<leveldb::Iterator> it(data->NewIterator(ReadOptions()));
+            it->Seek("0");
+            m_SchemaVersion = it->Valid() ? 1 : DB_SCHEMA_VERSION;
+
+            if(!it->Valid())
+            {
+                PutVarint(Schema, DB_SCHEMA_VERSION);
+                data->Put(WriteOptions(), SCHEMA_KEY, Schema);
+            }
+        }
+
+        m_NeedsMigration = m_SchemaVersion < DB_SCHEMA_VERSION;
+    }
+
+    void InitCursor()
+    {
+        std::string Data;
+
+        m_HasCursor = data->Get(ReadOptions(), CURSOR_KEY, &Data).ok() && m_Cursor.Deserialize(Data);
     }
 
     void InitLogger()
@@ -190,7 +1726,10 @@ private:
 
     void CloseDatabase()
     {
+        m_View.reset();
         delete data;
+        delete m_BlockCache;
+        delete m_FilterPolicy;
     }
 
     std::string m_DBPath = "";
@@ -0,0 +1,533 @@
+#ifndef HASH160_H
+#define HASH160_H
+
+#include <btc/ripemd160.h>
+#include <btc/sha2.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HASH160_X86 1
+#endif
+
+// Batch Hash160 (RIPEMD-160 of SHA-256) of many short independent messages: compressed keys from range
+// derivation, P2PK keys of decoded blocks. Messages are hashed in lanes, 4 (SSE4.1), 8 (AVX2) or 16 (AVX-512)
+// at a time, each lane a 32-bit element of a vector register. SHA-256 uses the SHA-NI instructions when the
+// CPU has them (a single stream beats the lanes there), RIPEMD-160 has no such instructions and always uses
+// the widest lanes. The kernels are picked once at runtime from cpuid, libbtc's scalar code is the fallback.
+
+enum class HashLevel
+{
+    Scalar,
+    Sse41,
+    Avx2,
+    Avx512
+};
+
+struct HashKernels
+{
+    HashLevel Level = HashLevel::Scalar;
+    bool ShaNi = false;
+    size_t Lanes = 1;
+
+    // Lanes messages of Blocks padded 64-byte blocks each
+    void (*Sha256)(const uint8_t *const *Padded, size_t Blocks, uint8_t (*Digests)[32]) = nullptr;
+
+    // Lanes SHA-256 digests
+    void (*Ripemd160)(const uint8_t (*Digests)[32], uint8_t (*Hashes)[20]) = nullptr;
+
+    // One message of Blocks padded blocks, SHA-NI only
+    void (*Sha256Single)(const uint8_t *Padded, size_t Blocks, uint8_t *Digest) = nullptr;
+
+    const char *Name = "scalar";
+};
+
+static const uint32_t SHA256_K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t SHA256_INIT[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+static const uint32_t RIPEMD160_INIT[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+// Message word, rotation and constant per step of the left and right RIPEMD-160 lines
+static const uint8_t RIPEMD160_R[80] =
+{
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  7, 4, 13, 1, 10, 6, 15, 3, 12, 0, 9, 5, 2, 14, 11, 8,
+    3, 10, 14, 4, 9, 15, 8, 1, 2, 7, 0, 6, 13, 11, 5, 12,  1, 9, 11, 10, 0, 8, 12, 4, 13, 3, 7, 15, 14, 5, 6, 2,
+    4, 0, 5, 9, 7, 12, 2, 10, 14, 1, 3, 8, 11, 6, 15, 13
+};
+
+static const uint8_t RIPEMD160_RR[80] =
+{
+    5, 14, 7, 0, 9, 2, 11, 4, 13, 6, 15, 8, 1, 10, 3, 12,  6, 11, 3, 7, 0, 13, 5, 10, 14, 15, 8, 12, 4, 9, 1, 2,
+    15, 5, 1, 3, 7, 14, 6, 9, 11, 8, 12, 2, 10, 0, 4, 13,  8, 6, 4, 1, 3, 11, 15, 0, 5, 12, 2, 13, 9, 7, 10, 14,
+    12, 15, 10, 4, 1, 5, 8, 7, 6, 2, 13, 14, 0, 3, 9, 11
+};
+
+static const uint8_t RIPEMD160_S[80] =
+{
+    11, 14, 15, 12, 5, 8, 7, 9, 11, 13, 14, 15, 6, 7, 9, 8,  7, 6, 8, 13, 11, 9, 7, 15, 7, 12, 15, 9, 11, 7, 13, 12,
+    11, 13, 6, 7, 14, 9, 13, 15, 14, 8, 13, 6, 5, 12, 7, 5,  11, 12, 14, 15, 14, 15, 9, 8, 9, 14, 5, 6, 8, 6, 5, 12,
+    9, 15, 5, 11, 6, 8, 13, 12, 5, 12, 13, 14, 11, 8, 5, 6
+};
+
+static const uint8_t RIPEMD160_SR[80] =
+{
+    8, 9, 9, 11, 13, 15, 15, 5, 7, 7, 8, 11, 14, 14, 12, 6,  9, 13, 15, 7, 12, 8, 9, 11, 7, 7, 12, 7, 6, 15, 13, 11,
+    9, 7, 15, 11, 8, 6, 6, 14, 12, 13, 5, 14, 13, 13, 7, 5,  15, 5, 8, 11, 14, 14, 6, 14, 6, 9, 12, 9, 12, 5, 15, 8,
+    8, 5, 12, 9, 12, 5, 14, 6, 8, 13, 6, 5, 15, 13, 11, 11
+};
+
+static const uint32_t RIPEMD160_K[5] = { 0x00000000, 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xa953fd4e };
+static const uint32_t RIPEMD160_KR[5] = { 0x50a28be6, 0x5c4dd124, 0x6d703ef3, 0x7a6d76e9, 0x00000000 };
+
+static inline uint32_t LoadBE32(const uint8_t *Bytes)
+{
+    return (static_cast<uint32_t>(Bytes[0]) << 24) | (Bytes[1] << 16) | (Bytes[2] << 8) | Bytes[3];
+}
+
+static inline void StoreBE32(uint8_t *Bytes, uint32_t Value)
+{
+    Bytes[0] = static_cast<uint8_t>(Value >> 24); Bytes[1] = static_cast<uint8_t>(Value >> 16);
+    Bytes[2] = static_cast<uint8_t>(Value >> 8); Bytes[3] = static_cast<uint8_t>(Value);
+}
+
+static inline uint32_t LoadLE32(const uint8_t *Bytes)
+{
+    return Bytes[0] | (Bytes[1] << 8) | (Bytes[2] << 16) | (static_cast<uint32_t>(Bytes[3]) << 24);
+}
+
+static inline void StoreLE32(uint8_t *Bytes, uint32_t Value)
+{
+    Bytes[0] = static_cast<uint8_t>(Value); Bytes[1] = static_cast<uint8_t>(Value >> 8);
+    Bytes[2] = static_cast<uint8_t>(Value >> 16); Bytes[3] = static_cast<uint8_t>(Value >> 24);
+}
+
+// SHA-256 padding: 0x80, zeros, the bit length big-endian; returns the number of 64-byte blocks written
+static inline size_t Sha256Pad(const uint8_t *Message, size_t Size, uint8_t *Padded)
+{
+    const size_t Blocks = (Size + 9 + 63) / 64;
+
+    memcpy(Padded, Message, Size);
+    memset(Padded + Size, 0, Blocks * 64 - Size);
+    Padded[Size] = 0x80;
+
+    const uint64_t Bits = static_cast<uint64_t>(Size) * 8;
+
+    for(int Byte = 0; Byte < 8; ++Byte)
+    {
+        Padded[Blocks * 64 - 1 - Byte] = static_cast<uint8_t>(Bits >> (8 * Byte));
+    }
+
+    return Blocks;
+}
+
+#if defined(HASH160_X86)
+
+// Lane kernels, written once over GCC vector types and compiled per instruction set through target attributes.
+// The always_inline bodies take on the target of the wrapper they are inlined into.
+
+typedef uint32_t HashVec4 __attribute__((vector_size(16)));
+typedef uint32_t HashVec8 __attribute__((vector_size(32)));
+typedef uint32_t HashVec16 __attribute__((vector_size(64)));
+
+#define HASH_INLINE static inline __attribute__((always_inline))
+
+// Macros rather than functions: a vector passed by value outside its target trips -Wpsabi
+#define HASH_ROTR(Value, Bits) (((Value) >> (Bits)) | ((Value) << (32 - (Bits))))
+#define HASH_ROTL(Value, Bits) (((Value) << (Bits)) | ((Value) >> (32 - (Bits))))
+
+#define RIPEMD160_F(Group, X, Y, Z) \
+    ((Group) == 0 ? ((X) ^ (Y) ^ (Z)) : \
+     (Group) == 1 ? (((X) & (Y)) | (~(X) & (Z))) : \
+     (Group) == 2 ? (((X) | ~(Y)) ^ (Z)) : \
+     (Group) == 3 ? (((X) & (Z)) | ((Y) & ~(Z))) : \
+                    ((X) ^ ((Y) | ~(Z))))
+
+template<typename V, size_t Lanes>
+HASH_INLINE void Sha256Lanes(const uint8_t *const *Padded, size_t Blocks, uint8_t (*Digests)[32])
+{
+    V State[8];
+
+    for(int Word = 0; Word < 8; ++Word)
+    {
+        State[Word] = V{} + SHA256_INIT[Word];
+    }
+
+    for(size_t Block = 0; Block < Blocks; ++Block)
+    {
+        V W[64];
+
+        for(int Word = 0; Word < 16; ++Word)
+        {
+            for(size_t Lane = 0; Lane < Lanes; ++Lane)
+            {
+                W[Word][Lane] = LoadBE32(Padded[Lane] + Block * 64 + Word * 4);
+            }
+        }
+
+        for(int Word = 16; Word < 64; ++Word)
+        {
+            const V S0 = HASH_ROTR(W[Word - 15], 7) ^ HASH_ROTR(W[Word - 15], 18) ^ (W[Word - 15] >> 3);
+            const V S1 = HASH_ROTR(W[Word - 2], 17) ^ HASH_ROTR(W[Word - 2], 19) ^ (W[Word - 2] >> 10);
+            W[Word] = W[Word - 16] + S0 + W[Word - 7] + S1;
+        }
+
+        V A = State[0], B = State[1], C = State[2], D = State[3], E = State[4], F = State[5], G = State[6], H = State[7];
+
+        #pragma GCC unroll 64
+        for(int Round = 0; Round < 64; ++Round)
+        {
+            const V T1 = H + (HASH_ROTR(E, 6) ^ HASH_ROTR(E, 11) ^ HASH_ROTR(E, 25)) + ((E & F) ^ (~E & G)) + SHA256_K[Round] + W[Round];
+            const V T2 = (HASH_ROTR(A, 2) ^ HASH_ROTR(A, 13) ^ HASH_ROTR(A, 22)) + ((A & B) ^ (A & C) ^ (B & C));
+
+            H = G; G = F; F = E; E = D + T1;
+            D = C; C = B; B = A; A = T1 + T2;
+        }
+
+        State[0] += A; State[1] += B; State[2] += C; State[3] += D;
+        State[4] += E; State[5] += F; State[6] += G; State[7] += H;
+    }
+
+    for(size_t Lane = 0; Lane < Lanes; ++Lane)
+    {
+        for(int Word = 0; Word < 8; ++Word)
+        {
+            StoreBE32(Digests[Lane] + Word * 4, State[Word][Lane]);
+        }
+    }
+}
+
+// The input is always a 32-byte SHA-256 digest: one block, words 8..15 are constant padding
+template<typename V, size_t Lanes>
+HASH_INLINE void Ripemd160Lanes(const uint8_t (*Digests)[32], uint8_t (*Hashes)[20])
+{
+    V X[16];
+
+    for(int Word = 0; Word < 8; ++Word)
+    {
+        for(size_t Lane = 0; Lane < Lanes; ++Lane)
+        {
+            X[Word][Lane] = LoadLE32(Digests[Lane] + Word * 4);
+        }
+    }
+
+    for(int Word = 8; Word < 16; ++Word)
+    {
+        X[Word] = V{};
+    }
+
+    X[8] = V{} + 0x80u;
+    X[14] = V{} + 256u;
+
+    V A = V{} + RIPEMD160_INIT[0], B = V{} + RIPEMD160_INIT[1], C = V{} + RIPEMD160_INIT[2], D = V{} + RIPEMD160_INIT[3], E = V{} + RIPEMD160_INIT[4];
+    V AR = A, BR = B, CR = C, DR = D, ER = E;
+
+    #pragma GCC unroll 80
+    for(int Step = 0; Step < 80; ++Step)
+    {
+        const int Group = Step / 16;
+
+        V T = HASH_ROTL(A + RIPEMD160_F(Group, B, C, D) + X[RIPEMD160_R[Step]] + RIPEMD160_K[Group], RIPEMD160_S[Step]) + E;
+        A = E; E = D; D = HASH_ROTL(C, 10); C = B; B = T;
+
+        T = HASH_ROTL(AR + RIPEMD160_F(4 - Group, BR, CR, DR) + X[RIPEMD160_RR[Step]] + RIPEMD160_KR[Group], RIPEMD160_SR[Step]) + ER;
+        AR = ER; ER = DR; DR = HASH_ROTL(CR, 10); CR = BR; BR = T;
+    }
+
+    const V H0 = V{} + RIPEMD160_INIT[1] + C + DR;
+    const V H1 = V{} + RIPEMD160_INIT[2] + D + ER;
+    const V H2 = V{} + RIPEMD160_INIT[3] + E + AR;
+    const V H3 = V{} + RIPEMD160_INIT[4] + A + BR;
+    const V H4 = V{} + RIPEMD160_INIT[0] + B + CR;
+
+    for(size_t Lane = 0; Lane < Lanes; ++Lane)
+    {
+        StoreLE32(Hashes[Lane] + 0, H0[Lane]);
+        StoreLE32(Hashes[Lane] + 4, H1[Lane]);
+        StoreLE32(Hashes[Lane] + 8, H2[Lane]);
+        StoreLE32(Hashes[Lane] + 12, H3[Lane]);
+        StoreLE32(Hashes[Lane] + 16, H4[Lane]);
+    }
+}
+
+__attribute__((target("sse4.1"))) static void Sha256Sse41(const uint8_t *const *Padded, size_t Blocks, uint8_t (*Digests)[32])
+{
+    Sha256Lanes<HashVec4, 4>(Padded, Blocks, Digests);
+}
+
+__attribute__((target("sse4.1"))) static void Ripemd160Sse41(const uint8_t (*Digests)[32], uint8_t (*Hashes)[20])
+{
+    Ripemd160Lanes<HashVec4, 4>(Digests, Hashes);
+}
+
+__attribute__((target("avx2"))) static void Sha256Avx2(const uint8_t *const *Padded, size_t Blocks, uint8_t (*Digests)[32])
+{
+    Sha256Lanes<HashVec8, 8>(Padded, Blocks, Digests);
+}
+
+__attribute__((target("avx2"))) static void Ripemd160Avx2(const uint8_t (*Digests)[32], uint8_t (*Hashes)[20])
+{
+    Ripemd160Lanes<HashVec8, 8>(Digests, Hashes);
+}
+
+__attribute__((target("avx512f"))) static void Sha256Avx512(const uint8_t *const *Padded, size_t Blocks, uint8_t (*Digests)[32])
+{
+    Sha256Lanes<HashVec16, 16>(Padded, Blocks, Digests);
+}
+
+__attribute__((target("avx512f"))) static void Ripemd160Avx512(const uint8_t (*Digests)[32], uint8_t (*Hashes)[20])
+{
+    Ripemd160Lanes<HashVec16, 16>(Digests, Hashes);
+}
+
+// One message with the SHA-NI round instructions, four rounds per quarter block
+__attribute__((target("sha,sse4.1"))) static void Sha256ShaNi(const uint8_t *Padded, size_t Blocks, uint8_t *Digest)
+{
+    const __m128i ByteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    //The instructions want the state as ABEF and CDGH
+    __m128i Tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&SHA256_INIT[0])), 0xB1);
+    __m128i State1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&SHA256_INIT[4])), 0x1B);
+    __m128i State0 = _mm_alignr_epi8(Tmp, State1, 8);
+    State1 = _mm_blend_epi16(State1, Tmp, 0xF0);
+
+    for(size_t Block = 0; Block < Blocks; ++Block)
+    {
+        const uint8_t *Data = Padded + Block * 64;
+        const __m128i Saved0 = State0, Saved1 = State1;
+        __m128i Msg[4];
+
+        #pragma GCC unroll 16
+        for(int Quad = 0; Quad < 16; ++Quad)
+        {
+            if(Quad < 4)
+            {
+                Msg[Quad] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + Quad * 16)), ByteSwap);
+            }
+
+            __m128i Words = _mm_add_epi32(Msg[Quad % 4], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&SHA256_K[Quad * 4])));
+            State1 = _mm_sha256rnds2_epu32(State1, State0, Words);
+
+            //Schedule: the next quarter gets its second half from the current one
+            if(Quad >= 3 && Quad < 15)
+            {
+                const __m128i Shifted = _mm_alignr_epi8(Msg[Quad % 4], Msg[(Quad + 3) % 4], 4);
+                Msg[(Quad + 1) % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(Msg[(Quad + 1) % 4], Shifted), Msg[Quad % 4]);
+            }
+
+            Words = _mm_shuffle_epi32(Words, 0x0E);
+            State0 = _mm_sha256rnds2_epu32(State0, State1, Words);
+
+            if(Quad >= 1 && Quad < 13)
+            {
+                Msg[(Quad + 3) % 4] = _mm_sha256msg1_epu32(Msg[(Quad + 3) % 4], Msg[Quad % 4]);
+            }
+        }
+
+        State0 = _mm_add_epi32(State0, Saved0);
+        State1 = _mm_add_epi32(State1, Saved1);
+    }
+
+    Tmp = _mm_shuffle_epi32(State0, 0x1B);
+    State1 = _mm_shuffle_epi32(State1, 0xB1);
+    State0 = _mm_blend_epi16(Tmp, State1, 0xF0);
+    State1 = _mm_alignr_epi8(State1, Tmp, 8);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(Digest), _mm_shuffle_epi8(State0, ByteSwap));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(Digest + 16), _mm_shuffle_epi8(State1, ByteSwap));
+}
+
+static bool CpuHasShaNi()
+{
+    unsigned int Eax = 0, Ebx = 0, Ecx = 0, Edx = 0;
+    return __get_cpuid_count(7, 0, &Eax, &Ebx, &Ecx, &Edx) && (Ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1");
+}
+
+#undef HASH_INLINE
+#undef HASH_ROTR
+#undef HASH_ROTL
+#undef RIPEMD160_F
+
+#endif // HASH160_X86
+
+// Kernels of a given level, Scalar when the CPU lacks it; ShaNi is used only when asked for and present
+static HashKernels GetHashKernels(HashLevel Level, bool UseShaNi = true)
+{
+    HashKernels Kernels;
+
+#if defined(HASH160_X86)
+    __builtin_cpu_init();
+
+    if(Level == HashLevel::Avx512 && __builtin_cpu_supports("avx512f"))
+    {
+        Kernels = { HashLevel::Avx512, false, 16, Sha256Avx512, Ripemd160Avx512, nullptr, "avx512" };
+    }
+    else if(Level >= HashLevel::Avx2 && __builtin_cpu_supports("avx2"))
+    {
+        Kernels = { HashLevel::Avx2, false, 8, Sha256Avx2, Ripemd160Avx2, nullptr, "avx2" };
+    }
+    else if(Level >= HashLevel::Sse41 && __builtin_cpu_supports("sse4.1"))
+    {
+        Kernels = { HashLevel::Sse41, false, 4, Sha256Sse41, Ripemd160Sse41, nullptr, "sse4.1" };
+    }
+
+    if(UseShaNi && CpuHasShaNi())
+    {
+        Kernels.ShaNi = true;
+        Kernels.Sha256Single = Sha256ShaNi;
+        Kernels.Name = Kernels.Lanes == 16 ? "sha-ni + avx512" : Kernels.Lanes == 8 ? "sha-ni + avx2" : Kernels.Lanes == 4 ? "sha-ni + sse4.1" : "sha-ni";
+    }
+#else
+    (void)Level;
+    (void)UseShaNi;
+#endif
+
+    return Kernels;
+}
+
+// The best kernels of this CPU, detected once
+static const HashKernels &GetBestHashKernels()
+{
+    static const HashKernels Best = GetHashKernels(HashLevel::Avx512);
+    return Best;
+}
+
+// Hash160 of Count messages of any size into Hashes[0..Count)
+static void Hash160Many(const uint8_t *const *Messages, const size_t *Sizes, size_t Count, uint8_t (*Hashes)[20], const HashKernels &Kernels = GetBestHashKernels())
+{
+    std::vector<std::array<uint8_t, 32>> Digests(Count);
+    auto *DigestBytes = reinterpret_cast<uint8_t (*)[32]>(Digests.data());
+
+    if(Kernels.Lanes == 1 && !Kernels.ShaNi)
+    {
+        for(size_t Index = 0; Index < Count; ++Index)
+        {
+            sha256_Raw(Messages[Index], Sizes[Index], DigestBytes[Index]);
+            btc_ripemd160(DigestBytes[Index], 32, Hashes[Index]);
+        }
+
+        return;
+    }
+
+    //Pad every message in place of one buffer, lanes must all run the same number of blocks
+    std::vector<size_t> Offsets(Count), BlockCounts(Count);
+    size_t Total = 0;
+
+    for(size_t Index = 0; Index < Count; ++Index)
+    {
+        Offsets[Index] = Total;
+        BlockCounts[Index] = (Sizes[Index] + 9 + 63) / 64;
+        Total += BlockCounts[Index] * 64;
+    }
+
+    std::vector<uint8_t> Padded(Total);
+
+    for(size_t Index = 0; Index < Count; ++Index)
+    {
+        Sha256Pad(Messages[Index], Sizes[Index], Padded.data() + Offsets[Index]);
+    }
+
+    if(Kernels.ShaNi)
+    {
+        for(size_t Index = 0; Index < Count; ++Index)
+        {
+            Kernels.Sha256Single(Padded.data() + Offsets[Index], BlockCounts[Index], DigestBytes[Index]);
+        }
+    }
+    else
+    {
+        //Short messages are nearly always one or two blocks, each pass takes the next group with equal counts
+        std::vector<size_t> Order(Count);
+        for(size_t Index = 0; Index < Count; ++Index) Order[Index] = Index;
+
+        std::stable_sort(Order.begin(), Order.end(), [&BlockCounts](size_t Left, size_t Right) { return BlockCounts[Left] < BlockCounts[Right]; });
+
+        const uint8_t *LanePointers[16];
+        uint8_t LaneDigests[16][32];
+
+        for(size_t First = 0; First < Count;)
+        {
+            const size_t Blocks = BlockCounts[Order[First]];
+            size_t Used = 0;
+
+            while(Used < Kernels.Lanes && First + Used < Count && BlockCounts[Order[First + Used]] == Blocks)
+            {
+                LanePointers[Used] = Padded.data() + Offsets[Order[First + Used]];
+                Used++;
+            }
+
+            //Idle lanes repeat the first message, their results are dropped
+            for(size_t Lane = Used; Lane < Kernels.Lanes; ++Lane)
+            {
+                LanePointers[Lane] = LanePointers[0];
+            }
+
+            Kernels.Sha256(LanePointers, Blocks, LaneDigests);
+
+            for(size_t Lane = 0; Lane < Used; ++Lane)
+            {
+                memcpy(DigestBytes[Order[First + Lane]], LaneDigests[Lane], 32);
+            }
+
+            First += Used;
+        }
+    }
+
+    if(Kernels.Lanes == 1)
+    {
+        for(size_t Index = 0; Index < Count; ++Index)
+        {
+            btc_ripemd160(DigestBytes[Index], 32, Hashes[Index]);
+        }
+
+        return;
+    }
+
+    uint8_t LaneInput[16][32];
+    uint8_t LaneHashes[16][20];
+
+    for(size_t First = 0; First < Count; First += Kernels.Lanes)
+    {
+        const size_t Used = std::min(Kernels.Lanes, Count - First);
+
+        for(size_t Lane = 0; Lane < Kernels.Lanes; ++Lane)
+        {
+            memcpy(LaneInput[Lane], DigestBytes[First + (Lane < Used ? Lane : 0)], 32);
+        }
+
+        Kernels.Ripemd160(LaneInput, LaneHashes);
+
+        memcpy(Hashes[First], LaneHashes[0], Used * 20);
+    }
+}
+
+// Messages of equal size laid out Stride bytes apart, the common case of serialized public keys
+static void Hash160Strided(const uint8_t *Messages, size_t Size, size_t Stride, size_t Count, uint8_t (*Hashes)[20], const HashKernels &Kernels = GetBestHashKernels())
+{
+    std::vector<const uint8_t*> Pointers(Count);
+    std::vector<size_t> Sizes(Count, Size);
+
+    for(size_t Index = 0; Index < Count; ++Index)
+    {
+        Pointers[Index] = Messages + Index * Stride;
+    }
+
+    Hash160Many(Pointers.data(), Sizes.data(), Count, Hashes, Kernels);
+}
+
+#endif // HASH160_H
@@ -0,0 +1,198 @@
+#ifndef HDDERIVER_H
+#define HDDERIVER_H
+
+#include <watchset.h>
+#include <hash160.h>
+
+#include <btc/base58.h>
+#include <btc/bip32.h>
+#include <btc/chainparams.h>
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Derives the m/i and m/branch/i P2PKH addresses of an xpub. The xpub is decoded once, every child is a copy of the parsed
+// node plus one public CKD step, and the hash160 comes straight from the child key: no Base58 round trips
+// of extended keys, the only string built is the final address.
+// Const after construction, one deriver can be shared by threads.
+class HdDeriver
+{
+public:
+
+    struct DerivedAddress
+    {
+        uint32_t Index = 0;
+        Hash160Key Hash160;
+        std::string Address;
+    };
+
+    HdDeriver(const btc_chainparams *Chain, const std::string &XpubAddress)
+        : m_Chain(Chain)
+    {
+        m_IsValid = btc_hdnode_deserialize(XpubAddress.c_str(), Chain, &m_Master);
+    }
+
+    bool IsValid() const
+    {
+        return m_IsValid;
+    }
+
+    bool DeriveHash160(uint32_t Index, Hash160Key &Hash160) const
+    {
+        if(!m_IsValid)
+        {
+            return false;
+        }
+
+        return DeriveChild(m_Master, Index, Hash160);
+    }
+
+    bool DeriveAddress(uint32_t Index, std::string &Address, Hash160Key &Hash160) const
+    {
+        if(!DeriveHash160(Index, Hash160))
+        {
+            return false;
+        }
+
+        Address = EncodeAddress(Hash160);
+        return true;
+    }
+
+    // m/Branch/Start .. m/Branch/(Start + Count - 1), the usual BIP44 external (0) and change (1) chains of an
+    // account xpub. Contiguous slices go to Threads workers (0: all cores); CKD only reads the shared
+    // secp256k1 context, so workers need no context of their own and no locking.
+    bool DeriveRange(uint32_t Branch, uint32_t Start, uint32_t Count, std::vector<DerivedAddress> &Derived, size_t Threads = 0) const
+    {
+        btc_hdnode BranchNode = m_Master;
+
+        if(!m_IsValid || !btc_hdnode_public_ckd(&BranchNode, Branch))
+        {
+            return false;
+        }
+
+        return DeriveChildren(BranchNode, Start, Count, Derived, Threads);
+    }
+
+    // m/Start .. m/(Start + Count - 1)
+    bool DeriveRange(uint32_t Start, uint32_t Count, std::vector<DerivedAddress> &Derived, size_t Threads = 0) const
+    {
+        return m_IsValid && DeriveChildren(m_Master, Start, Count, Derived, Threads);
+    }
+
+    // Base58Check of the version byte and the hash160
+    std::string EncodeAddress(const Hash160Key &Hash160) const
+    {
+        uint8_t Payload[1 + 20];
+        //Max bitcoin raw address length, for not nulling this string from garbage symbols tailing \000
+        char Encoded[36];
+
+        Payload[0] = m_Chain->b58prefix_pubkey_address;
+        memcpy(Payload + 1, Hash160.data(), Hash160.size());
+
+        if(!btc_base58_encode_check(Payload, sizeof (Payload), Encoded, sizeof (Encoded)))
+        {
+            return std::string();
+        }
+
+        return Encoded;
+    }
+
+private:
+
+    static constexpr size_t MinPerThread = 64;
+
+    // Public keys derived between two batched Hash160 calls
+    static constexpr size_t HashBatch = 256;
+
+    bool DeriveChildren(const btc_hdnode &Parent, uint32_t Start, uint32_t Count, std::vector<DerivedAddress> &Derived, size_t Threads) const
+    {
+        Derived.assign(Count, DerivedAddress());
+
+        if(Threads == 0)
+        {
+            Threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        //Thread start-up costs more than a few derivations
+        Threads = std::max<size_t>(1, std::min<size_t>(Threads, Count / MinPerThread));
+
+        std::atomic<bool> Failed{false};
+
+        auto DeriveSlice = [&](size_t Begin, size_t End)
+        {
+            uint8_t PublicKeys[HashBatch][BTC_ECKEY_COMPRESSED_LENGTH];
+            uint8_t Hashes[HashBatch][20];
+
+            for(size_t First = Begin; First < End && !Failed; First += HashBatch)
+            {
+                const size_t Batch = std::min(HashBatch, End - First);
+
+                for(size_t Offset = 0; Offset < Batch; ++Offset)
+                {
+                    btc_hdnode Child = Parent;
+                    Derived[First + Offset].Index = Start + static_cast<uint32_t>(First + Offset);
+
+                    if(!btc_hdnode_public_ckd(&Child, Derived[First + Offset].Index))
+                    {
+                        Failed = true;
+                        return;
+                    }
+
+                    memcpy(PublicKeys[Offset], Child.public_key, BTC_ECKEY_COMPRESSED_LENGTH);
+                }
+
+                Hash160Strided(PublicKeys[0], BTC_ECKEY_COMPRESSED_LENGTH, BTC_ECKEY_COMPRESSED_LENGTH, Batch, Hashes);
+
+                for(size_t Offset = 0; Offset < Batch; ++Offset)
+                {
+                    DerivedAddress &Out = Derived[First + Offset];
+
+                    memcpy(Out.Hash160.data(), Hashes[Offset], Out.Hash160.size());
+                    Out.Address = EncodeAddress(Out.Hash160);
+                }
+            }
+        };
+
+        std::vector<std::thread> Workers;
+        const size_t Slice = (Count + Threads - 1) / Threads;
+
+        for(size_t Begin = Slice; Begin < Count; Begin += Slice)
+        {
+            Workers.emplace_back(DeriveSlice, Begin, std::min<size_t>(Begin + Slice, Count));
+        }
+
+        DeriveSlice(0, std::min<size_t>(Slice, Count));
+
+        for(auto &Worker : Workers)
+        {
+            Worker.join();
+        }
+
+        return !Failed;
+    }
+
+    static bool DeriveChild(const btc_hdnode &Parent, uint32_t Index, Hash160Key &Hash160)
+    {
+        btc_hdnode Child = Parent;
+
+        if(!btc_hdnode_public_ckd(&Child, Index))
+        {
+            return false;
+        }
+
+        btc_hdnode_get_hash160(&Child, Hash160.data());
+        return true;
+    }
+
+private:
+
+    const btc_chainparams *m_Chain = nullptr;
+    btc_hdnode m_Master;
+    bool m_IsValid = false;
+};
+
+#endif // HDDERIVER_H
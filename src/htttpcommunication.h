@@ -4,7 +4,13 @@
 #include <jsonrpccpp/client.h>
 #include <jsonrpccpp/client/connectors/httpclient.h>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 #include <loggerinstances.h>
 
@@ -14,10 +20,23 @@ class HttpCommunication
 {
 public:
 
-    // Separated password and login and endpoint string to CURL connection
+    // One entry of a JSON-RPC batch
+    struct Request
+    {
+        std::string Method;
+        Json::Value Parameters;
+    };
+
+    // Upper bound of requests sent in one POST, keeps response documents reasonably sized
+    static constexpr size_t MaxBatchSize = 500;
+
+    // Separated password and login and endpoint string to CURL connection.
+    // PoolSize persistent connections are kept, so that many calls may be in flight (see bitcoind -rpcthreads)
     HttpCommunication(bool IsRegtest,
                       const std::string &Login = "hacker",
-                      const std::string &Password = "qwerty")
+                      const std::string &Password = "qwerty",
+                      size_t PoolSize = 4)
+        : m_PoolSize(std::max<size_t>(PoolSize, 1))
     {
         std::string Endpoint{};
 
@@ -41,8 +60,10 @@ public:
     // Do not forget to clean after us
     ~HttpCommunication()
     {
-        if(Http) delete Http;
-        if(Connector) delete Connector;
+        for(auto &Connection : m_Connections)
+        {
+            Disconnect(*Connection);
+        }
     }
 
     // Addition of a new address to out watchonly wallet to labeled group
@@ -54,6 +75,22 @@ public:
         return CallMethod(Method, Parameters, Response);
     }
 
+    // Many imports in one batched round trip
+    bool AddNewAddresses(const std::vector<std::string> &NewAddresses, const bool WithRescan)
+    {
+        std::vector<Request> Requests;
+        std::vector<Json::Value> Responses;
+
+        for(auto &NewAddress : NewAddresses)
+        {
+            Json::Value Parameters = Json::arrayValue;
+            Parameters.append(NewAddress); Parameters.append("Imported"); Parameters.append(WithRescan);
+            Requests.push_back({"importaddress", Parameters});
+        }
+
+        return CallBatch(Requests, Responses);
+    }
+
     bool GetCurrentBlockChainInfo(int &LastBlock)
     {
         return GetCurrentBlockCount(LastBlock);
@@ -120,23 +157,128 @@ public:
     }
 
 
+    bool GetBlockHashes(const std::vector<int> &BlockIndexes, std::vector<std::string> &Hashes)
+    {
+        std::vector<Request> Requests;
+        std::vector<Json::Value> Responses;
+
+        for(int BlockIndex : BlockIndexes)
+        {
+            Json::Value Parameter = Json::arrayValue;
+            Parameter.append(BlockIndex);
+            Requests.push_back({"getblockhash", Parameter});
+        }
+
+        if(!CallBatch(Requests, Responses))
+        {
+            return false;
+        }
+
+        Hashes.clear();
+
+        for(auto &Response : Responses)
+        {
+            Hashes.push_back(Response.asString());
+        }
+
+        return true;
+    }
+
+    bool GetBlockInfos(const std::vector<std::string> &BlockHashes, std::vector<Json::Value> &BlockInfos)
+    {
+        std::vector<Request> Requests;
+
+        for(auto &BlockHash : BlockHashes)
+        {
+            Json::Value Parameter = Json::arrayValue;
+            Parameter.append(BlockHash);
+            Requests.push_back({"getblock", Parameter});
+        }
+
+        return CallBatch(Requests, BlockInfos);
+    }
+
+    // Serialized blocks as hex (getblock verbosity 0), no transaction lookups and -txindex needed
+    bool GetRawBlocks(const std::vector<std::string> &BlockHashes, std::vector<std::string> &RawBlocks)
+    {
+        std::vector<Request> Requests;
+        std::vector<Json::Value> Responses;
+
+        for(auto &BlockHash : BlockHashes)
+        {
+            Json::Value Parameter = Json::arrayValue;
+            Parameter.append(BlockHash);
+            Parameter.append(0);
+            Requests.push_back({"getblock", Parameter});
+        }
+
+        if(!CallBatch(Requests, Responses))
+        {
+            return false;
+        }
+
+        RawBlocks.clear();
+
+        for(auto &Response : Responses)
+        {
+            RawBlocks.push_back(Response.asString());
+        }
+
+        return true;
+    }
+
+    bool GetRawTxInfos(const std::vector<std::string> &TxIds, std::vector<Json::Value> &TxInfos)
+    {
+        std::vector<Request> Requests;
+
+        for(auto &TxId : TxIds)
+        {
+            Json::Value Parameter = Json::arrayValue;
+            Parameter.append(TxId);
+            Parameter.append(1);
+            Requests.push_back({"getrawtransaction", Parameter});
+        }
+
+        return CallBatch(Requests, TxInfos);
+    }
+
+    // JSON-RPC batch: requests go out as arrays of up to MaxBatchSize calls per POST.
+    // Responses are returned in request order, fails if any of the calls failed.
+    bool CallBatch(const std::vector<Request> &Requests, std::vector<Json::Value> &Responses)
+    {
+        Responses.assign(Requests.size(), Json::Value());
+
+        for(size_t Offset = 0; Offset < Requests.size(); Offset += MaxBatchSize)
+        {
+            const size_t Count = std::min(MaxBatchSize, Requests.size() - Offset);
+
+            if(!SendBatch(Requests, Offset, Count, Responses))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     // Possible bottleneck, as we have to wait for an answer from json-rpc server, witch may be very slow.
-    // This will be called in background async thread, and must not affect on other calls to DB
+    // Each call leases its own pooled connection, so slow calls do not block the others.
     bool CallMethod(const std::string &Method, const Json::Value &Parameters, Json::Value &Response)
     {
-        //Guard the transmission environment
-        std::unique_lock<std::mutex> lock(m_TransmissionGuard);
+        ConnectionLease Lease(*this);
 
-        if (Connector)
+        if (Lease->Connector)
         {
             try
             {
-                Response = Connector->CallMethod(Method, Parameters);
+                Response = Lease->Connector->CallMethod(Method, Parameters);
+                MarkHealthy(*Lease);
                 PLOG_VERBOSE_(HttpLogger) << "Json-RPC call: " << Method;
                 return true;
             }
             catch (JsonRpcException &e)
             {
+                MarkFailed(*Lease, e);
                 PLOG_WARNING_(HttpLogger) << "Json-RPC call failed with error: " << e.what();
                 return false;
             }
@@ -145,9 +287,174 @@ public:
         return false;
     }
 
+    size_t GetPoolSize() const
+    {
+        return m_PoolSize;
+    }
+
 private:
 
-    std::mutex m_TransmissionGuard;
+    // One persistent keep-alive connection to bitcoind
+    struct RpcConnection
+    {
+        HttpClient *Http = nullptr;
+        Client *Connector = nullptr;
+
+        bool IsHealthy = false;
+        size_t Failures = 0;
+        std::chrono::steady_clock::time_point RetryAfter{};
+    };
+
+    // Takes an idle connection from the pool for the lifetime of the lease
+    class ConnectionLease
+    {
+    public:
+
+        ConnectionLease(HttpCommunication &Owner) : m_Owner(Owner), m_Connection(Owner.AcquireConnection()) {}
+        ~ConnectionLease() { m_Owner.ReleaseConnection(m_Connection); }
+
+        RpcConnection *operator->() const { return m_Connection; }
+        RpcConnection &operator*() const { return *m_Connection; }
+
+    private:
+
+        HttpCommunication &m_Owner;
+        RpcConnection *m_Connection;
+    };
+
+    // Unhealthy connections are reconnected at most once per second
+    static constexpr std::chrono::seconds ReconnectDelay{1};
+
+    RpcConnection *AcquireConnection()
+    {
+        std::unique_lock<std::mutex> lock(m_PoolGuard);
+        m_PoolCondition.wait(lock, [this] { return !m_IdleConnections.empty(); });
+
+        //Prefer healthy connections, fall back to any idle one
+        auto Found = std::find_if(m_IdleConnections.begin(), m_IdleConnections.end(), [](RpcConnection *Connection) { return Connection->IsHealthy; });
+        if(Found == m_IdleConnections.end()) Found = m_IdleConnections.begin();
+
+        RpcConnection *Connection = *Found;
+        m_IdleConnections.erase(Found);
+        lock.unlock();
+
+        if(!Connection->IsHealthy && std::chrono::steady_clock::now() >= Connection->RetryAfter)
+        {
+            Connect(*Connection);
+        }
+
+        return Connection;
+    }
+
+    void ReleaseConnection(RpcConnection *Connection)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_PoolGuard);
+            m_IdleConnections.push_back(Connection);
+        }
+
+        m_PoolCondition.notify_one();
+    }
+
+    void MarkHealthy(RpcConnection &Connection)
+    {
+        Connection.IsHealthy = true;
+        Connection.Failures = 0;
+    }
+
+    // Only transport errors mark a connection broken, RPC errors are answers from a live bitcoind
+    void MarkFailed(RpcConnection &Connection, const JsonRpcException &Error)
+    {
+        if(Error.GetCode() != Errors::ERROR_CLIENT_CONNECTOR)
+        {
+            return;
+        }
+
+        Connection.IsHealthy = false;
+        Connection.Failures++;
+        Connection.RetryAfter = std::chrono::steady_clock::now() + ReconnectDelay;
+
+        PLOG_WARNING_(HttpLogger) << "Json-RPC connection marked unhealthy, failures in a row: " << Connection.Failures;
+    }
+
+    bool SendBatch(const std::vector<Request> &Requests, size_t Offset, size_t Count, std::vector<Json::Value> &Responses)
+    {
+        Json::Value Batch = Json::arrayValue;
+
+        //Ids are indexes into Requests, bitcoind may answer a batch in any order
+        for(size_t Index = Offset; Index < Offset + Count; ++Index)
+        {
+            Json::Value Call;
+            Call["jsonrpc"] = "1.0";
+            Call["id"] = static_cast<Json::UInt64>(Index);
+            Call["method"] = Requests[Index].Method;
+            Call["params"] = Requests[Index].Parameters;
+            Batch.append(Call);
+        }
+
+        Json::StreamWriterBuilder Writer;
+        Writer["indentation"] = "";
+        const std::string Message = Json::writeString(Writer, Batch);
+        std::string Result;
+
+        {
+            ConnectionLease Lease(*this);
+
+            if(!Lease->Http)
+            {
+                return false;
+            }
+
+            try
+            {
+                Lease->Http->SendRPCMessage(Message, Result);
+                MarkHealthy(*Lease);
+            }
+            catch (JsonRpcException &e)
+            {
+                MarkFailed(*Lease, e);
+                PLOG_WARNING_(HttpLogger) << "Json-RPC batch call failed with error: " << e.what();
+                return false;
+            }
+        }
+
+        Json::Value ResultJson;
+        Json::CharReaderBuilder Reader;
+        std::string Errors;
+        std::istringstream ResultStream(Result);
+
+        if(!Json::parseFromStream(Reader, ResultStream, &ResultJson, &Errors) || !ResultJson.isArray())
+        {
+            PLOG_WARNING_(HttpLogger) << "Json-RPC batch response malformed: " << Errors;
+            return false;
+        }
+
+        bool Succeed = true;
+
+        for(auto &Entry : ResultJson)
+        {
+            const Json::UInt64 Id = Entry["id"].asUInt64();
+
+            if(Id < Offset || Id >= Offset + Count)
+            {
+                Succeed = false;
+                continue;
+            }
+
+            if(!Entry["error"].isNull())
+            {
+                PLOG_WARNING_(HttpLogger) << "Json-RPC batch call " << Requests[Id].Method << " failed with error: " << Entry["error"];
+                Succeed = false;
+                continue;
+            }
+
+            Responses[Id] = Entry["result"];
+        }
+
+        PLOG_VERBOSE_(HttpLogger) << "Json-RPC batch call: " << Count << " requests";
+
+        return Succeed && ResultJson.size() == Count;
+    }
 
     // Making full connection enpoint for CURL, from three pieces;
     std::string MakeCurlEndpoint(const std::string &Endpoint,
@@ -170,34 +477,62 @@ private:
 
     bool Init()
     {
-        Http = new HttpClient(m_CurlEndpoint);
+        size_t Healthy = 0;
 
-        if(Http)
+        for(size_t Index = 0; Index < m_PoolSize; ++Index)
         {
-            PLOG_VERBOSE_(HttpLogger) << "Http client started successfuly on " << m_CurlEndpoint;
+            m_Connections.emplace_back(new RpcConnection());
 
-            Connector = new Client(*Http, JSONRPC_CLIENT_V1, false);
+            if(Connect(*m_Connections.back())) Healthy++;
 
-            if(Connector)
-            {
-                PLOG_VERBOSE_(HttpLogger) << "Http client connector started successfuly! ";
+            m_IdleConnections.push_back(m_Connections.back().get());
+        }
 
-                return TestConnection();
-            }
+        PLOG_VERBOSE_(HttpLogger) << "Http connection pool started, healthy connections: " << Healthy << " of " << m_PoolSize;
+        PLOG_FATAL_IF_(HttpLogger, Healthy == 0) << "Http client init failed on: " << m_CurlEndpoint;
+
+        return Healthy > 0;
+    }
+
+    // (Re)creates the connection and pings bitcoind through it
+    bool Connect(RpcConnection &Connection)
+    {
+        Disconnect(Connection);
+
+        Connection.Http = new HttpClient(m_CurlEndpoint);
+        Connection.Connector = new Client(*Connection.Http, JSONRPC_CLIENT_V1, false);
+
+        PLOG_VERBOSE_(HttpLogger) << "Http client started successfuly on " << m_CurlEndpoint;
+
+        if(TestConnection(Connection))
+        {
+            MarkHealthy(Connection);
+            return true;
         }
 
-        PLOG_FATAL_(HttpLogger) << "Http client init failed on: " << m_CurlEndpoint;
+        Connection.IsHealthy = false;
+        Connection.Failures++;
+        Connection.RetryAfter = std::chrono::steady_clock::now() + ReconnectDelay;
 
         return false;
     }
 
+    void Disconnect(RpcConnection &Connection)
+    {
+        if(Connection.Connector) delete Connection.Connector;
+        if(Connection.Http) delete Connection.Http;
+
+        Connection.Connector = nullptr;
+        Connection.Http = nullptr;
+    }
+
     void InitLogger()
     {
          plog::init<HttpLogger>(GLOBAL_LOG_SEVERITY, "http.log");
     }
 
     // Uptime rpc call is used to detect a connection status of startup.
-    bool TestConnection()
+    bool TestConnection(RpcConnection &Connection)
     {
         Json::Value Params, Response;
         Params = Json::arrayValue;
@@ -206,7 +541,7 @@ private:
 
         try
         {
-          Response = Connector->CallMethod(Ping, Params);
+          Response = Connection.Connector->CallMethod(Ping, Params);
 
           PLOG_VERBOSE_(HttpLogger) << "Connection to bitcoind succed. Bitcoind uptime: " << Response << std::endl;
           return true;
@@ -220,8 +555,13 @@ private:
 
 private:
 
-    HttpClient *Http = nullptr;
-    Client *Connector = nullptr;
+    size_t m_PoolSize = 1;
+
+    std::vector<std::unique_ptr<RpcConnection>> m_Connections;
+    std::vector<RpcConnection*> m_IdleConnections;
+
+    std::mutex m_PoolGuard;
+    std::condition_variable m_PoolCondition;
 
     std::string m_CurlEndpoint = "";
 };
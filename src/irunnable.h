@@ -65,8 +65,14 @@ public:
 
     inline void WaitForCompletion()
     {
-        // Block until this thread exits
+        if (!IsStarted)
+        {
+            return;
+        }
+
+        // Block until this thread exits, a joined thread must not be cancelled afterwards
         pthread_join(Thread, nullptr);
+        IsStarted = false;
     }
 
 protected:
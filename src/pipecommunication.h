@@ -2,6 +2,7 @@
 #define PIPECOMMUNICATION_H
 
 #include <irunnable.h>
+#include <wireprotocol.h>
 
 #include <stdio.h>
 #include <string>
@@ -9,45 +10,24 @@
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <sstream>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <algorithm>
 
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include <loggerinstances.h>
 
 #define BUFFERSSIZE 1024*1024
 
-static const std::string DELIMETERS = " .,:;/";
-
-//Split our pipe command with different delimeters
-std::vector<std::string> Split(const std::string& StringToSplit, const std::string& Delimeters)
-{
-   std::vector<std::string> FoundTokens;
-   std::string OneToken;
-   std::istringstream TokenStream(StringToSplit);
-
-   for(auto &Delimeter : Delimeters)
-   {
-       while (std::getline(TokenStream, OneToken, Delimeter))
-       {
-          FoundTokens.push_back(OneToken);
-       }
-   }
-
-   return FoundTokens;
-}
-
-static std::string StrToLower(std::string s)
-{
-    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::tolower(c); });
-    return s;
-}
-
 class PipeCommand
 {
 public:
@@ -72,40 +52,154 @@ public:
         _Parameter = Paramater;
     }
 
-    //This is not a real deserializer, but using a boost or protobuf here - is just an overkill;
+    //Connection the command came from, 0 for the FIFO
+    uint64_t GetClientId() const
+    {
+        return _ClientId;
+    }
+
+    void SetClientId(uint64_t ClientId)
+    {
+        _ClientId = ClientId;
+    }
+
+    //Binary frames carry a request id for the reply
+    uint32_t GetRequestId() const
+    {
+        return _RequestId;
+    }
+
+    bool IsFramed() const
+    {
+        return _Framed;
+    }
+
+    //Socket clients and framed requests pipeline, so they get exactly one reply per request
+    bool ExpectsReply() const
+    {
+        return _ClientId != 0 || _Framed;
+    }
+
+    //One text line including its trailing newline, which is dropped
     bool Deserialize(const void *Buffer, size_t Size)
     {
-        if(Buffer && Size > 0)
+        if(!Buffer || Size == 0)
         {
-            std::string PipeString(static_cast<const char*>(Buffer), Size - 1);
-            std::vector<std::string> TokensFound = Split(PipeString, DELIMETERS);
+            return false;
+        }
 
-            if(TokensFound.size() == 1 && IsValid(TokensFound.at(0)))
-            {
-                SetCommand(TokensFound.at(0));
-                return true;
-            }
+        WireMessage Message;
+        ParseTextLine(std::string_view(static_cast<const char*>(Buffer), Size - 1), Message);
+
+        return FromWire(Message);
+    }
+
+    //False for an unknown command, the framing fields are kept anyway so it can still be answered
+    bool FromWire(const WireMessage &Message)
+    {
+        _Framed = Message.Framed;
+        _RequestId = Message.RequestId;
+        _CommandName.assign(Message.Command.data(), Message.Command.size());
+        _Parameter.assign(Message.Parameter.data(), Message.Parameter.size());
+
+        return !Message.Command.empty();
+    }
+
+    //Reply bytes in the protocol the request came in
+    std::string FormatReply(const std::string &Message, bool IsError = false) const
+    {
+        std::string Out;
+
+        if(_Framed)
+        {
+            AppendFrame(Out, IsError ? WIRE_OP_ERROR : WIRE_OP_REPLY, _RequestId, Message);
+        }
+        else
+        {
+            Out.reserve(Message.size() + 1);
+            Out.append(Message).push_back('\n');
+        }
+
+        return Out;
+    }
+
+private:
 
-            if(TokensFound.size() == 2 && IsValid(TokensFound.at(0)))
+    std::string _CommandName;
+    std::string _Parameter;
+    uint64_t _ClientId = 0;
+    uint32_t _RequestId = 0;
+    bool _Framed = false;
+};
+
+//Commands received from any channel, consumed in arrival order by the main thread
+class CommandInbox
+{
+public:
+
+    void Push(std::vector<PipeCommand> &Commands)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+
+            for(auto &Command : Commands)
             {
-                SetCommand(TokensFound.at(0));
-                SetParameter(TokensFound.at(1));
-                return true;
+                m_Commands.push(std::move(Command));
             }
         }
 
-        return false;
+        m_Condition.notify_one();
+    }
+
+    bool Pop(PipeCommand &Command)
+    {
+        std::lock_guard<std::mutex> lock(m_Guard);
+
+        if(m_Commands.empty())
+        {
+            return false;
+        }
+
+        Command = std::move(m_Commands.front());
+        m_Commands.pop();
+        return true;
+    }
+
+    void TakeAll(std::queue<PipeCommand> &Commands)
+    {
+        std::lock_guard<std::mutex> lock(m_Guard);
+        Commands = std::move(m_Commands);
+        m_Commands = std::queue<PipeCommand>();
+    }
+
+    //Blocks until at least one command arrived or Wake was called, then grabs them all
+    void WaitAll(std::queue<PipeCommand> &Commands)
+    {
+        std::unique_lock<std::mutex> lock(m_Guard);
+        m_Condition.wait(lock, [this] { return !m_Commands.empty() || m_Woken; });
+
+        m_Woken = false;
+        Commands = std::move(m_Commands);
+        m_Commands = std::queue<PipeCommand>();
     }
 
-    bool IsValid(const std::string &Command) const
+    //Lets the consumer look at work finished elsewhere, WaitAll may return without commands
+    void Wake()
     {
-        return StrToLower(Command) == std::string("generateaddress") || StrToLower(Command) == std::string("getbalance");
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+            m_Woken = true;
+        }
+
+        m_Condition.notify_one();
     }
 
 private:
 
-    std::string _CommandName;
-    std::string _Parameter;
+    std::queue<PipeCommand> m_Commands;
+    bool m_Woken = false;
+    std::mutex m_Guard;
+    std::condition_variable m_Condition;
 };
 
 class PipeCommunication : public IRunnable
@@ -121,11 +215,14 @@ public:
     {
         InitLogger();
         OpenPipes();
+        InitEventLoop();
         AllocateBuffers();
         IRunnable::Start();
     }
 
-    PipeCommunication()
+    //Received commands go to SharedInbox when given, so other channels can feed the same consumer
+    PipeCommunication(CommandInbox *SharedInbox = nullptr)
+        : m_Inbox(SharedInbox ? SharedInbox : &m_OwnInbox)
     {
         m_InPipeName = "testpipein";
         m_OutPipeName = "testpipeout";
@@ -133,49 +230,61 @@ public:
 
         InitLogger();
         OpenPipes();
+        InitEventLoop();
         AllocateBuffers();
         IRunnable::Start();
     }
 
     ~PipeCommunication() override
     {
+        //Let the loop leave epoll_wait on its own before the descriptors go away
+        m_Stopping = true;
+        Wake();
+        IRunnable::WaitForCompletion();
+
         ClosePipes();
         FreeBuffers();
         RemovePipeFiles();
-        IRunnable::Stop();
     }
 
     bool SendMessage(const std::string &InMsg)
     {
-        std::lock_guard<std::mutex> lock(SendQueueGuard);
+        {
+            std::lock_guard<std::mutex> lock(SendQueueGuard);
+            SendindMessagesQueue.push(InMsg + "\n");
+        }
 
-        SendindMessagesQueue.push(InMsg + "\n");
+        Wake();
         return true;
     }
 
-    bool RecieveMessage(PipeCommand &OutMsg)
+    //Answers a command in the protocol it came in
+    bool SendReply(const PipeCommand &Command, const std::string &InMsg, bool IsError = false)
     {
-        std::lock_guard<std::mutex> lock(RecieveQueueGuard);
-
-        if(RecievedMessagesQueue.size() > 0)
         {
-            OutMsg = RecievedMessagesQueue.front();
-            RecievedMessagesQueue.pop();
-            return true;
+            std::lock_guard<std::mutex> lock(SendQueueGuard);
+            SendindMessagesQueue.push(Command.FormatReply(InMsg, IsError));
         }
 
-        return false;
+        Wake();
+        return true;
+    }
+
+    bool RecieveMessage(PipeCommand &OutMsg)
+    {
+        return m_Inbox->Pop(OutMsg);
     }
 
     //Fast command grabber on std::move semantic, to grab all messages an release mutex fast;
     void GetAllRecieved(std::queue<PipeCommand> &AllCommands)
     {
-        std::lock_guard<std::mutex> lock(RecieveQueueGuard);
+        m_Inbox->TakeAll(AllCommands);
+    }
 
-        if(RecievedMessagesQueue.size() > 0)
-        {
-            AllCommands = std::move(RecievedMessagesQueue);
-        }
+    //Blocks until at least one command arrived, then grabs them all
+    void WaitForRecieved(std::queue<PipeCommand> &AllCommands)
+    {
+        m_Inbox->WaitAll(AllCommands);
     }
 
     //File decriptor ping, kind of lol
@@ -184,43 +293,172 @@ public:
          return (fcntl(FD_1, F_GETFD) != -1 || errno != EBADF) && (fcntl(FD_2, F_GETFD) != -1 || errno != EBADF);
     }
 
+    //Sleeps in epoll_wait until the input pipe is readable, a message is queued (eventfd),
+    //the output pipe drains after being full, or shutdown is requested
     void Run() override
     {
-        while(true)
+        epoll_event Events[MaxEvents];
+
+        while(!m_Stopping)
         {
-            while (ssize_t ReadBytes = read(FD_1, RecieveBuffer, BUFFERSSIZE))
+            const int Count = epoll_wait(m_EpollFD, Events, MaxEvents, -1);
+
+            if(Count < 0)
             {
-                PipeCommand InputCommand;
+                if(errno == EINTR) continue;
 
-                if(ReadBytes > 0 && InputCommand.Deserialize(RecieveBuffer, ReadBytes))
-                {
-                    std::lock_guard<std::mutex> lock(RecieveQueueGuard);
+                PLOG_ERROR_(PipeLogger) << "epoll_wait failed: " << std::strerror(errno);
+                return;
+            }
 
-                    RecievedMessagesQueue.push(InputCommand);
-                    memset(RecieveBuffer, 0, BUFFERSSIZE);
+            for(int Index = 0; Index < Count; ++Index)
+            {
+                if(Events[Index].data.fd == FD_1)
+                {
+                    ReadCommands();
                 }
+                else if(Events[Index].data.fd == m_WakeFD)
+                {
+                    uint64_t Counter = 0;
+                    while(read(m_WakeFD, &Counter, sizeof (Counter)) > 0) {}
+                }
+            }
 
-                break;
-            };
+            WriteMessages();
+        }
+    }
+
+private:
+
+    static constexpr int MaxEvents = 8;
+
+    void Wake()
+    {
+        const uint64_t One = 1;
+        if(write(m_WakeFD, &One, sizeof (One)) < 0 && errno != EAGAIN)
+        {
+            PLOG_WARNING_(PipeLogger) << "Failed to wake pipe loop: " << std::strerror(errno);
+        }
+    }
 
-            while (SendindMessagesQueue.size() > 0)
+    //Reads until the pipe is empty, straight into the receive buffer, and parses the complete messages in place
+    void ReadCommands()
+    {
+        std::vector<PipeCommand> Commands;
+        ssize_t ReadBytes = 0;
+
+        while((ReadBytes = read(FD_1, m_Input.Reserve(BUFFERSSIZE), BUFFERSSIZE)) > 0)
+        {
+            m_Input.Commit(ReadBytes);
+        }
+
+        bool Malformed = false;
+
+        const size_t Consumed = ParseWireMessages(m_Input.Data(), m_Input.Size(), [&Commands](const WireMessage &Message)
+        {
+            PipeCommand InputCommand;
+
+            //Unknown text lines are dropped as before, framed requests are always answered
+            if(InputCommand.FromWire(Message) || Message.Framed)
             {
-                const std::string MessageToSend = SendindMessagesQueue.front();
-                ssize_t BytesWrite = write(FD_2, static_cast<const void*>(MessageToSend.c_str()), MessageToSend.size());
+                Commands.push_back(std::move(InputCommand));
+            }
+        }, Malformed);
 
-                if(BytesWrite == MessageToSend.size())
-                {
-                    std::lock_guard<std::mutex> lock(SendQueueGuard);
+        m_Input.Consume(Consumed);
+
+        //A FIFO has no connection to drop, throw away what is buffered and resync on the next write
+        if(Malformed)
+        {
+            PLOG_WARNING_(PipeLogger) << "Malformed input on pipe, dropping " << m_Input.Size() << " bytes";
+            m_Input.Clear();
+        }
+
+        if(!Commands.empty())
+        {
+            m_Inbox->Push(Commands);
+        }
+    }
 
-                    SendindMessagesQueue.pop();
+    //Writes queued messages until done or the pipe is full, then waits for EPOLLOUT
+    void WriteMessages()
+    {
+        {
+            std::lock_guard<std::mutex> lock(SendQueueGuard);
+
+            while(SendindMessagesQueue.size() > 0)
+            {
+                m_Outgoing.push_back(std::move(SendindMessagesQueue.front()));
+                SendindMessagesQueue.pop();
+            }
+        }
+
+        while(m_Outgoing.size() > 0)
+        {
+            const std::string &MessageToSend = m_Outgoing.front();
+            const ssize_t BytesWrite = write(FD_2, MessageToSend.data() + m_OutgoingOffset, MessageToSend.size() - m_OutgoingOffset);
+
+            if(BytesWrite < 0)
+            {
+                if(errno != EAGAIN && errno != EINTR)
+                {
+                    PLOG_WARNING_(PipeLogger) << "Failed to write output pipe: " << std::strerror(errno);
+                    m_Outgoing.pop_front();
+                    m_OutgoingOffset = 0;
                 }
-            };
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                break;
+            }
+
+            m_OutgoingOffset += static_cast<size_t>(BytesWrite);
+
+            if(m_OutgoingOffset == MessageToSend.size())
+            {
+                m_Outgoing.pop_front();
+                m_OutgoingOffset = 0;
+            }
         }
+
+        WatchOutputPipe(m_Outgoing.size() > 0);
     }
 
-private:
+    void WatchOutputPipe(bool Enable)
+    {
+        if(Enable == m_WatchingOutput)
+        {
+            return;
+        }
+
+        epoll_event Event = {};
+        Event.events = Enable ? static_cast<uint32_t>(EPOLLOUT) : 0u;
+        Event.data.fd = FD_2;
+
+        epoll_ctl(m_EpollFD, EPOLL_CTL_MOD, FD_2, &Event);
+        m_WatchingOutput = Enable;
+    }
+
+    void InitEventLoop()
+    {
+        m_EpollFD = epoll_create1(EPOLL_CLOEXEC);
+        m_WakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        epoll_event Event = {};
+
+        Event.events = EPOLLIN;
+        Event.data.fd = FD_1;
+        epoll_ctl(m_EpollFD, EPOLL_CTL_ADD, FD_1, &Event);
+
+        Event.events = EPOLLIN;
+        Event.data.fd = m_WakeFD;
+        epoll_ctl(m_EpollFD, EPOLL_CTL_ADD, m_WakeFD, &Event);
+
+        //Output is only watched while a message is stuck in a full pipe
+        Event.events = 0;
+        Event.data.fd = FD_2;
+        epoll_ctl(m_EpollFD, EPOLL_CTL_ADD, FD_2, &Event);
+
+        PLOG_ERROR_IF_(PipeLogger, m_EpollFD < 0 || m_WakeFD < 0) << "Failed to create pipe event loop: " << std::strerror(errno);
+    }
 
     void OpenPipes()
     {
@@ -268,6 +506,8 @@ private:
     {
         close(FD_1);
         close(FD_2);
+        close(m_WakeFD);
+        close(m_EpollFD);
     }
 
     void RemovePipeFiles()
@@ -278,28 +518,35 @@ private:
 
     void AllocateBuffers()
     {
-        RecieveBuffer = malloc(BUFFERSSIZE);
+        m_Input.Reserve(BUFFERSSIZE);
     }
 
     void FreeBuffers()
     {
-        if(RecieveBuffer) free(RecieveBuffer);
+        m_Input.Clear();
     }
 
 private:
 
     int FD_1 = -1, FD_2 = -1;
+    int m_EpollFD = -1, m_WakeFD = -1;
+    std::atomic<bool> m_Stopping{false};
 
     std::string m_PipeLocation = "";
     std::string m_InPipeName = "";
     std::string m_OutPipeName = "";
 
-    std::queue<PipeCommand> RecievedMessagesQueue;
+    CommandInbox m_OwnInbox;
+    CommandInbox *m_Inbox = &m_OwnInbox;
     std::queue<std::string> SendindMessagesQueue;
 
-    void *RecieveBuffer = nullptr;
+    //Owned by the loop thread: input not parsed yet, messages taken from the send queue
+    ReceiveBuffer m_Input;
+    std::deque<std::string> m_Outgoing;
+    size_t m_OutgoingOffset = 0;
+    bool m_WatchingOutput = false;
 
-    std::mutex  RecieveQueueGuard, SendQueueGuard;
+    std::mutex  SendQueueGuard;
 };
 
 #endif // PIPECOMMUNICATION_H
@@ -9,11 +9,18 @@
 #include <sys/stat.h>
 #include <syslog.h>
 
+#include <cstdint>
 #include <memory>
 
 #include <dbstorage.h>
+#include <balancesnapshot.h>
 #include <htttpcommunication.h>
 #include <pipecommunication.h>
+#include <socketcommunication.h>
+#include <blockscanner.h>
+#include <watchset.h>
+#include <addresspool.h>
+#include <rangewatcher.h>
 #include <timer.h>
 
 #include <btc/btc.h>
@@ -40,6 +47,16 @@ struct StartUpParameters
     std::string RpcPassword{};
     std::string CurlEndpoint{};
     std::string XpubAddress{};
+    size_t RpcConnections = 4;
+    bool UseRawBlocks = false;
+    size_t PrefetchBlocks = 128;
+    size_t DecodeThreads = 0;
+    size_t DbCacheMB = 100;
+    std::string SocketPath{};
+    size_t PoolLowWatermark = 100;
+    size_t PoolHighWatermark = 1000;
+    StorageProfile Storage{};
+    std::string SnapshotPath{};
 };
 
 //Standart demonize example, not all signals handled, but ok
@@ -97,7 +114,7 @@ class Processor
 {
 public:
 
-    Processor(const StartUpParameters &Params) : m_XpubAddress(Params.XpubAddress)
+    Processor(const StartUpParameters &Params)
     {
         PLOG_VERBOSE_(MainLogger) << "Processor init!";
 
@@ -124,204 +141,284 @@ private:
 
     void ExecutePipeCommands()
     {
-        assert(m_PipeCommunication);
-
         std::queue<PipeCommand> Commands;
-        PipeCommand Command;
-        m_PipeCommunication->GetAllRecieved(Commands);
+
+        //Blocks until the pipe or socket loop hands over a command or a range is done, no polling
+        m_Inbox.WaitAll(Commands);
+
+        //Held back commands are older than anything in this batch
+        ResumeRangeClients();
 
         while(Commands.size() > 0)
         {
-            Command = Commands.front();
+            ExecuteCommand(Commands.front());
+            Commands.pop();
+        }
+    }
 
-            if(StrToLower(Command.GetCommand()) == "generateaddress")
-            {
-                const std::string NewHdAddress = GenerateNewHdAddress();
-                const std::string NewRawAddress = ExtractRawAddressFromHd(NewHdAddress);
+    void ExecuteCommand(const PipeCommand &Command)
+    {
+        //Replies go out in request order, so a client waits for its running WatchRange before anything else
+        auto Waiting = m_RangeClients.find(Command.GetClientId());
 
-                PLOG_VERBOSE_(MainLogger) << "New derived HD: " << NewHdAddress;
-                PLOG_VERBOSE_(MainLogger) << "New raw address: " << NewRawAddress;
+        if(Waiting != m_RangeClients.end())
+        {
+            Waiting->second.push_back(Command);
+            return;
+        }
 
-                TxInfo CurrentInfo = GetCurrentBlockChainInfo();
+        //The parser normalizes command names to lower case
+        if(Command.GetCommand() == "generateaddress")
+        {
+            std::string NewRawAddress;
 
-                AddNewAddressToDatabase(NewRawAddress, CurrentInfo);
-                AddNewAddressToBitcoind(NewRawAddress);
-            }
-            else if(StrToLower(Command.GetCommand()) == "getbalance")
+            if(m_AddressPool->Pop(NewRawAddress))
             {
-                int Balance = 0;
-                if(GetBalance(Command.GetParameter(), Balance))
+                PLOG_VERBOSE_(MainLogger) << "New raw address: " << NewRawAddress;
+
+                //Socket clients and framed requests pipeline, so every request gets exactly one reply
+                if(Command.ExpectsReply())
                 {
-                    SendBalanceToOutPipe(Command.GetParameter(), Balance);
+                    SendReply(Command, "[ Address: " + NewRawAddress + " ]");
                 }
             }
-
-            Commands.pop();
+            else if(Command.ExpectsReply())
+            {
+                SendReply(Command, "[ Error: no address available ]", true);
+            }
         }
+        else if(Command.GetCommand() == "getbalance")
+        {
+            int64_t Balance = 0;
+            int Height = -1;
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if(GetBalance(Command.GetParameter(), Balance, Height))
+            {
+                SendBalanceToOutPipe(Command, Balance, Height);
+            }
+            else if(Command.ExpectsReply())
+            {
+                SendReply(Command, "[ Error: unknown address " + Command.GetParameter() + " ]", true);
+            }
+        }
+        else if(Command.GetCommand() == "getbalances")
+        {
+            SendBalances(Command);
+        }
+        else if(Command.GetCommand() == "watchrange")
+        {
+            m_RangeClients[Command.GetClientId()];
+            m_RangeWatcher->Submit(Command);
+        }
+        else if(Command.ExpectsReply())
+        {
+            SendReply(Command, "[ Error: unknown command ]", true);
+        }
     }
 
-    std::string GenerateNewHdAddress()
+    // Runs what clients sent while their range was running; a WatchRange among it holds the rest back again
+    void ResumeRangeClients()
     {
-        std::string GeneratedHdAddress{};
-        //Max HD address length, for not nulling this string from garbage symbols tailing \000
-        char GeneratedHd[112];
+        for(uint64_t ClientId : m_RangeWatcher->TakeFinished())
+        {
+            auto Waiting = m_RangeClients.find(ClientId);
 
-        //Just an m/i depth
-        std::string KeyPath = "m/" + std::to_string(CurrentGenerationDepth);
+            if(Waiting == m_RangeClients.end())
+            {
+                continue;
+            }
 
-        if (hd_derive(currentchain, m_XpubAddress.c_str(), KeyPath.c_str(), GeneratedHd, sizeof (GeneratedHd)))
-        {
-            GeneratedHdAddress = GeneratedHd;
-        }
-        CurrentGenerationDepth++;
+            std::deque<PipeCommand> Held = std::move(Waiting->second);
+            m_RangeClients.erase(Waiting);
 
-        return GeneratedHdAddress;
+            for(auto &Command : Held)
+            {
+                ExecuteCommand(Command);
+            }
+        }
     }
 
-    std::string ExtractRawAddressFromHd(const std::string &HdAddress)
+    void AddNewAddressToWatchSet(const std::string &NewAddress)
     {
-        std::string ExtractedAddress{};
-        //Max bitcoin raw address length, for not nulling this string from garbage symbols tailing \000
-        char ExtractedStr[35];
+        assert(m_WatchSet);
 
-        btc_hdnode node;
+        Hash160Key Key;
 
-        if (btc_hdnode_deserialize(HdAddress.c_str(), currentchain, &node))
+        if(AddressToHash160(NewAddress, currentchain, Key))
         {
-            btc_hdnode_get_p2pkh_address(&node, currentchain, ExtractedStr, sizeof(ExtractedStr));
-            ExtractedAddress = ExtractedStr;
+            m_WatchSet->Add(Key, NewAddress);
         }
-
-        return ExtractedAddress;
     }
 
-    TxInfo GetCurrentBlockChainInfo() const
+    // Fills the watch set from the address table once at startup
+    void LoadWatchSet()
     {
-        assert(m_HttpCommunication);
+        assert(m_DBStorage);
+        assert(m_WatchSet);
 
-        TxInfo ReturnValue;
-        m_HttpCommunication->GetCurrentBlockChainInfo(ReturnValue.m_LastScannedBlockNum);
+        std::vector<std::string> Addresses;
+        m_DBStorage->GetAllAddresses(Addresses);
 
-        return ReturnValue;
+        for(auto &Address : Addresses)
+        {
+            AddNewAddressToWatchSet(Address);
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Watch set loaded, addresses: " << m_WatchSet->Size();
     }
 
-    void AddNewAddressToDatabase(const std::string &NewAddress, TxInfo &CurrentTxInfo)
+    // Record, backfill state and cursor come from one committed view. Height is the last block the balance
+    // includes, -1 before the first scan.
+    bool GetBalance(const std::string &OnAddress, int64_t &Balance, int &Height)
     {
         assert(m_DBStorage);
 
-        PLOG_VERBOSE_(MainLogger) << "Adding new address to DB: " << NewAddress;
-        m_DBStorage->UpdateTxInfo(NewAddress, CurrentTxInfo);
-    }
+        const std::shared_ptr<const DBView> View = m_DBStorage->GetView();
+        TxInfo Info;
 
-    void AddNewAddressToBitcoind(const std::string &NewAddress)
-    {
-        assert(m_HttpCommunication);
+        if(m_DBStorage->GetTxInfo(OnAddress, Info, View.get()))
+        {
+            PLOG_VERBOSE_(MainLogger) << "Found balance on address: " << OnAddress;
+
+            Balance = ReportedBalance(Info, View->m_HasCursor ? &View->m_Cursor : nullptr, m_DBStorage->HasBackfill(OnAddress, View.get()));
+            Height = View->m_HasCursor ? View->m_Cursor.m_Height - 1 : -1;
+            return true;
+        }
 
-        PLOG_VERBOSE_(MainLogger) << "Adding new address to bitcoind: " << NewAddress;
-        m_HttpCommunication->AddNewAddress(NewAddress, BlockChainRescanNeeded);
+        return false;
     }
 
-    bool GetBalance(const std::string &OnAddress, int &Balance)
+    // One reply for the whole list, a line "<address> <balance>" per requested address in request order,
+    // "unknown" for addresses not in the database
+    void SendBalances(const PipeCommand &Command)
     {
         assert(m_DBStorage);
 
-        TxInfo Info;
+        const std::string List = Command.GetParameter();
+        std::vector<std::string> Addresses;
+
+        ForEachToken(List, [&Addresses](std::string_view Address) { Addresses.emplace_back(Address); });
+
+        //The whole reply is answered from one committed view
+        const std::shared_ptr<const DBView> View = m_DBStorage->GetView();
 
-        if(m_DBStorage->GetTxInfo(OnAddress, Info))
+        std::vector<TxInfo> Infos;
+        std::vector<char> Found, Backfilling;
+        const size_t FoundCount = m_DBStorage->GetTxInfos(Addresses, Infos, Found, &Backfilling, View.get());
+
+        //Read once for the whole request instead of once per address
+        const ScanCursor *Cursor = View->m_HasCursor ? &View->m_Cursor : nullptr;
+
+        std::string Reply;
+        Reply.reserve(Addresses.size() * 48);
+
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
         {
-            PLOG_VERBOSE_(MainLogger) << "Found balance on address: " << OnAddress;
-            Balance = Info.m_Balance;
-            return true;
+            if(Index > 0) Reply.push_back('\n');
+
+            Reply.append(Addresses[Index]).push_back(' ');
+
+            if(Found[Index])
+            {
+                Reply.append(std::to_string(ReportedBalance(Infos[Index], Cursor, Backfilling[Index] != 0)));
+            }
+            else
+            {
+                Reply.append("unknown");
+            }
         }
 
-        return false;
+        PLOG_VERBOSE_(MainLogger) << "Bulk balance query, addresses: " << Addresses.size() << ", found: " << FoundCount;
+
+        SendReply(Command, Reply);
     }
 
-    void SendBalanceToOutPipe(const std::string &Address, const int &Balance)
+    void SendBalanceToOutPipe(const PipeCommand &Command, int64_t Balance, int Height)
     {
-        assert(m_PipeCommunication);
+        SendReply(Command, "[ Address: " + Command.GetParameter() + " < > " + "Balance: " + std::to_string(Balance) + " < > Height: " + std::to_string(Height) + " ]");
+    }
 
-        m_PipeCommunication->SendMessage("[ Address: " + Address + " < > " + "Balance: " + std::to_string(Balance) + " ]");
+    // Answers on the channel and in the protocol the command came in
+    void SendReply(const PipeCommand &Command, const std::string &Message, bool IsError = false)
+    {
+        if(Command.GetClientId() == 0)
+        {
+            assert(m_PipeCommunication);
+            m_PipeCommunication->SendReply(Command, Message, IsError);
+        }
+        else if(m_SocketCommunication)
+        {
+            m_SocketCommunication->SendReply(Command, Message, IsError);
+        }
     }
 
     void UpdateDatabase()
     {
-        assert(m_DBStorage);
-        assert(m_HttpCommunication);
+        assert(m_BlockScanner);
 
-        const TxInfo *IterationInfo;
-        const std::string *IterationAddress;
-        std::string BlockHash;
-        Json::Value BlockInfoJson, TxInfoJson;
-        int CurrentBlockCountInt = 0, LastSavedBlockNum = 0, Balance = 0;
+        PLOG_VERBOSE_(MainLogger) << "Async DB update called";
+        m_BlockScanner->Scan();
 
-        m_HttpCommunication->GetCurrentBlockCount(CurrentBlockCountInt);
+        const auto Cache = m_DBStorage->GetBalanceCacheStats();
 
-        std::unordered_map<std::string, TxInfo> Updated;
-        std::vector<std::string> Addresses;
-        std::unique_ptr<leveldb::Iterator> DBIterator = m_DBStorage->GetDbIterator();
+        PLOG_VERBOSE_(MainLogger) << "Balance cache hits: " << Cache.Hits << ", misses: " << Cache.Misses << ", evictions: " << Cache.Evictions
+                                  << ", entries: " << Cache.Entries << "/" << Cache.Capacity;
 
-        //For each table entry
-        for (DBIterator->SeekToFirst(); DBIterator->Valid(); DBIterator->Next())
-        {
-           //Current key
-           IterationAddress = reinterpret_cast<const std::string*>(DBIterator->key().data());
-           //Current value
-           IterationInfo = reinterpret_cast<const TxInfo*>(DBIterator->value().data());
-
-           if(IterationInfo && IterationAddress)
-           {
-               LastSavedBlockNum = IterationInfo->m_LastScannedBlockNum;
-
-               //From last saved block num, to current local block num
-               for(int StartBlock = LastSavedBlockNum; StartBlock < CurrentBlockCountInt; ++StartBlock)
-               {
-                   //Getting block hash
-                   if(m_HttpCommunication->GetBlockHash(std::to_string(StartBlock), BlockHash))
-                   {
-                       //Getting full block info
-                        if(m_HttpCommunication->GetBlockInfo(BlockHash, BlockInfoJson))
-                        {
-                            //Parse block info json from root, at tx array
-                            for(auto &Tx : BlockInfoJson["tx"])
-                            {
-                                //Get full transaction info json
-                                if(m_HttpCommunication->GetRawTxInfo(Tx.asString(), TxInfoJson))
-                                {
-                                    //Not tested as for -txindex=1 consumed all space on debian virtual machine :D
-                                    Json::Value VoutRoot = BlockInfoJson["vout"];
-
-                                    for(auto &Address : VoutRoot["addresses"])
-                                    {
-                                        if(Address == *IterationAddress)
-                                        {
-                                            Json::Value Amount = VoutRoot["amount"];
-                                            Balance += Amount.asInt();
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                   }
-               }
-           }
-
-        Updated.insert(std::pair<std::string, TxInfo>(*IterationAddress, TxInfo(CurrentBlockCountInt, Balance)));
+        uint64_t Batches = 0, Groups = 0;
+        m_DBStorage->GetCommitStats(Batches, Groups);
 
+        PLOG_VERBOSE_(MainLogger) << "Database commits: " << Batches << " batches in " << Groups << " group writes";
+
+        if(!m_SnapshotPath.empty()) PublishSnapshot();
+    }
+
+    // Replicas map the file, a new one replaces it after a cycle in which the cursor moved, or addresses,
+    // balances or backfills changed without a new block. Handing out pooled addresses alone does not count.
+    void PublishSnapshot()
+    {
+        const std::shared_ptr<const DBView> View = m_DBStorage->GetView();
+
+        if(View->m_DataSequence == m_PublishedSequence)
+        {
+            return;
         }
 
-        PLOG_VERBOSE_(MainLogger) << "Async DB update called, num of records:" << Addresses.size();
-        m_DBStorage->UpdateTxInfos(Updated);
+        if(BalanceSnapshot::Publish(*m_DBStorage, *View, m_SnapshotPath))
+        {
+            m_PublishedSequence = View->m_DataSequence;
+        }
     }
 
     void Init(const StartUpParameters &Params)
     {
        if(Params.IsRegtest) currentchain = &btc_chainparams_regtest;
-       m_DBStorage = new DBStorage(Params.DatabaseLocation);
-       m_HttpCommunication = new HttpCommunication(Params.IsRegtest, Params.RpcLogin, Params.RpcPassword);
-       m_PipeCommunication = new PipeCommunication();
+       m_DBStorage = new DBStorage(Params.DatabaseLocation, Params.Storage, currentchain);
+       m_SnapshotPath = Params.SnapshotPath;
+
+       if(m_DBStorage->GetSchemaVersion() > DB_SCHEMA_VERSION)
+       {
+           PLOG_FATAL_(MainLogger) << "Database has schema " << m_DBStorage->GetSchemaVersion() << ", written by a newer version";
+           exit(EXIT_FAILURE);
+       }
+
+       if(m_DBStorage->NeedsMigration())
+       {
+           PLOG_FATAL_(MainLogger) << "Database has address records of an older schema, run once with -migrate";
+           exit(EXIT_FAILURE);
+       }
+
+       m_HttpCommunication = new HttpCommunication(Params.IsRegtest, Params.RpcLogin, Params.RpcPassword, Params.RpcConnections);
+       m_PipeCommunication = new PipeCommunication(&m_Inbox);
+       if(!Params.SocketPath.empty()) m_SocketCommunication = new SocketCommunication(Params.SocketPath, &m_Inbox);
+       m_WatchSet = new WatchSet();
+       m_BlockScanner = new BlockScanner(m_DBStorage, m_HttpCommunication, m_WatchSet, Params.UseRawBlocks, Params.PrefetchBlocks, Params.DecodeThreads, Params.DbCacheMB);
+
+       LoadWatchSet();
+
+       //Started after the watch set is loaded, refills add to it
+       m_RangeWatcher = new RangeWatcher(m_DBStorage, m_HttpCommunication, m_WatchSet, m_BlockScanner, currentchain, Params.XpubAddress, &m_Inbox,
+                                         [this](const PipeCommand &Command, const std::string &Message, bool IsError) { SendReply(Command, Message, IsError); });
+       m_AddressPool = new AddressPool(m_DBStorage, m_HttpCommunication, m_WatchSet, m_BlockScanner, currentchain, Params.XpubAddress, Params.PoolLowWatermark, Params.PoolHighWatermark);
     }
 
     void InitLogger()
@@ -331,8 +428,13 @@ private:
 
     void Dispose()
     {
+        if(m_AddressPool) delete m_AddressPool;
+        if(m_RangeWatcher) delete m_RangeWatcher;
+        if(m_BlockScanner) delete m_BlockScanner;
+        if(m_WatchSet) delete m_WatchSet;
         if(m_DBStorage) delete m_DBStorage;
         if(m_HttpCommunication) delete m_HttpCommunication;
+        if(m_SocketCommunication) delete m_SocketCommunication;
         if(m_PipeCommunication) delete m_PipeCommunication;
     }
 
@@ -341,13 +443,23 @@ private:
     DBStorage *m_DBStorage = nullptr;
     HttpCommunication *m_HttpCommunication = nullptr;
     PipeCommunication *m_PipeCommunication = nullptr;
+    SocketCommunication *m_SocketCommunication = nullptr;
+    BlockScanner *m_BlockScanner = nullptr;
+    WatchSet *m_WatchSet = nullptr;
+    AddressPool *m_AddressPool = nullptr;
+    RangeWatcher *m_RangeWatcher = nullptr;
 
-    Timer DBUpdater{std::chrono::seconds{60}, std::bind(&Processor::UpdateDatabase, this), true, true};
+    //Main thread only: clients with a WatchRange running and the commands they sent since
+    std::unordered_map<uint64_t, std::deque<PipeCommand>> m_RangeClients;
 
-    std::string m_XpubAddress{};
+    //Only touched by the database updater
+    std::string m_SnapshotPath;
+    uint64_t m_PublishedSequence = UINT64_MAX;
 
-    bool BlockChainRescanNeeded = false;
-    uint32_t CurrentGenerationDepth = 0;
+    //Shared by the pipe and the socket, so commands from both run on the main thread in arrival order
+    CommandInbox m_Inbox;
+
+    Timer DBUpdater{std::chrono::seconds{60}, std::bind(&Processor::UpdateDatabase, this), true, true};
 };
 
 #endif // PROCESSOR_H
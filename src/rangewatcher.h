@@ -0,0 +1,209 @@
+#ifndef RANGEWATCHER_H
+#define RANGEWATCHER_H
+
+#include <irunnable.h>
+#include <dbstorage.h>
+#include <blockscanner.h>
+#include <htttpcommunication.h>
+#include <pipecommunication.h>
+#include <wireprotocol.h>
+#include <watchset.h>
+#include <hdderiver.h>
+
+#include <btc/chainparams.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <loggerinstances.h>
+
+// Runs WatchRange commands on a thread of its own: a range of up to MaxWatchRange addresses takes seconds
+// to derive and store, the command thread keeps answering everyone else meanwhile.
+// Ranges run one at a time in submission order and reply when done. The clients they came from are
+// handed back through TakeFinished, the inbox is woken for that.
+class RangeWatcher : public IRunnable
+{
+public:
+
+    typedef std::function<void(const PipeCommand &Command, const std::string &Message, bool IsError)> ReplyHandler;
+
+    static constexpr uint32_t MaxWatchRange = 1000000;
+
+    RangeWatcher(DBStorage *Storage, HttpCommunication *Http, WatchSet *Watch, BlockScanner *Scanner, const btc_chainparams *Chain,
+                 const std::string &XpubAddress, CommandInbox *Inbox, ReplyHandler Reply)
+        : m_DBStorage(Storage),
+          m_HttpCommunication(Http),
+          m_WatchSet(Watch),
+          m_BlockScanner(Scanner),
+          m_Deriver(Chain, XpubAddress),
+          m_Inbox(Inbox),
+          m_Reply(Reply)
+    {
+        IRunnable::Start();
+    }
+
+    ~RangeWatcher() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+            m_Stopping = true;
+        }
+
+        m_Condition.notify_all();
+        IRunnable::WaitForCompletion();
+    }
+
+    void Submit(const PipeCommand &Command)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Guard);
+            m_Pending.push_back(Command);
+        }
+
+        m_Condition.notify_all();
+    }
+
+    // Clients whose range is answered since the last call, in completion order
+    std::vector<uint64_t> TakeFinished()
+    {
+        std::lock_guard<std::mutex> lock(m_Guard);
+
+        std::vector<uint64_t> Finished;
+        Finished.swap(m_Finished);
+
+        return Finished;
+    }
+
+    void Run() override
+    {
+        while(true)
+        {
+            PipeCommand Command;
+
+            {
+                std::unique_lock<std::mutex> lock(m_Guard);
+                m_Condition.wait(lock, [this] { return m_Stopping || !m_Pending.empty(); });
+
+                if(m_Stopping)
+                {
+                    return;
+                }
+
+                Command = std::move(m_Pending.front());
+                m_Pending.pop_front();
+            }
+
+            WatchRange(Command);
+
+            {
+                std::lock_guard<std::mutex> lock(m_Guard);
+                m_Finished.push_back(Command.GetClientId());
+            }
+
+            m_Inbox->Wake();
+        }
+    }
+
+private:
+
+    // Gap-limit lookahead: derives m/<branch>/<start..start+count-1> on all cores and watches it from the
+    // birth height (default: the current block), older heights are backfilled by the scanner.
+    // Only the watch set and the database are written, the scanner does not need bitcoind's wallet.
+    void WatchRange(const PipeCommand &Command)
+    {
+        std::vector<uint32_t> Arguments;
+        bool Parsed = true;
+
+        ForEachToken(Command.GetParameter(), [&Arguments, &Parsed](std::string_view Token)
+        {
+            char *End = nullptr;
+            const std::string Number(Token);
+            const unsigned long Value = strtoul(Number.c_str(), &End, 10);
+
+            Parsed = Parsed && *End == '\0' && Value <= UINT32_MAX;
+            Arguments.push_back(static_cast<uint32_t>(Value));
+        });
+
+        if(!Parsed || Arguments.size() < 3 || Arguments.size() > 4 || Arguments[2] == 0 || Arguments[2] > MaxWatchRange)
+        {
+            m_Reply(Command, "[ Error: usage WatchRange <branch> <start> <count up to " + std::to_string(MaxWatchRange) + "> [birth height] ]", true);
+            return;
+        }
+
+        const auto Started = std::chrono::steady_clock::now();
+
+        int BirthHeight = static_cast<int>(Arguments.size() == 4 ? Arguments[3] : 0);
+        std::vector<HdDeriver::DerivedAddress> Derived;
+
+        if((Arguments.size() < 4 && !m_HttpCommunication->GetCurrentBlockChainInfo(BirthHeight)) ||
+           !m_Deriver.DeriveRange(Arguments[0], Arguments[1], Arguments[2], Derived))
+        {
+            m_Reply(Command, "[ Error: failed to derive range ]", true);
+            return;
+        }
+
+        //Addresses stored already keep their records and backfills
+        std::vector<std::string> Addresses;
+        Addresses.reserve(Derived.size());
+
+        for(auto &Entry : Derived)
+        {
+            Addresses.push_back(Entry.Address);
+        }
+
+        std::vector<TxInfo> Infos;
+        std::vector<char> Stored;
+        m_DBStorage->GetTxInfos(Addresses, Infos, Stored);
+
+        std::vector<std::string> NewAddresses;
+        std::vector<Hash160Key> NewHashes;
+
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            if(Stored[Index])
+            {
+                m_WatchSet->Add(Derived[Index].Hash160, Derived[Index].Address);
+                continue;
+            }
+
+            NewAddresses.push_back(std::move(Addresses[Index]));
+            NewHashes.push_back(Derived[Index].Hash160);
+        }
+
+        //Stored and watched in step with the scanner, a scan running meanwhile leaves them to their backfill
+        if(!NewAddresses.empty() && !m_BlockScanner->AddNewAddresses(NewAddresses, NewHashes, BirthHeight))
+        {
+            m_Reply(Command, "[ Error: failed to store range ]", true);
+            return;
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Watching m/" << Arguments[0] << "/" << Arguments[1] << ".." << Arguments[1] + Arguments[2] - 1 << ", new: " << NewAddresses.size() << " in "
+                                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Started).count() << " ms";
+
+        m_Reply(Command, "[ Watching: " + std::to_string(Derived.size()) + " < > New: " + std::to_string(NewAddresses.size()) + " ]", false);
+    }
+
+private:
+
+    DBStorage *m_DBStorage = nullptr;
+    HttpCommunication *m_HttpCommunication = nullptr;
+    WatchSet *m_WatchSet = nullptr;
+    BlockScanner *m_BlockScanner = nullptr;
+    HdDeriver m_Deriver;
+
+    CommandInbox *m_Inbox = nullptr;
+    ReplyHandler m_Reply;
+
+    std::deque<PipeCommand> m_Pending;
+    std::vector<uint64_t> m_Finished;
+    bool m_Stopping = false;
+    std::mutex m_Guard;
+    std::condition_variable m_Condition;
+};
+
+#endif // RANGEWATCHER_H
@@ -0,0 +1,206 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+
+#include <balancesnapshot.h>
+#include <pipecommunication.h>
+#include <socketcommunication.h>
+#include <wireprotocol.h>
+#include <timer.h>
+
+#include <loggerinstances.h>
+
+// Read-only query process: answers balance queries on its own socket from the snapshot file the daemon
+// publishes, without opening the database. Any number of replicas can map the same file.
+class Replica
+{
+public:
+
+    Replica(const std::string &SnapshotPath, const std::string &SocketPath, const btc_chainparams *Chain)
+        : m_SnapshotPath(SnapshotPath),
+          m_Chain(Chain)
+    {
+        InitLogger();
+        Refresh();
+
+        m_SocketCommunication = new SocketCommunication(SocketPath, &m_Inbox);
+        MainLoop();
+    }
+
+    ~Replica()
+    {
+        if(m_SocketCommunication) delete m_SocketCommunication;
+    }
+
+private:
+
+    void MainLoop()
+    {
+        while(true)
+        {
+            ExecuteCommands();
+        }
+    }
+
+    void ExecuteCommands()
+    {
+        std::queue<PipeCommand> Commands;
+        PipeCommand Command;
+
+        m_Inbox.WaitAll(Commands);
+
+        //One snapshot for the whole batch, a swap in between is picked up by the next one
+        const std::shared_ptr<const BalanceSnapshot> Snapshot = GetSnapshot();
+
+        while(Commands.size() > 0)
+        {
+            Command = Commands.front();
+
+            if(!Snapshot)
+            {
+                SendReply(Command, "[ Error: no balance snapshot ]", true);
+            }
+            else if(Command.GetCommand() == "getbalance")
+            {
+                int64_t Balance = 0;
+
+                if(GetBalance(*Snapshot, Command.GetParameter(), Balance))
+                {
+                    SendReply(Command, "[ Address: " + Command.GetParameter() + " < > " + "Balance: " + std::to_string(Balance) + " < > Height: " + std::to_string(Snapshot->GetHeight()) + " ]");
+                }
+                else
+                {
+                    SendReply(Command, "[ Error: unknown address " + Command.GetParameter() + " ]", true);
+                }
+            }
+            else if(Command.GetCommand() == "getbalances")
+            {
+                SendBalances(*Snapshot, Command);
+            }
+            else
+            {
+                SendReply(Command, "[ Error: read-only replica ]", true);
+            }
+
+            Commands.pop();
+        }
+    }
+
+    bool GetBalance(const BalanceSnapshot &Snapshot, const std::string &Address, int64_t &Balance) const
+    {
+        std::string Key;
+        SnapshotRecord Record;
+
+        if(!AddressToKey(Address, m_Chain, Key) || !Snapshot.Find(Key, Record))
+        {
+            return false;
+        }
+
+        TxInfo Info;
+        Info.m_Balance = Record.Balance;
+        Info.m_BirthHeight = Record.BirthHeight;
+
+        ScanCursor Cursor;
+        Cursor.m_Height = Snapshot.GetHeader().CursorHeight;
+
+        Balance = ReportedBalance(Info, Snapshot.GetHeader().HasCursor ? &Cursor : nullptr, Record.Backfilling != 0);
+        return true;
+    }
+
+    // Same reply as the daemon's: a line "<address> <balance>" per requested address, "unknown" if missing
+    void SendBalances(const BalanceSnapshot &Snapshot, const PipeCommand &Command)
+    {
+        std::string Reply;
+
+        ForEachToken(Command.GetParameter(), [this, &Snapshot, &Reply](std::string_view Token)
+        {
+            const std::string Address(Token);
+            int64_t Balance = 0;
+
+            if(!Reply.empty()) Reply.push_back('\n');
+
+            Reply.append(Address).push_back(' ');
+            Reply.append(GetBalance(Snapshot, Address, Balance) ? std::to_string(Balance) : "unknown");
+        });
+
+        SendReply(Command, Reply);
+    }
+
+    void SendReply(const PipeCommand &Command, const std::string &Message, bool IsError = false)
+    {
+        if(Command.ExpectsReply())
+        {
+            m_SocketCommunication->SendReply(Command, Message, IsError);
+        }
+    }
+
+    std::shared_ptr<const BalanceSnapshot> GetSnapshot()
+    {
+        std::lock_guard<std::mutex> Lock(m_SnapshotMutex);
+        return m_Snapshot;
+    }
+
+    // Maps the file again once the daemon renamed a new one over it. The old mapping stays valid until
+    // the last batch holding it is done.
+    void Refresh()
+    {
+        struct stat Info;
+
+        if(stat(m_SnapshotPath.c_str(), &Info) != 0)
+        {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> Lock(m_SnapshotMutex);
+
+            if(m_Snapshot && m_Snapshot->GetInode() == Info.st_ino)
+            {
+                return;
+            }
+        }
+
+        std::shared_ptr<const BalanceSnapshot> Snapshot = BalanceSnapshot::Open(m_SnapshotPath);
+
+        if(!Snapshot)
+        {
+            PLOG_ERROR_(MainLogger) << "Balance snapshot " << m_SnapshotPath << " is not readable";
+            return;
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Balance snapshot mapped, height: " << Snapshot->GetHeight() << ", addresses: " << Snapshot->GetHeader().Count;
+
+        std::lock_guard<std::mutex> Lock(m_SnapshotMutex);
+        m_Snapshot = std::move(Snapshot);
+    }
+
+    void InitLogger()
+    {
+        //No pipe in this process to set up the logger the socket writes to
+        plog::init<MainLogger>(GLOBAL_LOG_SEVERITY, "replica.log");
+        plog::init<PipeLogger>(GLOBAL_LOG_SEVERITY, "replica-socket.log");
+    }
+
+private:
+
+    const std::string m_SnapshotPath;
+    const btc_chainparams *m_Chain;
+
+    SocketCommunication *m_SocketCommunication = nullptr;
+    CommandInbox m_Inbox;
+
+    std::mutex m_SnapshotMutex;
+    std::shared_ptr<const BalanceSnapshot> m_Snapshot;
+
+    Timer SnapshotWatcher{std::chrono::seconds{1}, std::bind(&Replica::Refresh, this), true, true};
+};
+
+#endif // REPLICA_H
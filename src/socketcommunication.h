@@ -0,0 +1,453 @@
+#ifndef SOCKETCOMMUNICATION_H
+#define SOCKETCOMMUNICATION_H
+
+#include <irunnable.h>
+#include <pipecommunication.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <loggerinstances.h>
+
+// Unix domain stream socket accepting the same commands as the FIFO (binary frames or text lines, see
+// wireprotocol.h), from any number of clients.
+// Each connection gets its own id, replies are queued per connection and written back in request order,
+// so a client may pipeline requests. One epoll loop serves all connections.
+// A client which sends faster than it reads is not read from while its unanswered requests or unsent
+// replies are over the limits below, the kernel socket buffer then pushes back on it.
+// Logs to PipeLogger, which PipeCommunication sets up.
+class SocketCommunication : public IRunnable
+{
+public:
+
+    SocketCommunication(const std::string &SocketPath, CommandInbox *Inbox)
+        : m_SocketPath(SocketPath),
+          m_Inbox(Inbox)
+    {
+        OpenSocket();
+        IRunnable::Start();
+    }
+
+    ~SocketCommunication() override
+    {
+        m_Stopping = true;
+        Wake();
+        IRunnable::WaitForCompletion();
+
+        CloseSocket();
+    }
+
+    // Queues the reply to a command on its connection, dropped when the client is gone
+    bool SendReply(const PipeCommand &Command, const std::string &InMsg, bool IsError = false)
+    {
+        std::string Reply = Command.FormatReply(InMsg, IsError);
+
+        {
+            std::lock_guard<std::mutex> lock(m_SendGuard);
+            m_PendingReplies.emplace_back(Command.GetClientId(), std::move(Reply));
+        }
+
+        Wake();
+        return true;
+    }
+
+    size_t GetClientCount() const
+    {
+        return m_ClientCount;
+    }
+
+    void Run() override
+    {
+        epoll_event Events[MaxEvents];
+
+        while(!m_Stopping)
+        {
+            const int Count = epoll_wait(m_EpollFD, Events, MaxEvents, -1);
+
+            if(Count < 0)
+            {
+                if(errno == EINTR) continue;
+
+                PLOG_ERROR_(PipeLogger) << "Socket epoll_wait failed: " << std::strerror(errno);
+                return;
+            }
+
+            for(int Index = 0; Index < Count; ++Index)
+            {
+                const uint64_t Id = Events[Index].data.u64;
+
+                if(Id == ListenerId)
+                {
+                    AcceptClients();
+                }
+                else if(Id == WakeId)
+                {
+                    uint64_t Counter = 0;
+                    while(read(m_WakeFD, &Counter, sizeof (Counter)) > 0) {}
+
+                    DispatchReplies();
+                }
+                else
+                {
+                    HandleClient(Id, Events[Index].events);
+                }
+            }
+        }
+    }
+
+private:
+
+    struct Client
+    {
+        uint64_t Id = 0;
+        int FD = -1;
+        ReceiveBuffer Input;
+        std::deque<std::string> Outgoing;
+        size_t OutgoingOffset = 0;
+        size_t OutgoingBytes = 0;
+
+        // Requests handed to the inbox and not answered yet
+        size_t InFlight = 0;
+
+        // The client shut down its sending side, it is dropped once everything is answered
+        bool ReadClosed = false;
+
+        uint32_t WatchedEvents = 0;
+    };
+
+    typedef std::unordered_map<uint64_t, Client>::iterator ClientIterator;
+
+    static constexpr int MaxEvents = 256;
+    static constexpr uint64_t ListenerId = 0;
+    static constexpr uint64_t WakeId = 1;
+
+    static constexpr size_t MaxInFlight = 1024;
+    static constexpr size_t MaxOutgoingBytes = 4 * 1048576;
+
+    static bool IsBackedUp(const Client &Connection, size_t Reading = 0)
+    {
+        return Connection.InFlight + Reading >= MaxInFlight || Connection.OutgoingBytes >= MaxOutgoingBytes;
+    }
+
+    void Wake()
+    {
+        const uint64_t One = 1;
+        if(write(m_WakeFD, &One, sizeof (One)) < 0 && errno != EAGAIN)
+        {
+            PLOG_WARNING_(PipeLogger) << "Failed to wake socket loop: " << std::strerror(errno);
+        }
+    }
+
+    void AcceptClients()
+    {
+        while(true)
+        {
+            const int ClientFD = accept4(m_ListenFD, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if(ClientFD < 0)
+            {
+                PLOG_WARNING_IF_(PipeLogger, errno != EAGAIN && errno != EINTR) << "Socket accept failed: " << std::strerror(errno);
+                return;
+            }
+
+            const uint64_t Id = m_NextClientId++;
+            Client &Connection = m_Clients[Id];
+            Connection.Id = Id;
+            Connection.FD = ClientFD;
+            m_ClientCount = m_Clients.size();
+
+            Connection.WatchedEvents = EPOLLIN | EPOLLRDHUP;
+
+            epoll_event Event = {};
+            Event.events = Connection.WatchedEvents;
+            Event.data.u64 = Id;
+            epoll_ctl(m_EpollFD, EPOLL_CTL_ADD, ClientFD, &Event);
+
+            PLOG_VERBOSE_(PipeLogger) << "Socket client " << Id << " connected";
+        }
+    }
+
+    void HandleClient(uint64_t Id, uint32_t Events)
+    {
+        auto Found = m_Clients.find(Id);
+
+        if(Found == m_Clients.end())
+        {
+            return;
+        }
+
+        if(Events & (EPOLLERR | EPOLLHUP))
+        {
+            DropClient(Found);
+            return;
+        }
+
+        if((Events & (EPOLLIN | EPOLLRDHUP)) && !ReadCommands(Found->second))
+        {
+            DropClient(Found);
+            return;
+        }
+
+        Flush(Found);
+    }
+
+    // False when the client sent something that cannot be parsed
+    bool ReadCommands(Client &Connection)
+    {
+        std::vector<PipeCommand> Commands;
+        bool Malformed = false;
+
+        auto OnMessage = [&Commands, &Connection](const WireMessage &Message)
+        {
+            //Unknown commands go through the inbox as well, so their error reply keeps its place in the pipeline
+            PipeCommand InputCommand;
+            InputCommand.FromWire(Message);
+            InputCommand.SetClientId(Connection.Id);
+            Commands.push_back(std::move(InputCommand));
+        };
+
+        while(!Malformed && !IsBackedUp(Connection, Commands.size()))
+        {
+            const ssize_t ReadBytes = read(Connection.FD, m_ReadBuffer, sizeof (m_ReadBuffer));
+
+            if(ReadBytes <= 0)
+            {
+                Connection.ReadClosed = ReadBytes == 0 || (errno != EAGAIN && errno != EINTR);
+                break;
+            }
+
+            //Nothing pending: parse straight over the read buffer and keep only the incomplete tail
+            if(Connection.Input.Size() == 0)
+            {
+                const size_t Consumed = ParseWireMessages(m_ReadBuffer, ReadBytes, OnMessage, Malformed);
+                Connection.Input.Append(m_ReadBuffer + Consumed, ReadBytes - Consumed);
+            }
+            else
+            {
+                Connection.Input.Append(m_ReadBuffer, ReadBytes);
+                Connection.Input.Consume(ParseWireMessages(Connection.Input.Data(), Connection.Input.Size(), OnMessage, Malformed));
+            }
+        }
+
+        Connection.InFlight += Commands.size();
+
+        if(!Commands.empty())
+        {
+            m_Inbox->Push(Commands);
+        }
+
+        PLOG_WARNING_IF_(PipeLogger, Malformed) << "Socket client " << Connection.Id << " sent a malformed message, dropping it";
+
+        return !Malformed;
+    }
+
+    // Moves replies to their connections and writes only to the connections which got one
+    void DispatchReplies()
+    {
+        std::vector<std::pair<uint64_t, std::string>> Replies;
+
+        {
+            std::lock_guard<std::mutex> lock(m_SendGuard);
+            Replies.swap(m_PendingReplies);
+        }
+
+        std::vector<uint64_t> Touched;
+
+        for(auto &Reply : Replies)
+        {
+            auto Found = m_Clients.find(Reply.first);
+
+            if(Found == m_Clients.end())
+            {
+                continue;
+            }
+
+            if(Found->second.Outgoing.empty()) Touched.push_back(Reply.first);
+            if(Found->second.InFlight > 0) Found->second.InFlight--;
+
+            Found->second.OutgoingBytes += Reply.second.size();
+            Found->second.Outgoing.push_back(std::move(Reply.second));
+        }
+
+        for(auto Id : Touched)
+        {
+            auto Found = m_Clients.find(Id);
+
+            if(Found != m_Clients.end())
+            {
+                Flush(Found);
+            }
+        }
+    }
+
+    // Writes what the socket takes, then updates the watched events; drops the client when it is done or broken
+    void Flush(ClientIterator Found)
+    {
+        Client &Connection = Found->second;
+
+        if(!WriteReplies(Connection) || (Connection.ReadClosed && Connection.InFlight == 0 && Connection.Outgoing.empty()))
+        {
+            DropClient(Found);
+            return;
+        }
+
+        //Reading resumes here too, once enough replies are answered and written
+        const bool Reading = !Connection.ReadClosed && !IsBackedUp(Connection);
+        const uint32_t Events = (Reading ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u) |
+                                (Connection.Outgoing.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+
+        if(Events != Connection.WatchedEvents)
+        {
+            epoll_event Event = {};
+            Event.events = Events;
+            Event.data.u64 = Connection.Id;
+
+            epoll_ctl(m_EpollFD, EPOLL_CTL_MOD, Connection.FD, &Event);
+            Connection.WatchedEvents = Events;
+        }
+    }
+
+    // Writes until done or the socket buffer is full. False on a broken connection.
+    bool WriteReplies(Client &Connection)
+    {
+        while(!Connection.Outgoing.empty())
+        {
+            const std::string &Reply = Connection.Outgoing.front();
+            const ssize_t BytesWrite = send(Connection.FD, Reply.data() + Connection.OutgoingOffset, Reply.size() - Connection.OutgoingOffset, MSG_NOSIGNAL);
+
+            if(BytesWrite < 0)
+            {
+                return errno == EAGAIN || errno == EINTR;
+            }
+
+            Connection.OutgoingOffset += static_cast<size_t>(BytesWrite);
+            Connection.OutgoingBytes -= static_cast<size_t>(BytesWrite);
+
+            if(Connection.OutgoingOffset == Reply.size())
+            {
+                Connection.Outgoing.pop_front();
+                Connection.OutgoingOffset = 0;
+            }
+        }
+
+        return true;
+    }
+
+    void DropClient(ClientIterator Found)
+    {
+        PLOG_VERBOSE_(PipeLogger) << "Socket client " << Found->first << " disconnected";
+
+        epoll_ctl(m_EpollFD, EPOLL_CTL_DEL, Found->second.FD, nullptr);
+        close(Found->second.FD);
+
+        m_Clients.erase(Found);
+        m_ClientCount = m_Clients.size();
+    }
+
+    void OpenSocket()
+    {
+        m_EpollFD = epoll_create1(EPOLL_CLOEXEC);
+        m_WakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_ListenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        sockaddr_un Address = {};
+        Address.sun_family = AF_UNIX;
+
+        if(m_SocketPath.size() >= sizeof (Address.sun_path))
+        {
+            PLOG_FATAL_(PipeLogger) << "Socket path is too long: " << m_SocketPath;
+            return;
+        }
+
+        strncpy(Address.sun_path, m_SocketPath.c_str(), sizeof (Address.sun_path) - 1);
+
+        //Only a socket left over by an earlier run is replaced, never some other file at that path
+        struct stat Existing;
+
+        if(lstat(m_SocketPath.c_str(), &Existing) == 0)
+        {
+            if(!S_ISSOCK(Existing.st_mode))
+            {
+                PLOG_FATAL_(PipeLogger) << "Socket path exists and is not a socket: " << m_SocketPath;
+                return;
+            }
+
+            unlink(m_SocketPath.c_str());
+        }
+
+        //Owner only like the FIFOs, the daemon runs with umask 0. Narrowed around bind so there is no
+        //window in which the socket is open to everyone.
+        const mode_t PreviousMask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+        const bool Bound = bind(m_ListenFD, reinterpret_cast<sockaddr*>(&Address), sizeof (Address)) == 0;
+        umask(PreviousMask);
+
+        m_Bound = Bound;
+
+        if(!Bound || listen(m_ListenFD, SOMAXCONN) < 0)
+        {
+            PLOG_FATAL_(PipeLogger) << "Failed to listen on socket: " << m_SocketPath << std::endl << std::strerror(errno);
+            return;
+        }
+
+        epoll_event Event = {};
+
+        Event.events = EPOLLIN;
+        Event.data.u64 = ListenerId;
+        epoll_ctl(m_EpollFD, EPOLL_CTL_ADD, m_ListenFD, &Event);
+
+        Event.events = EPOLLIN;
+        Event.data.u64 = WakeId;
+        epoll_ctl(m_EpollFD, EPOLL_CTL_ADD, m_WakeFD, &Event);
+
+        PLOG_VERBOSE_(PipeLogger) << "Listening on socket: " << m_SocketPath;
+    }
+
+    void CloseSocket()
+    {
+        for(auto &Pair : m_Clients)
+        {
+            close(Pair.second.FD);
+        }
+
+        m_Clients.clear();
+
+        close(m_ListenFD);
+        close(m_WakeFD);
+        close(m_EpollFD);
+
+        if(m_Bound) unlink(m_SocketPath.c_str());
+    }
+
+private:
+
+    std::string m_SocketPath;
+    CommandInbox *m_Inbox = nullptr;
+
+    int m_EpollFD = -1, m_WakeFD = -1, m_ListenFD = -1;
+    bool m_Bound = false;
+    std::atomic<bool> m_Stopping{false};
+
+    // Owned by the loop thread, ids are never reused so late replies cannot reach a new client
+    std::unordered_map<uint64_t, Client> m_Clients;
+    uint64_t m_NextClientId = WakeId + 1;
+    std::atomic<size_t> m_ClientCount{0};
+    char m_ReadBuffer[65536];
+
+    std::vector<std::pair<uint64_t, std::string>> m_PendingReplies;
+    std::mutex m_SendGuard;
+};
+
+#endif // SOCKETCOMMUNICATION_H
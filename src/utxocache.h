@@ -0,0 +1,269 @@
+#ifndef UTXOCACHE_H
+#define UTXOCACHE_H
+
+#include <dbstorage.h>
+#include <watchset.h>
+
+#include <loggerinstances.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Write-back cache in front of the UTXO records of watched outputs, in the spirit of bitcoind's dbcache.
+// Changes stay in memory until the scanner commits them together with balances and the cursor; when the
+// cache grows past its budget the scanner commits early and clean entries are dropped.
+// Every input of every block is checked against it, a Bloom filter over all stored outpoints answers
+// nearly all of them without touching the map or the database.
+// Used by the commit stage only, no locking.
+class UtxoCache
+{
+public:
+
+    UtxoCache(DBStorage *Storage, size_t BudgetMB = 100)
+        : m_DBStorage(Storage),
+          m_BudgetBytes(BudgetMB * 1048576)
+    {
+    }
+
+    // Builds the filter from the stored records, once before the first scan
+    void Load()
+    {
+        if(m_Loaded)
+        {
+            return;
+        }
+
+        RebuildFilter(InitialFilterKeys);
+        m_Loaded = true;
+
+        PLOG_VERBOSE_(MainLogger) << "UTXO filter loaded, outputs: " << m_FilterKeys;
+    }
+
+    void Add(const std::string &Key, const UtxoEntry &Entry)
+    {
+        auto Found = m_Entries.find(Key);
+
+        if(Found == m_Entries.end())
+        {
+            Hash160Key FilterKey;
+            ToFilterKey(Key, FilterKey);
+
+            //A filter hit may be a stored record (a replayed block), only skip the delete when it surely is not
+            Found = m_Entries.emplace(Key, CachedUtxo()).first;
+            Found->second.Fresh = !m_Filter.MayContain(FilterKey.data());
+        }
+
+        Found->second.Entry = Entry;
+        Found->second.Dirty = true;
+        Found->second.Spent = false;
+
+        AddToFilter(Key);
+    }
+
+    // Looks the outpoint up in the cache, then in the database
+    bool Find(const std::string &Key, UtxoEntry &Entry)
+    {
+        Hash160Key FilterKey;
+        ToFilterKey(Key, FilterKey);
+
+        if(!m_Filter.MayContain(FilterKey.data()))
+        {
+            return false;
+        }
+
+        auto Found = m_Entries.find(Key);
+
+        if(Found == m_Entries.end())
+        {
+            CachedUtxo Loaded;
+
+            if(!m_DBStorage->GetUtxo(Key, Loaded.Entry))
+            {
+                return false;
+            }
+
+            Found = m_Entries.emplace(Key, Loaded).first;
+        }
+
+        Entry = Found->second.Entry;
+
+        return !Found->second.Spent;
+    }
+
+    // Outputs never written to the database just disappear, others leave a tombstone until the next commit
+    void Erase(const std::string &Key)
+    {
+        auto Found = m_Entries.find(Key);
+
+        if(Found == m_Entries.end())
+        {
+            return;
+        }
+
+        if(Found->second.Fresh)
+        {
+            m_Entries.erase(Found);
+            return;
+        }
+
+        Found->second.Spent = true;
+        Found->second.Dirty = true;
+    }
+
+    void GetChanges(UtxoChanges &Changes) const
+    {
+        for(auto &Pair : m_Entries)
+        {
+            if(!Pair.second.Dirty)
+            {
+                continue;
+            }
+
+            if(Pair.second.Spent)
+            {
+                Changes.Spent.push_back(Pair.first);
+            }
+            else
+            {
+                Changes.Added.emplace_back(Pair.first, Pair.second.Entry);
+            }
+        }
+    }
+
+    // Called once the changes are in the database
+    void Flushed()
+    {
+        for(auto Entry = m_Entries.begin(); Entry != m_Entries.end();)
+        {
+            if(Entry->second.Spent)
+            {
+                Entry = m_Entries.erase(Entry);
+                continue;
+            }
+
+            Entry->second.Dirty = false;
+            Entry->second.Fresh = false;
+            ++Entry;
+        }
+
+        //Everything left is clean, reloading on demand is cheaper than going over budget
+        if(IsOverBudget())
+        {
+            PLOG_VERBOSE_(MainLogger) << "UTXO cache over budget, dropping " << m_Entries.size() << " clean entries";
+            m_Entries.clear();
+        }
+    }
+
+    // Called when a commit failed: the database still holds the state before the pass, so every pending
+    // add and tombstone goes, and the filter is rebuilt from the stored records alone
+    void Discard()
+    {
+        m_Entries.clear();
+        RebuildFilter(InitialFilterKeys);
+
+        PLOG_WARNING_(MainLogger) << "UTXO cache discarded, outputs: " << m_FilterKeys;
+    }
+
+    bool IsOverBudget() const
+    {
+        return m_Entries.size() * EntryBytes > m_BudgetBytes;
+    }
+
+    size_t Size() const
+    {
+        return m_Entries.size();
+    }
+
+private:
+
+    struct CachedUtxo
+    {
+        UtxoEntry Entry;
+
+        // Differs from the database
+        bool Dirty = false;
+
+        // Not in the database at all
+        bool Fresh = false;
+
+        bool Spent = false;
+    };
+
+    // Rough heap cost of one map entry: node, bucket, the 42-byte key buffer and the value
+    static constexpr size_t EntryBytes = sizeof (std::pair<const std::string, CachedUtxo>) + 2 * sizeof (void*) + 48;
+
+    static constexpr size_t InitialFilterKeys = 4096;
+
+    // The txid is uniform, the output index is folded into the bytes the filter hashes
+    static void ToFilterKey(const std::string &Key, Hash160Key &FilterKey)
+    {
+        const uint8_t *TxId = reinterpret_cast<const uint8_t*>(Key.data()) + UTXO_KEY_PREFIX.size();
+        uint32_t Index = 0;
+
+        memcpy(FilterKey.data(), TxId, FilterKey.size());
+        memcpy(&Index, TxId + 32, sizeof (Index));
+
+        const uint64_t Mixed = (Index + 1) * 0x9E3779B97F4A7C15ULL;
+
+        for(int Byte = 0; Byte < 16; ++Byte)
+        {
+            FilterKey[Byte] ^= static_cast<uint8_t>(Mixed >> (8 * (Byte % 8)));
+        }
+    }
+
+    void AddToFilter(const std::string &Key)
+    {
+        Hash160Key FilterKey;
+        ToFilterKey(Key, FilterKey);
+
+        //Deleted outputs stay in the filter, it is rebuilt from live records whenever it fills up
+        if(++m_FilterKeys > m_FilterCapacity)
+        {
+            RebuildFilter(m_FilterCapacity * 2);
+            return;
+        }
+
+        m_Filter.Add(FilterKey.data());
+    }
+
+    void RebuildFilter(size_t Capacity)
+    {
+        std::vector<std::string> Keys;
+        m_DBStorage->GetUtxoKeys(Keys);
+
+        //Live entries may not be written yet whether they are fresh or not: a re-added output after a
+        //filter false positive or a disconnect is dirty but not fresh. Stored ones are added twice, harmless.
+        for(auto &Pair : m_Entries)
+        {
+            if(!Pair.second.Spent) Keys.push_back(Pair.first);
+        }
+
+        m_FilterCapacity = std::max(Capacity, Keys.size() * 2);
+        m_Filter.Reset(m_FilterCapacity);
+        m_FilterKeys = Keys.size();
+
+        for(auto &Key : Keys)
+        {
+            Hash160Key FilterKey;
+            ToFilterKey(Key, FilterKey);
+            m_Filter.Add(FilterKey.data());
+        }
+    }
+
+private:
+
+    DBStorage *m_DBStorage = nullptr;
+    size_t m_BudgetBytes = 0;
+    bool m_Loaded = false;
+
+    std::unordered_map<std::string, CachedUtxo> m_Entries;
+
+    BlockedBloomFilter m_Filter;
+    size_t m_FilterKeys = 0;
+    size_t m_FilterCapacity = 0;
+};
+
+#endif // UTXOCACHE_H
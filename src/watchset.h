@@ -0,0 +1,257 @@
+#ifndef WATCHSET_H
+#define WATCHSET_H
+
+#include <btc/btc.h>
+#include <btc/base58.h>
+#include <btc/chainparams.h>
+#include <btc/segwit_addr.h>
+
+#include <loggerinstances.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+
+typedef std::array<uint8_t, 20> Hash160Key;
+
+// Hash160 of a P2PKH/P2SH address or the program of a v0 P2WPKH address
+static bool AddressToHash160(const std::string &Address, const btc_chainparams *Chain, Hash160Key &Key)
+{
+    uint8_t Decoded[64];
+
+    //Version byte + hash160 + 4 checksum bytes
+    if(btc_base58_decode_check(Address.c_str(), Decoded, sizeof (Decoded)) == 25)
+    {
+        memcpy(Key.data(), Decoded + 1, Key.size());
+        return true;
+    }
+
+    int WitnessVersion = 0;
+    size_t ProgramSize = 0;
+
+    if(segwit_addr_decode(&WitnessVersion, Decoded, &ProgramSize, Chain->bech32_hrp, Address.c_str()) &&
+       WitnessVersion == 0 && ProgramSize == Key.size())
+    {
+        memcpy(Key.data(), Decoded, Key.size());
+        return true;
+    }
+
+    return false;
+}
+
+// Bloom filter split into cache line sized blocks: a key touches exactly one 64-byte block,
+// so a negative answer costs a single cache miss whatever the filter size.
+class BlockedBloomFilter
+{
+public:
+
+    void Reset(size_t ExpectedKeys)
+    {
+        size_t Blocks = 1;
+
+        while(Blocks * BlockBits < ExpectedKeys * BitsPerKey)
+        {
+            Blocks <<= 1;
+        }
+
+        m_Blocks.assign(Blocks, Block());
+        m_BlockMask = Blocks - 1;
+    }
+
+    void Add(const uint8_t *Key)
+    {
+        Block &Target = m_Blocks[BlockIndex(Key)];
+        uint32_t First, Step;
+        ProbeHashes(Key, First, Step);
+
+        for(uint32_t Probe = 0; Probe < Probes; ++Probe)
+        {
+            const uint32_t Bit = (First + Probe * Step) & (BlockBits - 1);
+            Target.Words[Bit >> 6] |= 1ULL << (Bit & 63);
+        }
+    }
+
+    bool MayContain(const uint8_t *Key) const
+    {
+        const Block &Target = m_Blocks[BlockIndex(Key)];
+        uint32_t First, Step;
+        ProbeHashes(Key, First, Step);
+
+        for(uint32_t Probe = 0; Probe < Probes; ++Probe)
+        {
+            const uint32_t Bit = (First + Probe * Step) & (BlockBits - 1);
+
+            if(!(Target.Words[Bit >> 6] & (1ULL << (Bit & 63))))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+
+    struct alignas(64) Block
+    {
+        uint64_t Words[8] = {0};
+    };
+
+    static constexpr uint32_t BlockBits = 512;
+    static constexpr size_t BitsPerKey = 16;
+    static constexpr uint32_t Probes = 8;
+
+    // Hash160 is already uniform, the first 8 bytes pick the block and the next 8 the bits inside it
+    size_t BlockIndex(const uint8_t *Key) const
+    {
+        uint64_t Hash;
+        memcpy(&Hash, Key, sizeof (Hash));
+        return static_cast<size_t>(Hash ^ (Hash >> 32)) & m_BlockMask;
+    }
+
+    static void ProbeHashes(const uint8_t *Key, uint32_t &First, uint32_t &Step)
+    {
+        uint64_t Hash;
+        memcpy(&Hash, Key + 8, sizeof (Hash));
+
+        First = static_cast<uint32_t>(Hash);
+        Step = static_cast<uint32_t>(Hash >> 32) | 1;
+    }
+
+    std::vector<Block> m_Blocks{1};
+    size_t m_BlockMask = 0;
+};
+
+// In-memory set of watched hash160s, mapping them back to the address record in the database.
+// Lookups first hit the Bloom filter, nearly every output of a block is rejected there.
+class WatchSet
+{
+public:
+
+    WatchSet()
+    {
+        Rebuild(InitialCapacity);
+    }
+
+    // Returns false for already watched keys
+    bool Add(const Hash160Key &Key, const std::string &Address)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_Guard);
+
+        if(FindSlot(Key.data()) != EmptySlot)
+        {
+            return false;
+        }
+
+        //Keep the table at most half full, the filter is sized along with it
+        if((m_Keys.size() + 1) * 2 > m_Slots.size())
+        {
+            Rebuild(m_Slots.size() * 2);
+        }
+
+        m_Keys.push_back(Key);
+        m_Addresses.push_back(Address);
+        Insert(Key.data(), static_cast<uint32_t>(m_Keys.size()));
+
+        return true;
+    }
+
+    // Copies out the address watched under the hash, false when it is not ours
+    bool Find(const uint8_t *Hash160, std::string &Address) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_Guard);
+
+        if(!m_Filter.MayContain(Hash160))
+        {
+            return false;
+        }
+
+        const uint32_t Slot = FindSlot(Hash160);
+
+        if(Slot == EmptySlot)
+        {
+            return false;
+        }
+
+        Address = m_Addresses[m_Slots[Slot] - 1];
+        return true;
+    }
+
+    size_t Size() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_Guard);
+        return m_Keys.size();
+    }
+
+private:
+
+    static constexpr size_t InitialCapacity = 1024;
+    static constexpr uint32_t EmptySlot = UINT32_MAX;
+
+    static size_t SlotHash(const uint8_t *Hash160)
+    {
+        uint64_t Hash;
+        memcpy(&Hash, Hash160 + 12, sizeof (Hash));
+        return static_cast<size_t>(Hash);
+    }
+
+    // Linear probing, returns the slot index holding the key or EmptySlot
+    uint32_t FindSlot(const uint8_t *Hash160) const
+    {
+        const size_t Mask = m_Slots.size() - 1;
+
+        for(size_t Slot = SlotHash(Hash160) & Mask; m_Slots[Slot] != 0; Slot = (Slot + 1) & Mask)
+        {
+            if(memcmp(m_Keys[m_Slots[Slot] - 1].data(), Hash160, sizeof (Hash160Key)) == 0)
+            {
+                return static_cast<uint32_t>(Slot);
+            }
+        }
+
+        return EmptySlot;
+    }
+
+    // Slots hold key index + 1, 0 marks an empty slot
+    void Insert(const uint8_t *Hash160, uint32_t Entry)
+    {
+        const size_t Mask = m_Slots.size() - 1;
+        size_t Slot = SlotHash(Hash160) & Mask;
+
+        while(m_Slots[Slot] != 0)
+        {
+            Slot = (Slot + 1) & Mask;
+        }
+
+        m_Slots[Slot] = Entry;
+        m_Filter.Add(Hash160);
+    }
+
+    void Rebuild(size_t Capacity)
+    {
+        m_Slots.assign(Capacity, 0);
+        m_Filter.Reset(Capacity / 2);
+
+        for(size_t Index = 0; Index < m_Keys.size(); ++Index)
+        {
+            Insert(m_Keys[Index].data(), static_cast<uint32_t>(Index + 1));
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Watch set resized to " << Capacity << " slots";
+    }
+
+private:
+
+    std::vector<Hash160Key> m_Keys;
+    std::vector<std::string> m_Addresses;
+    std::vector<uint32_t> m_Slots;
+
+    BlockedBloomFilter m_Filter;
+
+    mutable std::shared_timed_mutex m_Guard;
+};
+
+#endif // WATCHSET_H
@@ -0,0 +1,313 @@
+#ifndef WIREPROTOCOL_H
+#define WIREPROTOCOL_H
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Command framing shared by the pipe and the socket.
+//
+// Binary frame, integers little-endian:
+//   uint8  Magic      0xB7, never the first byte of a text command
+//   uint32 Length     payload bytes
+//   uint8  Opcode
+//   uint32 RequestId  echoed back in the reply frame
+//   Payload           the parameter of a request (an address), the text of a reply
+//
+// GetBalances takes a list of addresses, separated by any text delimiter or newline.
+// WatchRange takes "<branch> <start> <count> [birth height]" the same way.
+//
+// Text compatibility mode is the old protocol, one command per line: "getbalance <address>\n".
+// Both can be mixed on one stream, the first byte of every message tells them apart.
+
+static constexpr uint8_t WIRE_MAGIC = 0xB7;
+static constexpr size_t WIRE_HEADER_SIZE = 10;
+static constexpr size_t WIRE_MAX_PAYLOAD = 1024 * 1024;
+
+// Text lines longer than this are treated as garbage
+static constexpr size_t WIRE_MAX_LINE = 64 * 1024;
+
+enum WireOpcode : uint8_t
+{
+    WIRE_OP_GENERATE_ADDRESS = 0x01,
+    WIRE_OP_GET_BALANCE = 0x02,
+    WIRE_OP_GET_BALANCES = 0x03,
+    WIRE_OP_WATCH_RANGE = 0x04,
+
+    WIRE_OP_REPLY = 0x80,
+    WIRE_OP_ERROR = 0x81
+};
+
+// One parsed request. Views point into the receive buffer and are valid until it is consumed.
+struct WireMessage
+{
+    bool Framed = false;
+    uint8_t Opcode = 0;
+    uint32_t RequestId = 0;
+
+    // Lower case for known commands, empty for an unknown opcode or a line that does not parse
+    std::string_view Command;
+    std::string_view Parameter;
+};
+
+static const char TEXT_DELIMETERS[] = " .,:;/\r\t\n";
+
+static inline uint32_t ReadLE32(const char *Data)
+{
+    const uint8_t *Bytes = reinterpret_cast<const uint8_t*>(Data);
+    return Bytes[0] | (Bytes[1] << 8) | (Bytes[2] << 16) | (static_cast<uint32_t>(Bytes[3]) << 24);
+}
+
+static inline void WriteLE32(char *Data, uint32_t Value)
+{
+    for(int Byte = 0; Byte < 4; ++Byte)
+    {
+        Data[Byte] = static_cast<char>(Value >> (8 * Byte));
+    }
+}
+
+static inline std::string_view OpcodeToCommand(uint8_t Opcode)
+{
+    switch(Opcode)
+    {
+    case WIRE_OP_GENERATE_ADDRESS: return "generateaddress";
+    case WIRE_OP_GET_BALANCE: return "getbalance";
+    case WIRE_OP_GET_BALANCES: return "getbalances";
+    case WIRE_OP_WATCH_RANGE: return "watchrange";
+    default: return std::string_view();
+    }
+}
+
+static inline bool IsListCommand(uint8_t Opcode)
+{
+    return Opcode == WIRE_OP_GET_BALANCES || Opcode == WIRE_OP_WATCH_RANGE;
+}
+
+static inline bool EqualsNoCase(std::string_view Token, std::string_view Lower)
+{
+    if(Token.size() != Lower.size())
+    {
+        return false;
+    }
+
+    for(size_t Index = 0; Index < Token.size(); ++Index)
+    {
+        if((Token[Index] | 0x20) != Lower[Index]) return false;
+    }
+
+    return true;
+}
+
+// Calls OnToken(std::string_view) for every non-empty token between delimiters
+template<typename Handler>
+void ForEachToken(std::string_view List, Handler &&OnToken)
+{
+    size_t Position = List.find_first_not_of(TEXT_DELIMETERS);
+
+    while(Position != std::string_view::npos)
+    {
+        const size_t End = std::min(List.find_first_of(TEXT_DELIMETERS, Position), List.size());
+
+        OnToken(List.substr(Position, End - Position));
+        Position = List.find_first_not_of(TEXT_DELIMETERS, End);
+    }
+}
+
+static inline std::string_view TrimDelimeters(std::string_view Token)
+{
+    const size_t Start = Token.find_first_not_of(TEXT_DELIMETERS);
+
+    if(Start == std::string_view::npos)
+    {
+        return std::string_view();
+    }
+
+    return Token.substr(Start, Token.find_last_not_of(TEXT_DELIMETERS) - Start + 1);
+}
+
+// The command is matched against the opcode names. Single-address commands take at most one more token,
+// list commands keep the rest of the line.
+static inline void ParseTextLine(std::string_view Line, WireMessage &Message)
+{
+    const size_t Start = Line.find_first_not_of(TEXT_DELIMETERS);
+
+    if(Start == std::string_view::npos)
+    {
+        return;
+    }
+
+    const size_t End = std::min(Line.find_first_of(TEXT_DELIMETERS, Start), Line.size());
+    const std::string_view Name = Line.substr(Start, End - Start);
+    const std::string_view Rest = TrimDelimeters(Line.substr(End));
+
+    for(uint8_t Opcode : {WIRE_OP_GENERATE_ADDRESS, WIRE_OP_GET_BALANCE, WIRE_OP_GET_BALANCES, WIRE_OP_WATCH_RANGE})
+    {
+        if(!EqualsNoCase(Name, OpcodeToCommand(Opcode)))
+        {
+            continue;
+        }
+
+        if(!IsListCommand(Opcode) && Rest.find_first_of(TEXT_DELIMETERS) != std::string_view::npos)
+        {
+            return;
+        }
+
+        Message.Opcode = Opcode;
+        Message.Command = OpcodeToCommand(Opcode);
+        Message.Parameter = Rest;
+        return;
+    }
+}
+
+// Walks the complete messages at the front of Data without copying, calls OnMessage(const WireMessage&)
+// for each one and returns the bytes consumed. The tail is an incomplete message, left for the next read.
+// Malformed is set when the stream cannot be resynchronized (oversized frame or line).
+template<typename Handler>
+size_t ParseWireMessages(const char *Data, size_t Size, Handler &&OnMessage, bool &Malformed)
+{
+    size_t Position = 0;
+    Malformed = false;
+
+    while(Position < Size)
+    {
+        const char *Begin = Data + Position;
+        const size_t Left = Size - Position;
+        WireMessage Message;
+
+        if(static_cast<uint8_t>(Begin[0]) == WIRE_MAGIC)
+        {
+            if(Left < WIRE_HEADER_SIZE)
+            {
+                break;
+            }
+
+            const uint32_t Length = ReadLE32(Begin + 1);
+
+            if(Length > WIRE_MAX_PAYLOAD)
+            {
+                Malformed = true;
+                break;
+            }
+
+            if(Left < WIRE_HEADER_SIZE + Length)
+            {
+                break;
+            }
+
+            Message.Framed = true;
+            Message.Opcode = static_cast<uint8_t>(Begin[5]);
+            Message.RequestId = ReadLE32(Begin + 6);
+            Message.Command = OpcodeToCommand(Message.Opcode);
+            Message.Parameter = std::string_view(Begin + WIRE_HEADER_SIZE, Length);
+
+            Position += WIRE_HEADER_SIZE + Length;
+        }
+        else
+        {
+            const char *LineEnd = static_cast<const char*>(memchr(Begin, '\n', Left));
+
+            if(!LineEnd)
+            {
+                Malformed = Left > WIRE_MAX_LINE;
+                break;
+            }
+
+            ParseTextLine(std::string_view(Begin, LineEnd - Begin), Message);
+            Position += LineEnd - Begin + 1;
+        }
+
+        OnMessage(static_cast<const WireMessage&>(Message));
+    }
+
+    return Position;
+}
+
+static inline void AppendFrame(std::string &Out, uint8_t Opcode, uint32_t RequestId, std::string_view Payload)
+{
+    char Header[WIRE_HEADER_SIZE];
+
+    Header[0] = static_cast<char>(WIRE_MAGIC);
+    WriteLE32(Header + 1, static_cast<uint32_t>(Payload.size()));
+    Header[5] = static_cast<char>(Opcode);
+    WriteLE32(Header + 6, RequestId);
+
+    Out.append(Header, sizeof (Header));
+    Out.append(Payload.data(), Payload.size());
+}
+
+// Receive buffer the channels read straight into; the parser works in place and only an incomplete
+// message at the tail is ever moved
+class ReceiveBuffer
+{
+public:
+
+    // Free space for at least Bytes at the tail, call Commit with what was actually read
+    char *Reserve(size_t Bytes)
+    {
+        if(m_Data.size() - m_End < Bytes)
+        {
+            if(m_Begin > 0)
+            {
+                memmove(m_Data.data(), m_Data.data() + m_Begin, m_End - m_Begin);
+                m_End -= m_Begin;
+                m_Begin = 0;
+            }
+
+            if(m_Data.size() - m_End < Bytes)
+            {
+                m_Data.resize(m_End + Bytes);
+            }
+        }
+
+        return m_Data.data() + m_End;
+    }
+
+    void Commit(size_t Bytes)
+    {
+        m_End += Bytes;
+    }
+
+    void Append(const char *Bytes, size_t Size)
+    {
+        if(Size > 0)
+        {
+            memcpy(Reserve(Size), Bytes, Size);
+            Commit(Size);
+        }
+    }
+
+    void Consume(size_t Bytes)
+    {
+        m_Begin += Bytes;
+
+        if(m_Begin == m_End)
+        {
+            m_Begin = m_End = 0;
+        }
+    }
+
+    void Clear()
+    {
+        m_Begin = m_End = 0;
+    }
+
+    const char *Data() const
+    {
+        return m_Data.data() + m_Begin;
+    }
+
+    size_t Size() const
+    {
+        return m_End - m_Begin;
+    }
+
+private:
+
+    std::vector<char> m_Data;
+    size_t m_Begin = 0, m_End = 0;
+};
+
+#endif // WIREPROTOCOL_H
@@ -0,0 +1,188 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <loggerinstances.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Thread pool where every worker owns a task deque. Workers take their own newest task first
+// (tasks spawned from a task stay cache-hot) and steal the oldest ones of other workers when idle,
+// so a big block split into chunks gets spread over all cores while small blocks run whole.
+class WorkStealingPool
+{
+public:
+
+    typedef std::function<void ()> Task;
+
+    WorkStealingPool(size_t Threads = 0)
+    {
+        if(Threads == 0)
+        {
+            Threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        for(size_t Index = 0; Index < Threads; ++Index)
+        {
+            m_Queues.emplace_back(new WorkerQueue());
+        }
+
+        for(size_t Index = 0; Index < Threads; ++Index)
+        {
+            m_Workers.emplace_back(&WorkStealingPool::WorkerLoop, this, Index);
+        }
+
+        PLOG_VERBOSE_(MainLogger) << "Work stealing pool started with " << Threads << " workers";
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_IdleGuard);
+            m_Stopped = true;
+        }
+
+        m_IdleCondition.notify_all();
+
+        for(auto &Worker : m_Workers)
+        {
+            Worker.join();
+        }
+    }
+
+    // Tasks submitted from a worker go to its own deque, others are spread round robin
+    void Submit(Task &&NewTask)
+    {
+        size_t Target = (CurrentPool() == this) ? CurrentWorker() : m_NextQueue++ % m_Queues.size();
+
+        //Counted before it is visible, so a worker taking it never sees the counter underflow
+        {
+            std::lock_guard<std::mutex> lock(m_IdleGuard);
+            m_Pending++;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_Queues[Target]->Guard);
+            m_Queues[Target]->Tasks.push_back(std::move(NewTask));
+        }
+
+        m_IdleCondition.notify_one();
+    }
+
+    size_t GetThreadCount() const
+    {
+        return m_Workers.size();
+    }
+
+private:
+
+    struct WorkerQueue
+    {
+        std::mutex Guard;
+        std::deque<Task> Tasks;
+    };
+
+    static WorkStealingPool *&CurrentPool()
+    {
+        static thread_local WorkStealingPool *Pool = nullptr;
+        return Pool;
+    }
+
+    static size_t &CurrentWorker()
+    {
+        static thread_local size_t Worker = 0;
+        return Worker;
+    }
+
+    void WorkerLoop(size_t Index)
+    {
+        CurrentPool() = this;
+        CurrentWorker() = Index;
+
+        Task NextTask;
+
+        while(true)
+        {
+            if(TakeOwn(Index, NextTask) || Steal(Index, NextTask))
+            {
+                NextTask();
+                NextTask = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_IdleGuard);
+            m_IdleCondition.wait(lock, [this] { return m_Stopped || m_Pending > 0; });
+
+            if(m_Stopped && m_Pending == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    // Newest own task, LIFO
+    bool TakeOwn(size_t Index, Task &Out)
+    {
+        WorkerQueue &Own = *m_Queues[Index];
+        std::lock_guard<std::mutex> lock(Own.Guard);
+
+        if(Own.Tasks.empty())
+        {
+            return false;
+        }
+
+        Out = std::move(Own.Tasks.back());
+        Own.Tasks.pop_back();
+        Taken();
+
+        return true;
+    }
+
+    // Oldest task of another worker, FIFO
+    bool Steal(size_t Index, Task &Out)
+    {
+        for(size_t Offset = 1; Offset < m_Queues.size(); ++Offset)
+        {
+            WorkerQueue &Victim = *m_Queues[(Index + Offset) % m_Queues.size()];
+            std::lock_guard<std::mutex> lock(Victim.Guard);
+
+            if(!Victim.Tasks.empty())
+            {
+                Out = std::move(Victim.Tasks.front());
+                Victim.Tasks.pop_front();
+                Taken();
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Taken()
+    {
+        std::lock_guard<std::mutex> lock(m_IdleGuard);
+        m_Pending--;
+    }
+
+private:
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_Queues;
+    std::vector<std::thread> m_Workers;
+    std::atomic<size_t> m_NextQueue{0};
+
+    // Tasks queued but not taken yet, idle workers sleep while it is zero
+    size_t m_Pending = 0;
+    bool m_Stopped = false;
+    std::mutex m_IdleGuard;
+    std::condition_variable m_IdleCondition;
+};
+
+#endif // WORKSTEALINGPOOL_H
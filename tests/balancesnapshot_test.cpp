@@ -0,0 +1,228 @@
+#include <balancesnapshot.h>
+
+#include "testcheck.h"
+
+static const btc_chainparams *Chain = &btc_chainparams_main;
+
+// P2PKH and P2SH addresses whose keys share long prefixes, so lookups go past the 8-byte prefix compare
+static std::string MakeAddress(uint32_t Seed, bool ScriptHash)
+{
+    std::string Key(1, static_cast<char>(ScriptHash ? ADDRESS_KEY_P2SH : ADDRESS_KEY_P2PKH));
+    std::string Address;
+
+    Key.append(8, '\x5A');
+
+    for(size_t Byte = 0; Byte < 12; ++Byte)
+    {
+        Key.push_back(static_cast<char>((Seed >> (8 * (Byte % 4))) + Byte));
+    }
+
+    CHECK(KeyToAddress(Key, Chain, Address));
+    return Address;
+}
+
+static bool SameAsDatabase(const DBStorage &Storage, const DBView &View, const BalanceSnapshot &Snapshot, const std::string &Address)
+{
+    std::string Key;
+    SnapshotRecord Record;
+    TxInfo Info;
+
+    if(!AddressToKey(Address, Chain, Key) || !Snapshot.Find(Key, Record) || !Storage.GetTxInfo(Address, Info, &View))
+    {
+        return false;
+    }
+
+    ScanCursor Cursor;
+    Cursor.m_Height = Snapshot.GetHeader().CursorHeight;
+
+    return ReportedBalance(TxInfo(Record.BirthHeight, Record.Balance), Snapshot.GetHeader().HasCursor ? &Cursor : nullptr, Record.Backfilling != 0) ==
+           ReportedBalance(Info, View.m_HasCursor ? &View.m_Cursor : nullptr, Storage.HasBackfill(Address, &View));
+}
+
+// Every count around the full levels of the implicit tree: each stored address is found with the balance
+// the daemon reports, keys next to them are not
+static void TestFind()
+{
+    for(uint32_t Count : { 0u, 1u, 2u, 3u, 4u, 5u, 7u, 8u, 9u, 15u, 16u, 17u, 31u, 32u, 33u, 100u, 1000u, 20000u })
+    {
+        const std::string Dir = MakeTestDir();
+
+        {
+            DBStorage Storage(Dir, StorageProfile(), Chain);
+            std::vector<std::string> Addresses;
+
+            for(uint32_t Index = 0; Index < Count; ++Index)
+            {
+                Addresses.push_back(MakeAddress(Index * 3, Index % 2));
+            }
+
+            CHECK(Addresses.empty() || Storage.AddNewAddresses(Addresses, 0));
+
+            std::unordered_map<std::string, TxInfo> Updated;
+
+            for(uint32_t Index = 0; Index < Count; Index += 2)
+            {
+                Updated[Addresses[Index]] = TxInfo(0, Index * 11);
+            }
+
+            ScanCursor Cursor;
+            Cursor.m_Height = 50;
+            CHECK(Storage.CommitScan(Updated, UtxoChanges(), UndoChanges(), Cursor));
+
+            //Addresses joining below the cursor are reported unscanned until their backfill is done
+            std::vector<std::string> Late;
+
+            for(uint32_t Index = 0; Index < Count / 10; ++Index)
+            {
+                Late.push_back(MakeAddress(Index * 3 + 1, false));
+            }
+
+            CHECK(Late.empty() || Storage.AddNewAddresses(Late, 10));
+
+            const std::shared_ptr<const DBView> View = Storage.GetView();
+            CHECK(BalanceSnapshot::Publish(Storage, *View, Dir + "snapshot"));
+
+            const std::shared_ptr<const BalanceSnapshot> Snapshot = BalanceSnapshot::Open(Dir + "snapshot");
+            CHECK(Snapshot);
+
+            if(!Snapshot)
+            {
+                continue;
+            }
+
+            CHECK(Snapshot->GetHeader().Count == Addresses.size() + Late.size());
+            CHECK(Snapshot->GetHeader().Sequence == View->m_Sequence);
+            CHECK(Snapshot->GetHeight() == 49);
+
+            bool AllFound = true, NoneFound = true;
+
+            for(auto *List : { &Addresses, &Late })
+            {
+                for(auto &Address : *List)
+                {
+                    AllFound = AllFound && SameAsDatabase(Storage, *View, *Snapshot, Address);
+                }
+            }
+
+            SnapshotRecord Record;
+
+            for(uint32_t Index = 0; Index < Count + 1; ++Index)
+            {
+                std::string Key;
+                CHECK(AddressToKey(MakeAddress(Index * 3 + 2, true), Chain, Key));
+                NoneFound = NoneFound && !Snapshot->Find(Key, Record);
+            }
+
+            if(!AllFound || !NoneFound) fprintf(stderr, "%u addresses\n", Count);
+
+            CHECK(AllFound);
+            CHECK(NoneFound);
+            CHECK(!Snapshot->Find("", Record));
+            CHECK(!Snapshot->Find(std::string(SNAPSHOT_KEY_SIZE + 1, '\x01'), Record));
+        }
+
+        RemoveTestDir(Dir);
+    }
+}
+
+// The daemon republishes on a new data sequence: adding addresses moves it without moving the cursor,
+// handing out pooled addresses only moves the HD index and leaves it alone
+static void TestSequenceFollowsAddresses()
+{
+    const std::string Dir = MakeTestDir();
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+
+        ScanCursor Cursor;
+        Cursor.m_Height = 20;
+        CHECK(Storage.UpdateCursor(Cursor));
+
+        const std::shared_ptr<const DBView> Before = Storage.GetView();
+        const std::string Address = MakeAddress(7, false);
+
+        CHECK(Storage.AddNewAddresses({ Address }, 20));
+
+        const std::shared_ptr<const DBView> After = Storage.GetView();
+        CHECK(After->m_Sequence != Before->m_Sequence && After->m_DataSequence != Before->m_DataSequence);
+        CHECK(After->m_Cursor.m_Height == Before->m_Cursor.m_Height);
+
+        CHECK(Storage.UpdateHdIndex(5));
+
+        const std::shared_ptr<const DBView> Popped = Storage.GetView();
+        CHECK(Popped->m_Sequence != After->m_Sequence && Popped->m_DataSequence == After->m_DataSequence);
+
+        CHECK(BalanceSnapshot::Publish(Storage, *After, Dir + "snapshot"));
+
+        const std::shared_ptr<const BalanceSnapshot> Snapshot = BalanceSnapshot::Open(Dir + "snapshot");
+        CHECK(Snapshot && Snapshot->GetHeader().Count == 1 && SameAsDatabase(Storage, *After, *Snapshot, Address));
+    }
+
+    RemoveTestDir(Dir);
+}
+
+// Bulk lookups report the pending backfills the single lookups do, from the cache and from the tables
+static void TestBulkBackfilling()
+{
+    const std::string Dir = MakeTestDir();
+    std::vector<std::string> Addresses;
+
+    for(uint32_t Index = 0; Index < 200; ++Index)
+    {
+        Addresses.push_back(MakeAddress(Index * 5, Index % 3 == 0));
+    }
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+
+        ScanCursor Cursor;
+        Cursor.m_Height = 30;
+        CHECK(Storage.UpdateCursor(Cursor));
+
+        //Every other address joins below the cursor
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            CHECK(Storage.AddNewAddresses({ Addresses[Index] }, Index % 2 ? 10 : 30));
+        }
+    }
+
+    for(int Round = 0; Round < 2; ++Round)
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+
+        //Warm half of the cache through single lookups on the second round
+        for(size_t Index = 0; Round == 1 && Index < Addresses.size(); Index += 2)
+        {
+            Storage.HasBackfill(Addresses[Index]);
+        }
+
+        std::vector<std::string> Query = Addresses;
+        Query.push_back(MakeAddress(999999, false));
+
+        std::vector<TxInfo> Infos;
+        std::vector<char> Found, Backfilling;
+
+        CHECK(Storage.GetTxInfos(Query, Infos, Found, &Backfilling) == Addresses.size());
+        CHECK(!Found.back() && !Backfilling.back());
+
+        bool AllMatch = true;
+
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            AllMatch = AllMatch && Found[Index] && (Backfilling[Index] != 0) == (Index % 2 == 1) && Storage.HasBackfill(Addresses[Index]) == (Index % 2 == 1);
+        }
+
+        CHECK(AllMatch);
+    }
+
+    RemoveTestDir(Dir);
+}
+
+int main()
+{
+    TestFind();
+    TestSequenceFollowsAddresses();
+    TestBulkBackfilling();
+
+    return TestResult("balancesnapshot_test");
+}
@@ -0,0 +1,400 @@
+#include <blockscanner.h>
+
+#include "testcheck.h"
+
+static const btc_chainparams *Chain = &btc_chainparams_main;
+
+class BlockScannerTest
+{
+public:
+
+    BlockScannerTest(DBStorage &Storage, WatchSet &Watch)
+        : m_Scanner(&Storage, nullptr, &Watch)
+    {
+        m_Scanner.m_Utxos.Load();
+    }
+
+    bool Connect(MatchedBlock Block, ScanPass &Pass)
+    {
+        return m_Scanner.ConnectBlock(Block, Pass);
+    }
+
+    bool Commit(int ScannedUpTo, ScanPass &Pass)
+    {
+        return m_Scanner.Commit(ScannedUpTo, Pass);
+    }
+
+    // Disconnects Count blocks below the stored cursor and commits the rewind
+    bool Rewind(DBStorage &Storage, int Count)
+    {
+        ScanCursor Cursor;
+        ScanPass Pass;
+
+        if(!Storage.GetCursor(Cursor))
+        {
+            return false;
+        }
+
+        for(int Block = 0; Block < Count; ++Block)
+        {
+            if(!m_Scanner.DisconnectTip(Cursor, Pass))
+            {
+                return false;
+            }
+        }
+
+        return m_Scanner.CommitRewind(Cursor, Pass);
+    }
+
+    bool AddNewAddresses(const std::vector<std::string> &Addresses, const std::vector<Hash160Key> &Hashes, int BirthHeight)
+    {
+        return m_Scanner.AddNewAddresses(Addresses, Hashes, BirthHeight);
+    }
+
+    void SetScanning(bool Scanning)
+    {
+        m_Scanner.SetScanning(Scanning);
+    }
+
+private:
+
+    BlockScanner m_Scanner;
+};
+
+struct TestAddress
+{
+    std::string Address;
+    Hash160Key Hash160;
+};
+
+static TestAddress MakeAddress(uint8_t Seed)
+{
+    TestAddress Result;
+    std::string Key(1, static_cast<char>(ADDRESS_KEY_P2PKH));
+
+    Key.append(20, static_cast<char>(Seed));
+
+    CHECK(KeyToAddress(Key, Chain, Result.Address));
+    CHECK(AddressToHash160(Result.Address, Chain, Result.Hash160));
+
+    return Result;
+}
+
+static Outpoint MakeOutpoint(uint8_t Tx, uint32_t Index)
+{
+    Outpoint Point;
+
+    memset(Point.TxId, Tx, sizeof (Point.TxId));
+    Point.Index = Index;
+
+    return Point;
+}
+
+static MatchedBlock MakeBlock(int Height, const std::string &Hash, const std::string &PrevHash)
+{
+    MatchedBlock Block;
+
+    Block.Height = Height;
+    Block.BlockHash = Hash;
+    Block.PrevBlockHash = PrevHash;
+
+    return Block;
+}
+
+static void Pay(MatchedBlock &Block, const TestAddress &To, int64_t Value, uint8_t Tx, uint32_t Index)
+{
+    const Outpoint Point = MakeOutpoint(Tx, Index);
+    MatchedOutput Output;
+
+    Output.Address = To.Address;
+    Output.Value = Value;
+    Output.UtxoKey = UtxoKey(Point.TxId, Point.Index);
+    memcpy(Output.Hash160, To.Hash160.data(), sizeof (Output.Hash160));
+
+    Block.Outputs.push_back(Output);
+}
+
+static void Spend(MatchedBlock &Block, uint8_t Tx, uint32_t Index)
+{
+    Block.Spends.push_back(MakeOutpoint(Tx, Index));
+}
+
+static int64_t BalanceOf(DBStorage &Storage, const TestAddress &Address)
+{
+    TxInfo Info;
+    return Storage.GetTxInfo(Address.Address, Info) ? Info.m_Balance : INT64_MIN;
+}
+
+static bool HasUtxo(DBStorage &Storage, uint8_t Tx, uint32_t Index)
+{
+    const Outpoint Point = MakeOutpoint(Tx, Index);
+    UtxoEntry Entry;
+
+    return Storage.GetUtxo(UtxoKey(Point.TxId, Point.Index), Entry);
+}
+
+// Five blocks with undo: outputs, spends of older blocks and of an output of the same branch
+static std::vector<MatchedBlock> MainChain(const TestAddress &A, const TestAddress &B)
+{
+    std::vector<MatchedBlock> Blocks;
+
+    Blocks.push_back(MakeBlock(0, "a0", ""));
+    Pay(Blocks.back(), A, 100, 1, 0);
+    Pay(Blocks.back(), B, 50, 1, 1);
+
+    Blocks.push_back(MakeBlock(1, "a1", "a0"));
+    Pay(Blocks.back(), A, 30, 2, 0);
+
+    Blocks.push_back(MakeBlock(2, "a2", "a1"));
+    Spend(Blocks.back(), 1, 0);
+    Pay(Blocks.back(), B, 7, 3, 0);
+
+    Blocks.push_back(MakeBlock(3, "a3", "a2"));
+    Pay(Blocks.back(), A, 1000, 4, 0);
+    Spend(Blocks.back(), 1, 1);
+
+    Blocks.push_back(MakeBlock(4, "a4", "a3"));
+    Spend(Blocks.back(), 4, 0);
+    Spend(Blocks.back(), 2, 0);
+    Pay(Blocks.back(), B, 5, 5, 0);
+
+    return Blocks;
+}
+
+// Disconnecting the last two blocks restores balances and outputs as of block 2, the other branch connects on top
+static void TestRewind()
+{
+    const std::string Dir = MakeTestDir();
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+        WatchSet Watch;
+        const TestAddress A = MakeAddress(1), B = MakeAddress(2);
+
+        Watch.Add(A.Hash160, A.Address);
+        Watch.Add(B.Hash160, B.Address);
+        CHECK(Storage.AddNewAddresses({ A.Address, B.Address }, 0));
+
+        BlockScannerTest Scanner(Storage, Watch);
+
+        {
+            ScanPass Pass;
+            Pass.UndoFrom = 0;
+
+            for(auto &Block : MainChain(A, B))
+            {
+                CHECK(Scanner.Connect(Block, Pass));
+            }
+
+            CHECK(Scanner.Commit(5, Pass));
+        }
+
+        CHECK(BalanceOf(Storage, A) == 0 && BalanceOf(Storage, B) == 12);
+        CHECK(!HasUtxo(Storage, 1, 0) && !HasUtxo(Storage, 1, 1) && !HasUtxo(Storage, 2, 0) && !HasUtxo(Storage, 4, 0));
+        CHECK(HasUtxo(Storage, 3, 0) && HasUtxo(Storage, 5, 0));
+
+        CHECK(Scanner.Rewind(Storage, 2));
+
+        ScanCursor Cursor;
+        BlockUndo Undo;
+
+        CHECK(Storage.GetCursor(Cursor) && Cursor.m_Height == 3 && strcmp(Cursor.m_BlockHash, "a2") == 0);
+        CHECK(BalanceOf(Storage, A) == 30 && BalanceOf(Storage, B) == 57);
+        CHECK(!HasUtxo(Storage, 1, 0) && HasUtxo(Storage, 1, 1) && HasUtxo(Storage, 2, 0) && HasUtxo(Storage, 3, 0));
+        CHECK(!HasUtxo(Storage, 4, 0) && !HasUtxo(Storage, 5, 0));
+        CHECK(Storage.GetUndo(2, Undo) && !Storage.GetUndo(3, Undo) && !Storage.GetUndo(4, Undo));
+
+        //The other branch spends an output the disconnected one had spent as well
+        {
+            ScanPass Pass;
+            Pass.UndoFrom = 0;
+            Pass.LastBlockHash = Cursor.m_BlockHash;
+
+            MatchedBlock Orphan = MakeBlock(3, "c3", "a1");
+            CHECK(!Scanner.Connect(Orphan, Pass));
+
+            MatchedBlock Block3 = MakeBlock(3, "b3", "a2");
+            Pay(Block3, A, 9, 6, 0);
+            Spend(Block3, 2, 0);
+
+            MatchedBlock Block4 = MakeBlock(4, "b4", "b3");
+            Pay(Block4, B, 1, 7, 0);
+
+            CHECK(Scanner.Connect(Block3, Pass) && Scanner.Connect(Block4, Pass));
+            CHECK(Scanner.Commit(5, Pass));
+        }
+
+        CHECK(Storage.GetCursor(Cursor) && Cursor.m_Height == 5 && strcmp(Cursor.m_BlockHash, "b4") == 0);
+        CHECK(BalanceOf(Storage, A) == 9 && BalanceOf(Storage, B) == 58);
+        CHECK(!HasUtxo(Storage, 2, 0) && HasUtxo(Storage, 6, 0) && HasUtxo(Storage, 7, 0));
+        CHECK(Storage.GetUndo(3, Undo) && strcmp(Undo.m_BlockHash, "b3") == 0);
+    }
+
+    RemoveTestDir(Dir);
+}
+
+// Backfill credits in blocks which still have undo records are disconnected with them, pending backfills
+// end at the rewound cursor
+static void TestRewindBackfill()
+{
+    const std::string Dir = MakeTestDir();
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+        WatchSet Watch;
+        const TestAddress A = MakeAddress(1), B = MakeAddress(2), C = MakeAddress(3), D = MakeAddress(4);
+
+        Watch.Add(A.Hash160, A.Address);
+        Watch.Add(B.Hash160, B.Address);
+        CHECK(Storage.AddNewAddresses({ A.Address, B.Address }, 0));
+
+        BlockScannerTest Scanner(Storage, Watch);
+
+        {
+            ScanPass Pass;
+            Pass.UndoFrom = 0;
+
+            for(auto &Block : MainChain(A, B))
+            {
+                CHECK(Scanner.Connect(Block, Pass));
+            }
+
+            CHECK(Scanner.Commit(5, Pass));
+        }
+
+        //Both join below the cursor, only C gets backfilled before the rewind
+        Watch.Add(C.Hash160, C.Address);
+        Watch.Add(D.Hash160, D.Address);
+        CHECK(Storage.AddNewAddresses({ C.Address }, 0));
+        CHECK(Storage.AddNewAddresses({ D.Address }, 1));
+
+        {
+            std::unordered_map<std::string, BackfillRange> Backfills;
+            CHECK(Storage.GetBackfills(Backfills) && Backfills.size() == 2);
+            Backfills.erase(D.Address);
+
+            ScanPass Pass;
+            Pass.Backfills = &Backfills;
+            Pass.UndoFrom = 0;
+
+            std::vector<MatchedBlock> Blocks = MainChain(A, B);
+            Pay(Blocks[1], C, 200, 8, 0);
+            Spend(Blocks[3], 8, 0);
+            Pay(Blocks[4], C, 300, 9, 0);
+
+            MatchedBlock Stale = Blocks[2];
+            Stale.BlockHash = "x2";
+
+            CHECK(Scanner.Connect(Blocks[0], Pass) && Scanner.Connect(Blocks[1], Pass));
+            CHECK(!Scanner.Connect(Stale, Pass));
+
+            for(size_t Height = 2; Height < Blocks.size(); ++Height)
+            {
+                CHECK(Scanner.Connect(Blocks[Height], Pass));
+            }
+
+            CHECK(Scanner.Commit(5, Pass));
+        }
+
+        BlockUndo Undo;
+
+        CHECK(BalanceOf(Storage, C) == 300 && !HasUtxo(Storage, 8, 0) && HasUtxo(Storage, 9, 0));
+        CHECK(!Storage.HasBackfill(C.Address) && Storage.HasBackfill(D.Address));
+        CHECK(Storage.GetUndo(4, Undo) && Undo.m_Created.size() == 2);
+
+        //The main pass balances are untouched by the backfill
+        CHECK(BalanceOf(Storage, A) == 0 && BalanceOf(Storage, B) == 12);
+
+        CHECK(Scanner.Rewind(Storage, 2));
+
+        CHECK(BalanceOf(Storage, A) == 30 && BalanceOf(Storage, B) == 57);
+        CHECK(BalanceOf(Storage, C) == 200 && HasUtxo(Storage, 8, 0) && !HasUtxo(Storage, 9, 0));
+
+        std::unordered_map<std::string, BackfillRange> Backfills;
+        CHECK(Storage.GetBackfills(Backfills) && Backfills.size() == 1);
+        CHECK(Backfills[D.Address].m_From == 1 && Backfills[D.Address].m_To == 3);
+    }
+
+    RemoveTestDir(Dir);
+}
+
+// Addresses joining while a scan runs are left out of its passes, their backfills end at each cursor it commits
+static void TestJoinDuringScan()
+{
+    const std::string Dir = MakeTestDir();
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+        WatchSet Watch;
+        const TestAddress A = MakeAddress(1), B = MakeAddress(2), C = MakeAddress(3), D = MakeAddress(4);
+
+        BlockScannerTest Scanner(Storage, Watch);
+        CHECK(Scanner.AddNewAddresses({ A.Address }, { A.Hash160 }, 0));
+
+        std::vector<MatchedBlock> Blocks = MainChain(A, B);
+        Pay(Blocks[3], C, 40, 8, 0);
+        Pay(Blocks[4], D, 60, 9, 0);
+
+        {
+            ScanPass Pass;
+            Pass.UndoFrom = 0;
+
+            CHECK(Scanner.Connect(Blocks[0], Pass) && Scanner.Connect(Blocks[1], Pass));
+            CHECK(Scanner.Commit(2, Pass));
+        }
+
+        Scanner.SetScanning(true);
+
+        {
+            ScanPass Pass;
+            Pass.UndoFrom = 0;
+            Pass.LastBlockHash = "a1";
+
+            //The pipeline has matched block 2 when B and C join, D joins above the blocks of the pass
+            CHECK(Scanner.Connect(Blocks[2], Pass));
+            CHECK(Scanner.AddNewAddresses({ B.Address, C.Address }, { B.Hash160, C.Hash160 }, 1));
+            CHECK(Scanner.AddNewAddresses({ D.Address }, { D.Hash160 }, 7));
+
+            std::unordered_map<std::string, BackfillRange> Backfills;
+            CHECK(Storage.GetBackfills(Backfills) && Backfills.size() == 2 && Backfills[C.Address].m_To == 2);
+
+            CHECK(Scanner.Connect(Blocks[3], Pass) && Scanner.Connect(Blocks[4], Pass));
+            CHECK(Scanner.Commit(5, Pass));
+        }
+
+        Scanner.SetScanning(false);
+
+        CHECK(BalanceOf(Storage, A) == 0 && BalanceOf(Storage, B) == 0 && BalanceOf(Storage, C) == 0 && BalanceOf(Storage, D) == 0);
+
+        std::unordered_map<std::string, BackfillRange> Backfills;
+        CHECK(Storage.GetBackfills(Backfills) && Backfills.size() == 2);
+        CHECK(Backfills[B.Address].m_From == 1 && Backfills[B.Address].m_To == 5);
+        CHECK(Backfills[C.Address].m_From == 1 && Backfills[C.Address].m_To == 5);
+        CHECK(!Storage.HasBackfill(D.Address));
+
+        //The next cycle joins nothing, its passes credit every watched address again
+        {
+            ScanPass Pass;
+            Pass.UndoFrom = 0;
+            Pass.LastBlockHash = "a4";
+
+            MatchedBlock Block5 = MakeBlock(5, "a5", "a4");
+            Pay(Block5, C, 3, 10, 0);
+
+            CHECK(Scanner.Connect(Block5, Pass) && Scanner.Commit(6, Pass));
+        }
+
+        CHECK(BalanceOf(Storage, C) == 3 && Storage.HasBackfill(C.Address));
+    }
+
+    RemoveTestDir(Dir);
+}
+
+int main()
+{
+    TestRewind();
+    TestRewindBackfill();
+    TestJoinDuringScan();
+
+    return TestResult("blockscanner_test");
+}
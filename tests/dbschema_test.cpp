@@ -0,0 +1,347 @@
+#include <dbstorage.h>
+
+#include "testcheck.h"
+
+static const btc_chainparams *Chain = &btc_chainparams_main;
+
+static std::vector<std::string> MakeAddresses(size_t Count)
+{
+    std::vector<std::string> Addresses;
+    std::string Address;
+
+    for(size_t Index = 0; Index < Count; ++Index)
+    {
+        std::string Key(1, static_cast<char>(Index % 2 ? ADDRESS_KEY_P2PKH : ADDRESS_KEY_P2WPKH));
+        uint64_t State = Index;
+
+        //splitmix64, every address distinct
+        for(size_t Byte = 0; Byte < 20; ++Byte)
+        {
+            uint64_t Mixed = (State += 0x9E3779B97F4A7C15ULL);
+            Mixed = (Mixed ^ (Mixed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            Mixed = (Mixed ^ (Mixed >> 27)) * 0x94D049BB133111EBULL;
+
+            Key.push_back(static_cast<char>(Mixed ^ (Mixed >> 31)));
+        }
+
+        if(KeyToAddress(Key, Chain, Address)) Addresses.push_back(Address);
+    }
+
+    return Addresses;
+}
+
+static std::string MakeUtxoKey(uint32_t Seed)
+{
+    uint8_t TxId[32];
+
+    for(size_t Index = 0; Index < sizeof (TxId); ++Index)
+    {
+        TxId[Index] = static_cast<uint8_t>(Seed * 31 + Index);
+    }
+
+    return UtxoKey(TxId, Seed);
+}
+
+static UtxoEntry MakeEntry(uint32_t Seed)
+{
+    UtxoEntry Entry;
+
+    for(size_t Index = 0; Index < sizeof (Entry.m_Hash160); ++Index)
+    {
+        Entry.m_Hash160[Index] = static_cast<uint8_t>(Seed + Index);
+    }
+
+    Entry.m_Value = 2100000000000000LL - Seed;
+    Entry.m_Height = static_cast<int>(Seed);
+    return Entry;
+}
+
+static bool SameEntry(const UtxoEntry &Left, const UtxoEntry &Right)
+{
+    return memcmp(Left.m_Hash160, Right.m_Hash160, sizeof (Left.m_Hash160)) == 0 && Left.m_Value == Right.m_Value && Left.m_Height == Right.m_Height;
+}
+
+static BlockUndo MakeUndo(int Height)
+{
+    BlockUndo Block;
+
+    Block.m_Height = Height;
+    snprintf(Block.m_BlockHash, sizeof (Block.m_BlockHash), "%064x", Height);
+    snprintf(Block.m_PrevBlockHash, sizeof (Block.m_PrevBlockHash), "%064x", Height - 1);
+
+    for(uint32_t Seed = 0; Seed < 3; ++Seed)
+    {
+        Block.m_Created.emplace_back(MakeUtxoKey(Height * 10 + Seed), MakeEntry(Height * 10 + Seed));
+    }
+
+    Block.m_Spent.emplace_back(MakeUtxoKey(Height * 10 + 9), MakeEntry(Height * 10 + 9));
+    return Block;
+}
+
+static bool SameUndo(const BlockUndo &Left, const BlockUndo &Right)
+{
+    bool Same = Left.m_Height == Right.m_Height && strcmp(Left.m_BlockHash, Right.m_BlockHash) == 0 &&
+                strcmp(Left.m_PrevBlockHash, Right.m_PrevBlockHash) == 0 &&
+                Left.m_Created.size() == Right.m_Created.size() && Left.m_Spent.size() == Right.m_Spent.size();
+
+    for(size_t Index = 0; Same && Index < Left.m_Created.size(); ++Index)
+    {
+        Same = Left.m_Created[Index].first == Right.m_Created[Index].first && SameEntry(Left.m_Created[Index].second, Right.m_Created[Index].second);
+    }
+
+    for(size_t Index = 0; Same && Index < Left.m_Spent.size(); ++Index)
+    {
+        Same = Left.m_Spent[Index].first == Right.m_Spent[Index].first && SameEntry(Left.m_Spent[Index].second, Right.m_Spent[Index].second);
+    }
+
+    return Same;
+}
+
+// Every proper prefix of a record is refused
+template<typename T>
+static bool RefusesTruncated(const std::string &Data)
+{
+    for(size_t Size = 0; Size < Data.size(); ++Size)
+    {
+        T Value;
+
+        if(Value.Deserialize(Slice(Data.data(), Size)))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void TestTxInfo()
+{
+    for(int64_t Balance : { int64_t(0), int64_t(-1), int64_t(1), INT64_MAX, INT64_MIN, int64_t(1) << 40 })
+    {
+        for(int BirthHeight : { 0, -5, 840000, INT_MAX, INT_MIN })
+        {
+            TxInfo Decoded;
+
+            CHECK(Decoded.Deserialize(TxInfo(BirthHeight, Balance).Serialize()));
+            CHECK(Decoded.m_BirthHeight == BirthHeight && Decoded.m_Balance == Balance);
+        }
+    }
+
+    CHECK(RefusesTruncated<TxInfo>(TxInfo(800000, 123456789).Serialize()));
+
+    //A later version appends fields, this one reads its own and skips the tail
+    std::string Extended = TxInfo(4, 9).Serialize();
+    Extended[0] = 2;
+    Extended += "\x05\x06";
+
+    TxInfo Decoded;
+    CHECK(Decoded.Deserialize(Extended) && Decoded.m_BirthHeight == 4 && Decoded.m_Balance == 9);
+    CHECK(!Decoded.Deserialize(std::string(1, '\0') + TxInfo(4, 9).Serialize().substr(1)));
+
+    //A birth height outside int is corrupt, not truncated
+    std::string Wide;
+    PutVarint(Wide, TxInfo::Version);
+    PutSignedVarint(Wide, int64_t(INT_MIN) - 1);
+    PutSignedVarint(Wide, 0);
+    CHECK(!Decoded.Deserialize(Wide));
+
+    //Schema 1 records: two raw ints, or nothing for a bare address
+    const int32_t Fields[2] = { 700000, 5000 };
+    CHECK(Decoded.DeserializeLegacy(Slice(reinterpret_cast<const char*>(Fields), sizeof (Fields))));
+    CHECK(Decoded.m_BirthHeight == 700000 && Decoded.m_Balance == 5000);
+    CHECK(Decoded.DeserializeLegacy(Slice()) && Decoded.m_BirthHeight == 0 && Decoded.m_Balance == -1);
+    CHECK(!Decoded.DeserializeLegacy(Slice("12345", 5)));
+}
+
+static void TestMetaRecords()
+{
+    ScanCursor Cursor, DecodedCursor;
+    Cursor.m_Height = 850000;
+    snprintf(Cursor.m_BlockHash, sizeof (Cursor.m_BlockHash), "%064x", 849999);
+
+    CHECK(DecodedCursor.Deserialize(Cursor.Serialize()));
+    CHECK(DecodedCursor.m_Height == 850000 && strcmp(DecodedCursor.m_BlockHash, Cursor.m_BlockHash) == 0);
+    CHECK(DecodedCursor.Deserialize(ScanCursor().Serialize()) && DecodedCursor.m_Height == 0 && DecodedCursor.m_BlockHash[0] == 0);
+    CHECK(RefusesTruncated<ScanCursor>(Cursor.Serialize()));
+
+    BackfillRange Range, DecodedRange;
+    Range.m_From = -1;
+    Range.m_To = INT_MAX;
+
+    CHECK(DecodedRange.Deserialize(Range.Serialize()) && DecodedRange.m_From == -1 && DecodedRange.m_To == INT_MAX);
+    CHECK(RefusesTruncated<BackfillRange>(Range.Serialize()));
+
+    //Heights outside int are corrupt, not truncated
+    std::string Wide;
+    PutVarint(Wide, BackfillRange::Version);
+    PutSignedVarint(Wide, int64_t(INT_MAX) + 1);
+    PutSignedVarint(Wide, 0);
+    CHECK(!DecodedRange.Deserialize(Wide));
+
+    const UtxoEntry Entry = MakeEntry(77);
+    UtxoEntry DecodedEntry;
+
+    CHECK(DecodedEntry.Deserialize(Entry.Serialize()) && SameEntry(DecodedEntry, Entry));
+    CHECK(RefusesTruncated<UtxoEntry>(Entry.Serialize()));
+
+    //No padding reaches the database: equal entries give equal bytes
+    CHECK(Entry.Serialize() == MakeEntry(77).Serialize());
+    CHECK(Entry.Serialize().size() < sizeof (UtxoEntry));
+
+    const BlockUndo Block = MakeUndo(123456);
+    BlockUndo DecodedBlock;
+
+    CHECK(DecodedBlock.Deserialize(Block.Serialize()) && SameUndo(DecodedBlock, Block));
+    CHECK(DecodedBlock.Deserialize(BlockUndo().Serialize()) && DecodedBlock.m_Created.empty() && DecodedBlock.m_Spent.empty());
+    CHECK(RefusesTruncated<BlockUndo>(Block.Serialize()));
+
+    //A corrupt count is refused before anything is allocated for it
+    std::string Huge;
+    PutVarint(Huge, BlockUndo::Version);
+    PutSignedVarint(Huge, 1);
+    PutVarint(Huge, 0);
+    PutVarint(Huge, 0);
+    PutVarint(Huge, UINT64_MAX / 2);
+    PutVarint(Huge, 0);
+    CHECK(!DecodedBlock.Deserialize(Huge));
+
+    uint32_t Index = 0;
+    CHECK(DecodeHdIndex(EncodeHdIndex(UINT32_MAX), Index) && Index == UINT32_MAX);
+    CHECK(DecodeHdIndex(EncodeHdIndex(42), Index) && Index == 42);
+    CHECK(!DecodeHdIndex(Slice(EncodeHdIndex(300).data(), 1), Index));
+}
+
+static void Write(const std::string &Dir, const std::vector<std::pair<std::string, std::string>> &Records)
+{
+    DB *Raw = nullptr;
+    Options RawOptions;
+    RawOptions.create_if_missing = true;
+
+    CHECK(DB::Open(RawOptions, Dir + "data", &Raw).ok());
+
+    for(auto &Record : Records)
+    {
+        Raw->Put(WriteOptions(), Record.first, Record.second);
+    }
+
+    delete Raw;
+}
+
+static void TestMigrateSchema1()
+{
+    const std::string Dir = MakeTestDir();
+    const std::vector<std::string> Addresses = MakeAddresses(25000);
+
+    std::vector<std::pair<std::string, std::string>> Records;
+
+    for(size_t Index = 0; Index < Addresses.size(); ++Index)
+    {
+        const int32_t Fields[2] = { static_cast<int32_t>(Index), static_cast<int32_t>(Index * 3) };
+        Records.emplace_back(Addresses[Index], std::string(reinterpret_cast<const char*>(Fields), sizeof (Fields)));
+    }
+
+    Records.emplace_back("1BoatSLRHtKNngkdXEeobR76b53LETtpyT", "");
+    Records.emplace_back("notanaddress", "12345678");
+    Write(Dir, Records);
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+        ScanCursor Cursor;
+
+        CHECK(Storage.NeedsMigration() && Storage.GetSchemaVersion() == 1);
+        CHECK(!Storage.GetCursor(Cursor));
+        CHECK(Storage.Migrate());
+        CHECK(!Storage.NeedsMigration() && Storage.GetSchemaVersion() == DB_SCHEMA_VERSION);
+
+        bool AllMigrated = true;
+
+        for(size_t Index = 0; Index < Addresses.size(); ++Index)
+        {
+            TxInfo Info;
+            AllMigrated = AllMigrated && Storage.GetTxInfo(Addresses[Index], Info) && Info.m_BirthHeight == static_cast<int>(Index) && Info.m_Balance == static_cast<int64_t>(Index) * 3;
+        }
+
+        CHECK(AllMigrated);
+
+        TxInfo Bare;
+        CHECK(Storage.GetTxInfo("1BoatSLRHtKNngkdXEeobR76b53LETtpyT", Bare) && Bare.m_Balance == -1 && Bare.m_BirthHeight == 0);
+
+        std::vector<std::string> All;
+        Storage.GetAllAddresses(All);
+        CHECK(All.size() == Addresses.size() + 1);
+
+        //Running it again finds nothing to do
+        CHECK(Storage.Migrate());
+    }
+
+    {
+        DBStorage Reopened(Dir, StorageProfile(), Chain);
+        TxInfo Info;
+
+        CHECK(!Reopened.NeedsMigration() && Reopened.GetSchemaVersion() == DB_SCHEMA_VERSION);
+        CHECK(Reopened.GetTxInfo(Addresses[42], Info) && Info.m_BirthHeight == 42 && Info.m_Balance == 126);
+    }
+
+    RemoveTestDir(Dir);
+}
+
+static void TestNewDatabase()
+{
+    const std::string Dir = MakeTestDir();
+    const std::vector<std::string> Addresses = MakeAddresses(10);
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+        CHECK(!Storage.NeedsMigration() && Storage.GetSchemaVersion() == DB_SCHEMA_VERSION);
+
+        ScanCursor Cursor;
+        Cursor.m_Height = 50;
+        strcpy(Cursor.m_BlockHash, "abc");
+
+        CHECK(Storage.UpdateCursor(Cursor));
+        CHECK(Storage.AddNewAddresses(Addresses, 20));
+        CHECK(Storage.UpdateHdIndex(77));
+    }
+
+    {
+        DBStorage Reopened(Dir, StorageProfile(), Chain);
+        ScanCursor Cursor;
+        uint32_t Index = 0;
+        std::unordered_map<std::string, BackfillRange> Backfills;
+
+        CHECK(!Reopened.NeedsMigration());
+        CHECK(Reopened.GetCursor(Cursor) && Cursor.m_Height == 50 && strcmp(Cursor.m_BlockHash, "abc") == 0);
+        CHECK(Reopened.GetHdIndex(Index) && Index == 77);
+        CHECK(Reopened.GetBackfills(Backfills) && Backfills.size() == Addresses.size() && Backfills[Addresses[0]].m_From == 20 && Backfills[Addresses[0]].m_To == 50);
+    }
+
+    RemoveTestDir(Dir);
+}
+
+// A database of a later schema is neither used nor touched
+static void TestNewerSchema()
+{
+    const std::string Dir = MakeTestDir();
+    std::string Schema;
+    PutVarint(Schema, DB_SCHEMA_VERSION + 1);
+    Write(Dir, { { SCHEMA_KEY, Schema } });
+
+    {
+        DBStorage Storage(Dir, StorageProfile(), Chain);
+        CHECK(Storage.GetSchemaVersion() == DB_SCHEMA_VERSION + 1 && !Storage.NeedsMigration());
+        CHECK(!Storage.Migrate());
+    }
+
+    RemoveTestDir(Dir);
+}
+
+int main()
+{
+    TestTxInfo();
+    TestMetaRecords();
+    TestMigrateSchema1();
+    TestNewDatabase();
+    TestNewerSchema();
+
+    return TestResult("dbschema_test");
+}
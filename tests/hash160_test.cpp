@@ -0,0 +1,105 @@
+#include <hash160.h>
+
+#include "testcheck.h"
+
+static void ReferenceHash160(const uint8_t *Message, size_t Size, uint8_t *Hash)
+{
+    uint8_t Digest[32];
+
+    sha256_Raw(Message, Size, Digest);
+    btc_ripemd160(Digest, 32, Hash);
+}
+
+// Sizes around every block boundary and batches which leave lanes idle, for each level and with and without
+// SHA-NI. Levels the CPU lacks fall back and are checked anyway.
+static void TestAgainstLibbtc()
+{
+    std::vector<uint8_t> Data(4096);
+
+    for(size_t Index = 0; Index < Data.size(); ++Index)
+    {
+        Data[Index] = static_cast<uint8_t>(Index * 131 + (Index >> 8));
+    }
+
+    for(HashLevel Level : {HashLevel::Scalar, HashLevel::Sse41, HashLevel::Avx2, HashLevel::Avx512})
+    {
+        for(bool UseShaNi : {false, true})
+        {
+            const HashKernels Kernels = GetHashKernels(Level, UseShaNi);
+
+            for(size_t Count : {1, 3, 4, 5, 8, 15, 16, 17, 33, 100})
+            {
+                std::vector<const uint8_t*> Messages(Count);
+                std::vector<size_t> Sizes(Count);
+
+                //Mixed sizes, so lanes are grouped by block count
+                for(size_t Index = 0; Index < Count; ++Index)
+                {
+                    Sizes[Index] = (Index * 37 + Count) % 200;
+                    Messages[Index] = Data.data() + Index * 13;
+                }
+
+                std::vector<std::array<uint8_t, 20>> Hashes(Count);
+                Hash160Many(Messages.data(), Sizes.data(), Count, reinterpret_cast<uint8_t (*)[20]>(Hashes.data()), Kernels);
+
+                bool Matches = true;
+
+                for(size_t Index = 0; Index < Count; ++Index)
+                {
+                    uint8_t Expected[20];
+                    ReferenceHash160(Messages[Index], Sizes[Index], Expected);
+
+                    Matches = Matches && memcmp(Expected, Hashes[Index].data(), 20) == 0;
+                }
+
+                if(!Matches) fprintf(stderr, "kernels %s, %zu messages\n", Kernels.Name, Count);
+                CHECK(Matches);
+            }
+
+            //Compressed and uncompressed public keys, the strided layout the callers use
+            for(size_t Size : {33, 65})
+            {
+                const size_t Count = 37;
+                std::vector<std::array<uint8_t, 20>> Hashes(Count);
+
+                Hash160Strided(Data.data(), Size, Size + 3, Count, reinterpret_cast<uint8_t (*)[20]>(Hashes.data()), Kernels);
+
+                bool Matches = true;
+
+                for(size_t Index = 0; Index < Count; ++Index)
+                {
+                    uint8_t Expected[20];
+                    ReferenceHash160(Data.data() + Index * (Size + 3), Size, Expected);
+
+                    Matches = Matches && memcmp(Expected, Hashes[Index].data(), 20) == 0;
+                }
+
+                CHECK(Matches);
+            }
+        }
+    }
+}
+
+static void TestKnownVector()
+{
+    //RIPEMD-160(SHA-256("")), as bitcoind computes it
+    static const uint8_t Expected[20] = { 0xb4, 0x72, 0xa2, 0x66, 0xd0, 0xbd, 0x89, 0xc1, 0x37, 0x06,
+                                          0xa4, 0x13, 0x2c, 0xcf, 0xb1, 0x6f, 0x7c, 0x3b, 0x9f, 0xcb };
+    const uint8_t Empty = 0;
+    const uint8_t *Message = &Empty;
+    const size_t Size = 0;
+    uint8_t Hash[1][20];
+
+    Hash160Many(&Message, &Size, 1, Hash);
+    CHECK(memcmp(Hash[0], Expected, sizeof (Expected)) == 0);
+}
+
+int main()
+{
+    printf("best kernels: %s\n", GetBestHashKernels().Name);
+
+    TestAgainstLibbtc();
+    TestKnownVector();
+
+    return TestResult("hash160_test");
+}
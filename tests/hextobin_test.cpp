@@ -0,0 +1,102 @@
+#include <blockdecoder.h>
+
+#include "testcheck.h"
+
+static std::string ToHex(const std::vector<uint8_t> &Bytes, bool Upper)
+{
+    const char *Digits = Upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    std::string Hex;
+
+    for(uint8_t Byte : Bytes)
+    {
+        Hex.push_back(Digits[Byte >> 4]);
+        Hex.push_back(Digits[Byte & 0x0F]);
+    }
+
+    return Hex;
+}
+
+// Every length crosses the 8-byte SSE2 steps and the scalar tail differently
+static void TestRoundTrip()
+{
+    for(size_t Size = 0; Size <= 70; ++Size)
+    {
+        std::vector<uint8_t> Bytes(Size);
+
+        for(size_t Index = 0; Index < Size; ++Index)
+        {
+            Bytes[Index] = static_cast<uint8_t>(Index * 37 + Size * 11);
+        }
+
+        for(bool Upper : {false, true})
+        {
+            std::vector<uint8_t> Decoded;
+
+            CHECK(HexToBin(ToHex(Bytes, Upper), Decoded));
+            CHECK(Decoded == Bytes);
+        }
+    }
+
+    std::vector<uint8_t> All(256);
+
+    for(size_t Index = 0; Index < All.size(); ++Index)
+    {
+        All[Index] = static_cast<uint8_t>(Index);
+    }
+
+    std::vector<uint8_t> Decoded;
+
+    CHECK(HexToBin(ToHex(All, false), Decoded) && Decoded == All);
+    CHECK(HexToBin(ToHex(All, true), Decoded) && Decoded == All);
+    CHECK(HexToBin("aBcDeF09", Decoded) && Decoded == std::vector<uint8_t>({0xAB, 0xCD, 0xEF, 0x09}));
+}
+
+// Characters next to the valid ranges, at every position of the vector part and of the tail
+static void TestInvalid()
+{
+    const char Neighbours[] = { '/', ':', '@', 'G', '`', 'g', ' ', '\0', static_cast<char>(0x80), static_cast<char>(0xC1), static_cast<char>(0xFF) };
+    const std::string Valid(40, 'a');
+    std::vector<uint8_t> Decoded;
+
+    for(size_t Position = 0; Position < Valid.size(); ++Position)
+    {
+        for(char Neighbour : Neighbours)
+        {
+            std::string Hex = Valid;
+            Hex[Position] = Neighbour;
+
+            CHECK(!HexToBin(Hex, Decoded));
+        }
+    }
+
+    CHECK(!HexToBin("abc", Decoded));
+    CHECK(!HexToBin(std::string(33, '0'), Decoded));
+}
+
+static void TestHashToHex()
+{
+    uint8_t Hash[32];
+
+    for(size_t Index = 0; Index < sizeof (Hash); ++Index)
+    {
+        Hash[Index] = static_cast<uint8_t>(Index);
+    }
+
+    std::vector<uint8_t> Decoded;
+    CHECK(HexToBin(HashToHex(Hash), Decoded));
+
+    //Shown byte reversed
+    for(size_t Index = 0; Index < sizeof (Hash); ++Index)
+    {
+        CHECK(Decoded[Index] == Hash[31 - Index]);
+    }
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestInvalid();
+    TestHashToHex();
+
+    return TestResult("hextobin_test");
+}
@@ -0,0 +1,52 @@
+#ifndef TESTCHECK_H
+#define TESTCHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+// Minimal checks for the test executables: failures are counted and reported, the test keeps going
+static int TestFailures = 0;
+
+#define CHECK(Condition) \
+    do \
+    { \
+        if(!(Condition)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #Condition); \
+            TestFailures++; \
+        } \
+    } while(0)
+
+static int TestResult(const char *Name)
+{
+    printf("%s: %s, %d failed checks\n", Name, TestFailures == 0 ? "passed" : "FAILED", TestFailures);
+    return TestFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Fresh directory for a test database, with the trailing slash DBStorage expects
+static std::string MakeTestDir()
+{
+    char Template[] = "/tmp/addrtestXXXXXX";
+
+    if(!mkdtemp(Template))
+    {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    return std::string(Template) + "/";
+}
+
+static void RemoveTestDir(const std::string &Dir)
+{
+    const std::string Command = "rm -rf '" + Dir + "'";
+
+    if(system(Command.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to remove %s\n", Dir.c_str());
+    }
+}
+
+#endif // TESTCHECK_H
@@ -0,0 +1,185 @@
+#include <utxocache.h>
+
+#include "testcheck.h"
+
+static std::string MakeKey(uint32_t Seed, uint32_t Index)
+{
+    //splitmix64, txids are uniform like real ones
+    uint64_t State = Seed;
+    uint8_t TxId[32];
+
+    for(size_t Word = 0; Word < sizeof (TxId) / 8; ++Word)
+    {
+        uint64_t Mixed = (State += 0x9E3779B97F4A7C15ULL);
+        Mixed = (Mixed ^ (Mixed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        Mixed = (Mixed ^ (Mixed >> 27)) * 0x94D049BB133111EBULL;
+        Mixed ^= Mixed >> 31;
+
+        memcpy(TxId + 8 * Word, &Mixed, sizeof (Mixed));
+    }
+
+    return UtxoKey(TxId, Index);
+}
+
+static UtxoEntry MakeEntry(int64_t Value)
+{
+    UtxoEntry Entry;
+    Entry.m_Hash160[0] = static_cast<uint8_t>(Value);
+    Entry.m_Value = Value;
+    Entry.m_Height = 7;
+    return Entry;
+}
+
+static void Commit(DBStorage &Storage, UtxoCache &Cache, int Height)
+{
+    UtxoChanges Changes;
+    Cache.GetChanges(Changes);
+
+    ScanCursor Cursor;
+    Cursor.m_Height = Height;
+
+    CHECK(Storage.CommitScan(std::unordered_map<std::string, TxInfo>(), Changes, UndoChanges(), Cursor));
+    Cache.Flushed();
+}
+
+// An output stored, spent and then added again (a disconnected block) is dirty but not fresh, the filter
+// still had its key so the cache could not tell it is gone from the database. A rebuild before the next
+// commit has to keep it, or its spend is never found.
+static void TestRebuildKeepsUnwrittenEntries()
+{
+    const std::string Dir = MakeTestDir();
+
+    {
+        DBStorage Storage(Dir);
+        UtxoCache Cache(&Storage);
+        UtxoEntry Found;
+
+        Cache.Load();
+
+        const std::string Readded = MakeKey(1, 0), Stored = MakeKey(2, 1);
+
+        Cache.Add(Readded, MakeEntry(100));
+        Cache.Add(Stored, MakeEntry(200));
+        Commit(Storage, Cache, 1);
+
+        Cache.Erase(Readded);
+        Commit(Storage, Cache, 2);
+        CHECK(!Storage.GetUtxo(Readded, Found));
+
+        Cache.Add(Readded, MakeEntry(100));
+
+        //Enough fresh outputs to fill the filter and force a rebuild while Readded is pending
+        std::vector<std::string> Fresh;
+
+        for(uint32_t Seed = 1000; Seed < 1000 + 10000; ++Seed)
+        {
+            Fresh.push_back(MakeKey(Seed, Seed % 3));
+            Cache.Add(Fresh.back(), MakeEntry(Seed));
+        }
+
+        CHECK(Cache.Find(Readded, Found) && Found.m_Value == 100);
+        CHECK(Cache.Find(Stored, Found) && Found.m_Value == 200);
+
+        bool AllFresh = true;
+
+        for(auto &Key : Fresh)
+        {
+            AllFresh = AllFresh && Cache.Find(Key, Found);
+        }
+
+        CHECK(AllFresh);
+
+        //The spend is debited and reaches the database
+        Cache.Erase(Readded);
+        CHECK(!Cache.Find(Readded, Found));
+        Commit(Storage, Cache, 3);
+        CHECK(!Storage.GetUtxo(Readded, Found));
+        CHECK(Storage.GetUtxo(Fresh.front(), Found));
+    }
+
+    RemoveTestDir(Dir);
+}
+
+// Everything stored survives a rebuild after the cache dropped its clean entries
+static void TestRebuildFromDatabase()
+{
+    const std::string Dir = MakeTestDir();
+
+    {
+        DBStorage Storage(Dir);
+        UtxoEntry Found;
+        std::vector<std::string> Keys;
+
+        {
+            UtxoCache Cache(&Storage);
+            Cache.Load();
+
+            for(uint32_t Seed = 0; Seed < 5000; ++Seed)
+            {
+                Keys.push_back(MakeKey(Seed, 0));
+                Cache.Add(Keys.back(), MakeEntry(Seed));
+            }
+
+            Commit(Storage, Cache, 1);
+        }
+
+        UtxoCache Reloaded(&Storage);
+        Reloaded.Load();
+
+        bool AllFound = true;
+
+        for(size_t Index = 0; Index < Keys.size(); ++Index)
+        {
+            AllFound = AllFound && Reloaded.Find(Keys[Index], Found) && Found.m_Value == static_cast<int64_t>(Index);
+        }
+
+        CHECK(AllFound);
+        CHECK(!Reloaded.Find(MakeKey(999999, 5), Found));
+    }
+
+    RemoveTestDir(Dir);
+}
+
+// After a failed commit the cache goes back to what is stored: pending outputs are gone, spent ones are back
+static void TestDiscard()
+{
+    const std::string Dir = MakeTestDir();
+
+    {
+        DBStorage Storage(Dir);
+        UtxoCache Cache(&Storage);
+        UtxoEntry Found;
+
+        Cache.Load();
+
+        const std::string Stored = MakeKey(1, 0), Pending = MakeKey(2, 0);
+
+        Cache.Add(Stored, MakeEntry(100));
+        Commit(Storage, Cache, 1);
+
+        Cache.Add(Pending, MakeEntry(200));
+        Cache.Erase(Stored);
+        CHECK(!Cache.Find(Stored, Found));
+
+        Cache.Discard();
+
+        CHECK(Cache.Size() == 0);
+        CHECK(Cache.Find(Stored, Found) && Found.m_Value == 100);
+        CHECK(!Cache.Find(Pending, Found));
+
+        UtxoChanges Changes;
+        Cache.GetChanges(Changes);
+        CHECK(Changes.Added.empty() && Changes.Spent.empty());
+    }
+
+    RemoveTestDir(Dir);
+}
+
+int main()
+{
+    TestRebuildKeepsUnwrittenEntries();
+    TestRebuildFromDatabase();
+    TestDiscard();
+
+    return TestResult("utxocache_test");
+}